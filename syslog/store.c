@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <antd/list.h>
+#include <antd/bst.h>
+#include <antd/utils.h>
+
+#include "../tunnel.h"
+#include "store.h"
+
+#define MODULE_NAME "syslogb"
+
+/** bytes appended between two index entries */
+#define STORE_INDEX_STEP (64u * 1024u)
+#define STORE_BUFF_SIZE (64u * 1024u)
+#define STORE_CHUNK_SIZE (BUFFLEN * 16)
+#define STORE_FRAME_SIZE (BUFFLEN * 16)
+#define STORE_MAX_RECORD (BUFFLEN * 4)
+/** bytes of segments a query reads in one step of the main loop */
+#define STORE_QUERY_BUDGET (STORE_CHUNK_SIZE * 8)
+
+/**
+ * @brief Record header on disk, followed by the record data
+ *
+ */
+typedef struct
+{
+    uint64_t time;
+    uint32_t size;
+    uint8_t severity;
+    uint8_t reserved[3];
+} store_record_h_t;
+
+/**
+ * @brief Sparse index entry: time of the first record
+ * stored at offset
+ */
+typedef struct
+{
+    uint64_t time;
+    uint32_t offset;
+    uint32_t reserved;
+} store_index_t;
+
+typedef struct
+{
+    char dir[MAX_CHANNEL_PATH];
+    char name[MAX_CHANNEL_NAME];
+    uint32_t segment_size;
+    unsigned int segments;
+    unsigned int first;
+    unsigned int seq;
+    int fd;
+    int ifd;
+    uint32_t size;
+    uint32_t indexed;
+    uint8_t buffer[STORE_BUFF_SIZE];
+    uint32_t buffered;
+} store_t;
+
+typedef struct
+{
+    uint16_t client_id;
+    uint64_t from;
+    uint64_t to;
+    uint8_t severity;
+    unsigned int seq;
+    int fd;
+    off_t offset;
+} store_query_t;
+
+static store_t store = {.fd = -1, .ifd = -1};
+static bst_node_t *queries = NULL;
+
+static uint64_t store_now()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + ts.tv_nsec / 1000000u;
+}
+
+static void store_file(char *buff, unsigned int seq, const char *ext)
+{
+    (void)snprintf(buff, BUFFLEN, "%s/%s.%u.%s", store.dir, store.name, seq, ext);
+}
+
+static int store_open_segment(unsigned int seq)
+{
+    char file[BUFFLEN];
+    struct stat st;
+    store_file(file, seq, "log");
+    store.fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (store.fd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to open segment %s: %s", file, strerror(errno));
+        return -1;
+    }
+    store_file(file, seq, "idx");
+    store.ifd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (store.ifd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to open index %s: %s", file, strerror(errno));
+        (void)close(store.fd);
+        store.fd = -1;
+        return -1;
+    }
+    store.size = 0;
+    if (fstat(store.fd, &st) == 0)
+    {
+        store.size = (uint32_t)st.st_size;
+    }
+    store.indexed = store.size;
+    store.seq = seq;
+    return 0;
+}
+
+static void store_close_segment()
+{
+    store_flush();
+    if (store.fd != -1)
+    {
+        (void)close(store.fd);
+        store.fd = -1;
+    }
+    if (store.ifd != -1)
+    {
+        (void)close(store.ifd);
+        store.ifd = -1;
+    }
+}
+
+static void store_rotate()
+{
+    char file[BUFFLEN];
+    store_close_segment();
+    if (store_open_segment(store.seq + 1) == -1)
+    {
+        return;
+    }
+    M_DEBUG(MODULE_NAME, "Log store rotated to segment %u", store.seq);
+    // remove the oldest segments
+    while (store.seq - store.first >= store.segments)
+    {
+        store_file(file, store.first, "log");
+        (void)unlink(file);
+        store_file(file, store.first, "idx");
+        (void)unlink(file);
+        store.first++;
+    }
+}
+
+int store_open(const char *dir, const char *name, uint32_t segment_size, unsigned int segments)
+{
+    DIR *d;
+    struct dirent *entry;
+    char *end;
+    unsigned long seq;
+    size_t len = strlen(name);
+    int found = 0;
+    (void)strncpy(store.dir, dir, sizeof(store.dir) - 1);
+    (void)strncpy(store.name, name, sizeof(store.name) - 1);
+    store.segment_size = segment_size;
+    store.segments = segments > 0 ? segments : 1;
+    store.first = 0;
+    store.seq = 0;
+    store.buffered = 0;
+    d = opendir(dir);
+    if (d == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to open log store %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    // resume from the existing segments
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strncmp(entry->d_name, name, len) != 0 || entry->d_name[len] != '.')
+        {
+            continue;
+        }
+        seq = strtoul(entry->d_name + len + 1, &end, 10);
+        if (end == entry->d_name + len + 1 || strcmp(end, ".log") != 0)
+        {
+            continue;
+        }
+        if (!found || seq < store.first)
+        {
+            store.first = (unsigned int)seq;
+        }
+        if (!found || seq > store.seq)
+        {
+            store.seq = (unsigned int)seq;
+        }
+        found = 1;
+    }
+    (void)closedir(d);
+    if (store_open_segment(store.seq) == -1)
+    {
+        return -1;
+    }
+    M_LOG(MODULE_NAME, "Log store %s/%s: segments %u to %u", dir, name, store.first, store.seq);
+    return 0;
+}
+
+void store_flush()
+{
+    int status;
+    uint32_t offset = 0;
+    while (store.fd != -1 && offset < store.buffered)
+    {
+        status = write(store.fd, store.buffer + offset, store.buffered - offset);
+        if (status == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            M_ERROR(MODULE_NAME, "Unable to write to log store: %s", strerror(errno));
+            break;
+        }
+        offset += status;
+    }
+    store.buffered = 0;
+}
+
+void store_append(const uint8_t *data, int size, uint8_t severity)
+{
+    store_record_h_t header;
+    store_index_t index;
+    uint32_t len;
+    if (store.fd == -1 || size <= 0)
+    {
+        return;
+    }
+    if (size > (int)STORE_MAX_RECORD)
+    {
+        size = STORE_MAX_RECORD;
+    }
+    len = sizeof(header) + size;
+    if (store.size > 0 && store.size + len > store.segment_size)
+    {
+        store_rotate();
+        if (store.fd == -1)
+        {
+            return;
+        }
+    }
+    (void)memset(&header, 0, sizeof(header));
+    header.time = store_now();
+    header.size = (uint32_t)size;
+    header.severity = severity;
+    if (store.size == 0 || store.size - store.indexed >= STORE_INDEX_STEP)
+    {
+        (void)memset(&index, 0, sizeof(index));
+        index.time = header.time;
+        index.offset = store.size;
+        if (write(store.ifd, &index, sizeof(index)) != (int)sizeof(index))
+        {
+            M_ERROR(MODULE_NAME, "Unable to write to log store index: %s", strerror(errno));
+        }
+        store.indexed = store.size;
+    }
+    if (store.buffered + len > sizeof(store.buffer))
+    {
+        store_flush();
+    }
+    (void)memcpy(store.buffer + store.buffered, &header, sizeof(header));
+    (void)memcpy(store.buffer + store.buffered + sizeof(header), data, size);
+    store.buffered += len;
+    store.size += len;
+}
+
+static void free_queries(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    (void)argv;
+    store_query_t *q = (store_query_t *)node->data;
+    if (q)
+    {
+        if (q->fd != -1)
+        {
+            (void)close(q->fd);
+        }
+        free(q);
+        node->data = NULL;
+    }
+}
+
+void store_close()
+{
+    store_close_segment();
+    bst_for_each(queries, free_queries, NULL, 0);
+    bst_free(queries);
+    queries = NULL;
+}
+
+/**
+ * @brief Read the index of a segment
+ *
+ * @param first time of the first record of the segment
+ * @param time lookup time
+ * @param offset offset of the last indexed record before time
+ * @return -1 if the segment has no index
+ */
+static int store_index_lookup(unsigned int seq, uint64_t time, uint64_t *first, uint32_t *offset)
+{
+    char file[BUFFLEN];
+    store_index_t index;
+    int ifd;
+    int ret = -1;
+    store_file(file, seq, "idx");
+    ifd = open(file, O_RDONLY);
+    if (ifd == -1)
+    {
+        return -1;
+    }
+    *offset = 0;
+    while (read(ifd, &index, sizeof(index)) == (int)sizeof(index))
+    {
+        if (ret == -1)
+        {
+            *first = index.time;
+            ret = 0;
+        }
+        if (index.time > time)
+        {
+            break;
+        }
+        *offset = index.offset;
+    }
+    (void)close(ifd);
+    return ret;
+}
+
+/**
+ * @brief Open the segment where a query should continue
+ *
+ * @return -1 when there is no more segment to read
+ */
+static int store_query_seek(store_query_t *q)
+{
+    char file[BUFFLEN];
+    uint64_t first, next;
+    uint32_t offset, next_offset;
+    if (q->fd != -1)
+    {
+        (void)close(q->fd);
+        q->fd = -1;
+    }
+    if (q->seq < store.first)
+    {
+        q->seq = store.first;
+    }
+    for (; q->seq <= store.seq; q->seq++)
+    {
+        if (store_index_lookup(q->seq, q->from, &first, &offset) == -1)
+        {
+            continue;
+        }
+        if (first > q->to)
+        {
+            return -1;
+        }
+        // skip the segment if the next one starts before the time range
+        if (q->seq < store.seq && store_index_lookup(q->seq + 1, q->from, &next, &next_offset) == 0 && next <= q->from)
+        {
+            continue;
+        }
+        store_file(file, q->seq, "log");
+        q->fd = open(file, O_RDONLY);
+        if (q->fd == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to open segment %s: %s", file, strerror(errno));
+            continue;
+        }
+        q->offset = offset;
+        return 0;
+    }
+    return -1;
+}
+
+static int store_query_send(int fd, store_query_t *q, uint8_t *frame, int size, int last)
+{
+    tunnel_msg_t msg;
+    frame[0] = STORE_CTRL_QUERY;
+    frame[1] = (uint8_t)last;
+    msg.header.type = CHANNEL_CTRL;
+    msg.header.channel_id = 0;
+    msg.header.client_id = q->client_id;
+    msg.header.size = size;
+    msg.data = frame;
+    if (msg_write(fd, &msg) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to send query result to client %d", q->client_id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fill one frame with the matching records of a query
+ * in format [code][last][4 bytes time][severity][2 bytes size][data]...
+ * At most STORE_QUERY_BUDGET bytes are read, the query then resumes
+ * from its saved segment and offset at the next step
+ *
+ * @return 1 when the query is finished
+ */
+static int store_query_batch(int fd, store_query_t *q)
+{
+    uint8_t chunk[STORE_CHUNK_SIZE];
+    uint8_t frame[STORE_FRAME_SIZE];
+    store_record_h_t header;
+    int frame_size = 2;
+    int status, offset;
+    uint32_t net32;
+    uint16_t net16;
+    int budget = STORE_QUERY_BUDGET;
+    while (1)
+    {
+        if (budget <= 0)
+        {
+            if (frame_size > 2)
+            {
+                return store_query_send(fd, q, frame, frame_size, 0) == -1 ? 1 : 0;
+            }
+            return 0;
+        }
+        if (q->fd == -1 && store_query_seek(q) == -1)
+        {
+            break;
+        }
+        status = pread(q->fd, chunk, sizeof(chunk), q->offset);
+        if (status == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to read segment %u: %s", q->seq, strerror(errno));
+            break;
+        }
+        budget -= status;
+        offset = 0;
+        while (offset + (int)sizeof(header) <= status)
+        {
+            (void)memcpy(&header, chunk + offset, sizeof(header));
+            if (header.size > STORE_MAX_RECORD)
+            {
+                M_ERROR(MODULE_NAME, "Corrupted record in segment %u at %ld", q->seq, (long)(q->offset + offset));
+                offset = status;
+                status = 0;
+                break;
+            }
+            if (offset + (int)sizeof(header) + (int)header.size > status)
+            {
+                break;
+            }
+            if (header.time > q->to)
+            {
+                (void)store_query_send(fd, q, frame, frame_size, 1);
+                return 1;
+            }
+            if (header.time >= q->from && header.severity <= q->severity)
+            {
+                if (frame_size + 7 + (int)header.size > (int)sizeof(frame))
+                {
+                    q->offset += offset;
+                    return store_query_send(fd, q, frame, frame_size, 0) == -1 ? 1 : 0;
+                }
+                net32 = htonl((uint32_t)(header.time / 1000u));
+                (void)memcpy(frame + frame_size, &net32, sizeof(net32));
+                frame[frame_size + 4] = header.severity;
+                net16 = htons((uint16_t)header.size);
+                (void)memcpy(frame + frame_size + 5, &net16, sizeof(net16));
+                (void)memcpy(frame + frame_size + 7, chunk + offset + sizeof(header), header.size);
+                frame_size += 7 + header.size;
+            }
+            offset += sizeof(header) + header.size;
+        }
+        q->offset += offset;
+        if (offset == 0 || status < (int)sizeof(chunk))
+        {
+            // end of this segment
+            (void)close(q->fd);
+            q->fd = -1;
+            q->seq++;
+        }
+    }
+    (void)store_query_send(fd, q, frame, frame_size, 1);
+    return 1;
+}
+
+int store_query(int fd, uint16_t client_id, uint32_t from, uint32_t to, uint8_t severity)
+{
+    store_query_t *q;
+    uint8_t frame[2];
+    store_query_cancel(client_id);
+    q = (store_query_t *)malloc(sizeof(store_query_t));
+    if (q == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate query: %s", strerror(errno));
+        return -1;
+    }
+    q->client_id = client_id;
+    q->from = (uint64_t)from * 1000u;
+    q->to = (uint64_t)to * 1000u + 999u;
+    q->severity = severity;
+    q->seq = store.first;
+    q->fd = -1;
+    q->offset = 0;
+    if (store.fd == -1)
+    {
+        // store is disabled, reply with an empty result
+        (void)store_query_send(fd, q, frame, sizeof(frame), 1);
+        free(q);
+        return -1;
+    }
+    queries = bst_insert(queries, client_id, q);
+    return 0;
+}
+
+void store_query_cancel(uint16_t client_id)
+{
+    bst_node_t *node = bst_find(queries, client_id);
+    if (node)
+    {
+        free_queries(node, NULL, 0);
+        queries = bst_delete(queries, client_id);
+    }
+}
+
+static void query_step(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    int *fd = (int *)argv[0];
+    list_t *finished = (list_t *)argv[1];
+    store_query_t *q = (store_query_t *)node->data;
+    if (q && store_query_batch(*fd, q))
+    {
+        list_put_i(finished, node->key);
+    }
+}
+
+int store_query_step(int fd)
+{
+    list_t finished;
+    item_t item;
+    void *argv[2];
+    if (queries == NULL)
+    {
+        return 0;
+    }
+    // the queries read what is on disk
+    store_flush();
+    finished = list_init();
+    argv[0] = (void *)&fd;
+    argv[1] = (void *)&finished;
+    bst_for_each(queries, query_step, argv, 2);
+    list_for_each(item, finished)
+    {
+        store_query_cancel(item->value.i);
+    }
+    list_free(&finished);
+    return queries != NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef STORE_H
+#define STORE_H
+#include <stdint.h>
+
+#define STORE_DEFAULT_SEGMENT_SIZE (4u * 1024u * 1024u)
+#define STORE_DEFAULT_SEGMENTS 8u
+
+/** CTRL code of the historical query request and its replies*/
+#define STORE_CTRL_QUERY 0x02
+
+/**
+ * @brief Open the segmented log store in a directory, segments are
+ * named <name>.<seq>.log and their sparse time index <name>.<seq>.idx
+ *
+ * @param dir store directory
+ * @param name segment prefix (channel name)
+ * @param segment_size maximal size of a segment in bytes
+ * @param segments maximal number of segments kept on disk
+ * @return 0 on success, -1 on error
+ */
+int store_open(const char *dir, const char *name, uint32_t segment_size, unsigned int segments);
+/**
+ * @brief Append a record to the store, the record is buffered
+ * until store_flush() is called
+ */
+void store_append(const uint8_t *data, int size, uint8_t severity);
+void store_flush(void);
+void store_close(void);
+
+/**
+ * @brief Register a historical query of a client, matching records
+ * are sent back by store_query_step() in batched CTRL frames
+ *
+ * @param from start time (epoch seconds)
+ * @param to end time (epoch seconds)
+ * @param severity maximal severity (0 emerg ... 7 debug)
+ */
+int store_query(int fd, uint16_t client_id, uint32_t from, uint32_t to, uint8_t severity);
+void store_query_cancel(uint16_t client_id);
+/**
+ * @brief Send one batch of each pending query
+ *
+ * @return number of pending queries
+ */
+int store_query_step(int fd);
+
+#endif
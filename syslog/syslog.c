@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
@@ -13,15 +14,102 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include <antd/list.h>
 #include <antd/bst.h>
 #include <antd/utils.h>
 
 #include "../tunnel.h"
+#include "store.h"
 
 #define MODULE_NAME "syslogb"
 
+#define SL_MAX_TAG 48
+#define SL_MAX_SOURCES 1024
+#define SL_DEFAULT_REPEAT_FLUSH 5000
+
+#define SL_CTRL_STATS 0x01
+
+#define SL_INPUT_DGRAM 0x0
+#define SL_INPUT_STREAM 0x1
+#define SL_INPUT_CONN 0x2
+#define SL_INPUT_KMSG 0x3
+/** max bytes read from an input per select() wakeup */
+#define SL_READ_BUDGET (BUFFLEN * 64)
+
+/**
+ * @brief An ingestion source: datagram socket, stream
+ * socket (listener or accepted connection) or /dev/kmsg
+ *
+ */
+typedef struct _syslog_input_t
+{
+    int type;
+    int fd;
+    char name[SL_MAX_TAG];
+    char path[MAX_CHANNEL_PATH];
+    /** partial record of a stream connection */
+    uint8_t buffer[BUFFLEN];
+    int size;
+    /** bytes of an oversized octet counted record to discard */
+    int skip;
+} syslog_input_t;
+
+/**
+ * @brief Per program state used for duplicate collapsing
+ * and rate limiting
+ *
+ */
+typedef struct _syslog_source_t
+{
+    char tag[SL_MAX_TAG];
+    char pri[8];
+    uint8_t last[BUFFLEN];
+    int last_size;
+    unsigned int repeated;
+    unsigned long long repeat_since;
+    double tokens;
+    unsigned long long refill_at;
+    unsigned int dropped;
+    char input[SL_MAX_TAG];
+    /** next source with the same hash */
+    struct _syslog_source_t *next;
+} syslog_source_t;
+
+/**
+ * @brief Parsed view of a RFC3164 record:
+ * <PRI>Mmm dd hh:mm:ss TAG[PID]: message
+ *
+ */
+typedef struct
+{
+    int pri_len;
+    int body;
+    int tag_len;
+} syslog_record_t;
+
+
+typedef struct
+{
+    unsigned int received;
+    unsigned int forwarded;
+    unsigned int suppressed;
+    unsigned int dropped;
+} syslog_stat_t;
+
 static bst_node_t *clients = NULL;
+static bst_node_t *sources = NULL;
+static bst_node_t *inputs = NULL;
+static int n_sources = 0;
+static syslog_stat_t stats = {0};
+
+/** duplicate flush timer in ms, 0 disables collapsing*/
+static unsigned int repeat_flush = SL_DEFAULT_REPEAT_FLUSH;
+/** token bucket per program: messages per second and burst size, 0 disables the limit*/
+static unsigned int rate_limit = 0;
+static unsigned int rate_burst = 0;
+/** prefix forwarded records with the name of their source */
+static unsigned int source_tag = 0;
 
 static volatile int running = 1;
 
@@ -41,6 +129,651 @@ static void send_data(bst_node_t *node, void **argv, int argc)
         M_ERROR(MODULE_NAME, "Unable to write data message to client %d", node->key);
     }
 }
+static unsigned long long now_ms()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000u + ts.tv_nsec / 1000000u;
+}
+
+static unsigned int env_uint(const char *name, unsigned int value)
+{
+    char *env = getenv(name);
+    if (env != NULL && strlen(env) > 0)
+    {
+        value = (unsigned int)atoi(env);
+    }
+    return value;
+}
+
+static void syslog_parse(const uint8_t *data, int size, syslog_record_t *rec)
+{
+    int i = 0;
+    rec->pri_len = 0;
+    rec->body = 0;
+    rec->tag_len = 0;
+    if (size > 0 && data[0] == '<')
+    {
+        for (i = 1; i < size && i < 6 && data[i] != '>'; i++)
+            ;
+        if (i < size && data[i] == '>')
+        {
+            rec->pri_len = i + 1;
+        }
+    }
+    rec->body = rec->pri_len;
+    // skip the "Mmm dd hh:mm:ss " timestamp, it changes for each duplicate
+    i = rec->pri_len;
+    if (size - i > 16 && data[i + 3] == ' ' && data[i + 6] == ' ' && data[i + 9] == ':' && data[i + 12] == ':' && data[i + 15] == ' ')
+    {
+        rec->body = i + 16;
+    }
+    for (i = rec->body; i < size && i - rec->body < SL_MAX_TAG - 1; i++)
+    {
+        if (data[i] == '[' || data[i] == ':' || data[i] == ' ')
+        {
+            break;
+        }
+    }
+    rec->tag_len = i - rec->body;
+}
+
+static void syslog_fanout(int fd, const char *name, uint8_t *data, int size)
+{
+    tunnel_msg_t msg;
+    void *fargv[2];
+    uint8_t buff[SL_MAX_TAG + BUFFLEN + 3];
+    int len;
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.size = size;
+    msg.data = data;
+    store_append(data, size, (size > 1 && data[0] == '<') ? atoi((char *)data + 1) & 0x7 : LOG_INFO);
+    if (source_tag)
+    {
+        len = snprintf((char *)buff, sizeof(buff), "[%s] ", name);
+        size = size > BUFFLEN ? BUFFLEN : size;
+        (void)memcpy(buff + len, data, size);
+        msg.header.size = len + size;
+        msg.data = buff;
+    }
+    fargv[0] = (void *)&msg;
+    fargv[1] = (void *)&fd;
+    bst_for_each(clients, send_data, fargv, 2);
+    stats.forwarded++;
+}
+
+static void syslog_notify(int fd, syslog_source_t *src, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void syslog_notify(int fd, syslog_source_t *src, const char *fmt, ...)
+{
+    char buff[BUFFLEN];
+    va_list args;
+    int len = snprintf(buff, sizeof(buff), "%s%s: ", src->pri, src->tag);
+    va_start(args, fmt);
+    len += vsnprintf(buff + len, sizeof(buff) - len, fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof(buff))
+    {
+        len = sizeof(buff) - 1;
+    }
+    syslog_fanout(fd, src->input, (uint8_t *)buff, len);
+}
+
+static void syslog_flush_repeat(int fd, syslog_source_t *src)
+{
+    if (src->repeated == 0)
+    {
+        return;
+    }
+    syslog_notify(fd, src, "last message repeated %u times", src->repeated);
+    src->repeated = 0;
+}
+
+static void flush_repeats(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    int *fd = (int *)argv[0];
+    unsigned long long *now = (unsigned long long *)argv[1];
+    unsigned long long *deadline = (unsigned long long *)argv[2];
+    syslog_source_t *src;
+    for (src = (syslog_source_t *)node->data; src; src = src->next)
+    {
+        if (src->repeated == 0)
+        {
+            continue;
+        }
+        if (*now >= src->repeat_since + repeat_flush)
+        {
+            syslog_flush_repeat(*fd, src);
+        }
+        else if (*deadline == 0 || src->repeat_since + repeat_flush < *deadline)
+        {
+            *deadline = src->repeat_since + repeat_flush;
+        }
+    }
+}
+
+static void free_sources(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    (void)argv;
+    syslog_source_t *src;
+    while (node->data)
+    {
+        src = (syslog_source_t *)node->data;
+        node->data = src->next;
+        free(src);
+    }
+}
+
+static syslog_source_t *syslog_source(syslog_input_t *in, const uint8_t *data, syslog_record_t *rec, unsigned long long now)
+{
+    char tag[SL_MAX_TAG];
+    char key[2 * SL_MAX_TAG];
+    int hash;
+    bst_node_t *node;
+    syslog_source_t *src;
+    syslog_source_t *head = NULL;
+    (void)memcpy(tag, data + rec->body, rec->tag_len);
+    tag[rec->tag_len] = '\0';
+    // programs are tracked per input
+    (void)snprintf(key, sizeof(key), "%s/%s", in->name, tag);
+    hash = simple_hash(key);
+    node = bst_find(sources, hash);
+    if (node)
+    {
+        head = (syslog_source_t *)node->data;
+    }
+    // programs whose keys collide are chained
+    for (src = head; src; src = src->next)
+    {
+        if (strncmp(src->tag, tag, SL_MAX_TAG) == 0 && strncmp(src->input, in->name, SL_MAX_TAG) == 0)
+        {
+            return src;
+        }
+    }
+    if (n_sources >= SL_MAX_SOURCES)
+    {
+        // untracked programs are forwarded as is
+        return NULL;
+    }
+    src = (syslog_source_t *)malloc(sizeof(syslog_source_t));
+    if (src == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate source for %s: %s", tag, strerror(errno));
+        return NULL;
+    }
+    (void)memset(src, 0, sizeof(syslog_source_t));
+    (void)strncpy(src->tag, tag, SL_MAX_TAG);
+    src->tokens = rate_burst;
+    src->refill_at = now;
+    (void)strncpy(src->input, in->name, SL_MAX_TAG);
+    if (head)
+    {
+        src->next = head->next;
+        head->next = src;
+    }
+    else
+    {
+        sources = bst_insert(sources, hash, src);
+    }
+    n_sources++;
+    return src;
+}
+
+/**
+ * @brief Forward a record to all subscribers, collapsing
+ * duplicate lines of a program and applying its rate limit
+ *
+ */
+static void syslog_dispatch(int fd, syslog_input_t *in, uint8_t *data, int size)
+{
+    syslog_record_t rec;
+    syslog_source_t *src;
+    unsigned long long now;
+    int key_size;
+    stats.received++;
+    if (repeat_flush == 0 && rate_limit == 0)
+    {
+        syslog_fanout(fd, in->name, data, size);
+        return;
+    }
+    now = now_ms();
+    syslog_parse(data, size, &rec);
+    src = syslog_source(in, data, &rec, now);
+    if (src == NULL)
+    {
+        syslog_fanout(fd, in->name, data, size);
+        return;
+    }
+    (void)snprintf(src->pri, sizeof(src->pri), "%.*s", rec.pri_len, (char *)data);
+    // duplicate key is the record without its timestamp
+    key_size = rec.pri_len + size - rec.body;
+    if (repeat_flush > 0)
+    {
+        if (key_size == src->last_size && memcmp(src->last, data, rec.pri_len) == 0 && memcmp(src->last + rec.pri_len, data + rec.body, size - rec.body) == 0)
+        {
+            if (src->repeated == 0)
+            {
+                src->repeat_since = now;
+            }
+            src->repeated++;
+            stats.suppressed++;
+            return;
+        }
+        syslog_flush_repeat(fd, src);
+        (void)memcpy(src->last, data, rec.pri_len);
+        (void)memcpy(src->last + rec.pri_len, data + rec.body, size - rec.body);
+        src->last_size = key_size;
+    }
+    if (rate_limit > 0)
+    {
+        src->tokens += (double)(now - src->refill_at) * rate_limit / 1000.0;
+        src->refill_at = now;
+        if (src->tokens > rate_burst)
+        {
+            src->tokens = rate_burst;
+        }
+        if (src->tokens < 1.0)
+        {
+            src->dropped++;
+            stats.dropped++;
+            return;
+        }
+        src->tokens -= 1.0;
+        if (src->dropped > 0)
+        {
+            syslog_notify(fd, src, "%u messages dropped by rate limit", src->dropped);
+            src->dropped = 0;
+        }
+    }
+    syslog_fanout(fd, in->name, data, size);
+}
+
+static void syslog_send_stats(int fd, tunnel_msg_t *msg)
+{
+    uint8_t buff[1 + 4 * sizeof(uint32_t)];
+    uint32_t net32;
+    int offset = 1;
+    buff[0] = SL_CTRL_STATS;
+    net32 = htonl(stats.received);
+    (void)memcpy(buff + offset, &net32, sizeof(net32));
+    offset += sizeof(net32);
+    net32 = htonl(stats.forwarded);
+    (void)memcpy(buff + offset, &net32, sizeof(net32));
+    offset += sizeof(net32);
+    net32 = htonl(stats.suppressed);
+    (void)memcpy(buff + offset, &net32, sizeof(net32));
+    offset += sizeof(net32);
+    net32 = htonl(stats.dropped);
+    (void)memcpy(buff + offset, &net32, sizeof(net32));
+    offset += sizeof(net32);
+    msg->header.type = CHANNEL_CTRL;
+    msg->header.size = offset;
+    msg->data = buff;
+    if (msg_write(fd, msg) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to send statistic to client %d", msg->header.client_id);
+    }
+    msg->data = NULL;
+}
+
+static int syslog_bind(syslog_input_t *in, int type)
+{
+    struct sockaddr_un saddr;
+    int sock_fd;
+    (void)unlink(in->path);
+    if ((sock_fd = socket(AF_UNIX, type, 0)) < 0)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create socket %s: %s", in->path, strerror(errno));
+        return -1;
+    }
+    /* bind to the socket path */
+    (void)memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    (void)strncpy(saddr.sun_path, in->path, sizeof(saddr.sun_path) - 1);
+    if (0 != (bind(sock_fd, (struct sockaddr *)&saddr, sizeof(struct sockaddr_un))))
+    {
+        M_ERROR(MODULE_NAME, "Unable to bind socket %s: %s", in->path, strerror(errno));
+        (void)close(sock_fd);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(sock_fd, 16) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to listen on socket %s: %s", in->path, strerror(errno));
+        (void)close(sock_fd);
+        return -1;
+    }
+    (void)chmod(in->path, 0777);
+    M_LOG(MODULE_NAME, "Unix domain socket: %s created", in->path);
+    return sock_fd;
+}
+
+/**
+ * @brief Open an input from its specification:
+ * [dgram:]/path, stream:/path or kmsg[:/dev/kmsg]
+ *
+ */
+static syslog_input_t *syslog_open_input(const char *spec)
+{
+    syslog_input_t *in;
+    const char *path = spec;
+    in = (syslog_input_t *)malloc(sizeof(syslog_input_t));
+    if (in == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate input %s: %s", spec, strerror(errno));
+        return NULL;
+    }
+    (void)memset(in, 0, sizeof(syslog_input_t));
+    in->type = SL_INPUT_DGRAM;
+    (void)strncpy(in->name, "dgram", SL_MAX_TAG);
+    if (strncmp(spec, "dgram:", 6) == 0)
+    {
+        path = spec + 6;
+    }
+    else if (strncmp(spec, "stream:", 7) == 0)
+    {
+        in->type = SL_INPUT_STREAM;
+        (void)strncpy(in->name, "stream", SL_MAX_TAG);
+        path = spec + 7;
+    }
+    else if (strncmp(spec, "kmsg", 4) == 0)
+    {
+        in->type = SL_INPUT_KMSG;
+        (void)strncpy(in->name, "kmsg", SL_MAX_TAG);
+        path = spec[4] == ':' ? spec + 5 : "/dev/kmsg";
+    }
+    if (strlen(path) == 0 || strlen(path) > MAX_CHANNEL_PATH - 1)
+    {
+        M_ERROR(MODULE_NAME, "Invalid input path: %s", spec);
+        free(in);
+        return NULL;
+    }
+    (void)strncpy(in->path, path, MAX_CHANNEL_PATH - 1);
+    switch (in->type)
+    {
+    case SL_INPUT_STREAM:
+        in->fd = syslog_bind(in, SOCK_STREAM);
+        break;
+    case SL_INPUT_KMSG:
+        in->fd = open(in->path, O_RDONLY);
+        if (in->fd == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to open %s: %s", in->path, strerror(errno));
+        }
+        else
+        {
+            // only live kernel messages are forwarded
+            (void)lseek(in->fd, 0, SEEK_END);
+        }
+        break;
+    default:
+        in->fd = syslog_bind(in, SOCK_DGRAM);
+        break;
+    }
+    if (in->fd == -1)
+    {
+        free(in);
+        return NULL;
+    }
+    (void)fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) | O_NONBLOCK);
+    return in;
+}
+
+static void syslog_close_input(syslog_input_t *in)
+{
+    (void)close(in->fd);
+    if (in->type == SL_INPUT_DGRAM || in->type == SL_INPUT_STREAM)
+    {
+        (void)unlink(in->path);
+    }
+    free(in);
+}
+
+/**
+ * @brief Convert a /dev/kmsg record "pri,seq,usec,flags;message"
+ * to "<pri>kernel: message"
+ *
+ */
+static int syslog_kmsg_record(uint8_t *data, int size, uint8_t *out)
+{
+    int pri = atoi((char *)data);
+    int i;
+    int len;
+    for (i = 0; i < size && data[i] != ';'; i++)
+        ;
+    if (i == size)
+    {
+        return -1;
+    }
+    i++;
+    len = snprintf((char *)out, BUFFLEN, "<%d>kernel: ", pri);
+    // drop the dictionary lines that follow the message
+    while (i < size && data[i] != '\n' && len < BUFFLEN)
+    {
+        out[len++] = data[i++];
+    }
+    return len;
+}
+
+/**
+ * @brief Split the buffered stream data into records, octet counted
+ * ("LEN SP MSG") or delimited by newline/NUL
+ *
+ */
+static void syslog_stream_records(int fd, syslog_input_t *in)
+{
+    int start = 0;
+    int i, len, digits;
+    while (start < in->size)
+    {
+        if (in->skip > 0)
+        {
+            len = in->size - start < in->skip ? in->size - start : in->skip;
+            in->skip -= len;
+            start += len;
+            continue;
+        }
+        if (in->buffer[start] == '\n' || in->buffer[start] == '\0')
+        {
+            start++;
+            continue;
+        }
+        if (in->buffer[start] >= '1' && in->buffer[start] <= '9')
+        {
+            len = 0;
+            for (i = start, digits = 0; i < in->size && in->buffer[i] >= '0' && in->buffer[i] <= '9' && digits < 9; i++, digits++)
+            {
+                len = len * 10 + in->buffer[i] - '0';
+            }
+            if (i < in->size && in->buffer[i] == ' ')
+            {
+                i++;
+                if (i + len <= in->size)
+                {
+                    syslog_dispatch(fd, in, in->buffer + i, len);
+                    start = i + len;
+                    continue;
+                }
+                if (start == 0 && in->size == (int)sizeof(in->buffer))
+                {
+                    // the record can not be buffered, forward its head only
+                    syslog_dispatch(fd, in, in->buffer + i, in->size - i);
+                    in->skip = len - (in->size - i);
+                    start = in->size;
+                    continue;
+                }
+                break;
+            }
+            if (i == in->size)
+            {
+                break;
+            }
+        }
+        for (i = start; i < in->size && in->buffer[i] != '\n' && in->buffer[i] != '\0'; i++)
+            ;
+        if (i == in->size && (start > 0 || in->size < (int)sizeof(in->buffer)))
+        {
+            break;
+        }
+        syslog_dispatch(fd, in, in->buffer + start, i - start);
+        start = i;
+    }
+    in->size -= start;
+    if (in->size > 0 && start > 0)
+    {
+        (void)memmove(in->buffer, in->buffer + start, in->size);
+    }
+}
+
+/**
+ * @brief Read from an input until it is drained or the read
+ * budget is consumed
+ *
+ * @return -1 if the input is closed
+ */
+static int syslog_read_input(int fd, syslog_input_t *in, list_t *accepted)
+{
+    uint8_t buff[BUFFLEN * 8];
+    uint8_t record[BUFFLEN];
+    int budget = SL_READ_BUDGET;
+    int status, cfd;
+    syslog_input_t *conn;
+    while (budget > 0)
+    {
+        switch (in->type)
+        {
+        case SL_INPUT_STREAM:
+            cfd = accept(in->fd, NULL, NULL);
+            if (cfd == -1)
+            {
+                if (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED)
+                {
+                    // transient, the listener stays usable
+                    M_ERROR(MODULE_NAME, "Unable to accept connection on %s: %s", in->path, strerror(errno));
+                    return 0;
+                }
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            conn = (syslog_input_t *)malloc(sizeof(syslog_input_t));
+            if (conn == NULL)
+            {
+                M_ERROR(MODULE_NAME, "Unable to allocate connection: %s", strerror(errno));
+                (void)close(cfd);
+                return 0;
+            }
+            (void)memset(conn, 0, sizeof(syslog_input_t));
+            conn->type = SL_INPUT_CONN;
+            conn->fd = cfd;
+            // the connection is dispatched under its listener name, it
+            // keeps no reference to the listener that may be closed first
+            (void)strncpy(conn->name, in->name, SL_MAX_TAG);
+            (void)fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+            M_DEBUG(MODULE_NAME, "New connection %d on %s", cfd, in->path);
+            list_put_ptr(accepted, conn);
+            budget -= BUFFLEN;
+            break;
+
+        case SL_INPUT_CONN:
+            status = read(in->fd, in->buffer + in->size, sizeof(in->buffer) - in->size);
+            if (status == 0)
+            {
+                return -1;
+            }
+            if (status == -1)
+            {
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            in->size += status;
+            budget -= status;
+            syslog_stream_records(fd, in);
+            break;
+
+        case SL_INPUT_KMSG:
+            status = read(in->fd, buff, sizeof(buff) - 1);
+            if (status == -1)
+            {
+                if (errno == EPIPE)
+                {
+                    // records were overwritten in the kernel ring buffer
+                    continue;
+                }
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+            }
+            if (status == 0)
+            {
+                return 0;
+            }
+            budget -= status;
+            status = syslog_kmsg_record(buff, status, record);
+            if (status > 0)
+            {
+                syslog_dispatch(fd, in, record, status);
+            }
+            break;
+
+        default:
+            status = recv(in->fd, buff, BUFFLEN, 0);
+            if (status == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                {
+                    return 0;
+                }
+                M_ERROR(MODULE_NAME, "Unable to read data from the socket %s: %s", in->path, strerror(errno));
+                return -1;
+            }
+            budget -= status;
+            syslog_dispatch(fd, in, buff, status);
+            break;
+        }
+    }
+    return 0;
+}
+
+static void prepare_fd_set(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    fd_set *fd_in = (fd_set *)argv[0];
+    int *max_fd = (int *)argv[1];
+    if (!node->data)
+    {
+        return;
+    }
+    FD_SET(node->key, fd_in);
+    *max_fd = node->key > *max_fd ? node->key : *max_fd;
+}
+
+static void monitor_inputs(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    int *fd = (int *)argv[0];
+    fd_set *fd_in = (fd_set *)argv[1];
+    list_t *closed = (list_t *)argv[2];
+    list_t *accepted = (list_t *)argv[3];
+    syslog_input_t *in = (syslog_input_t *)node->data;
+    if (!in || !FD_ISSET(in->fd, fd_in))
+    {
+        return;
+    }
+    if (syslog_read_input(*fd, in, accepted) == -1)
+    {
+        list_put_ptr(closed, in);
+    }
+}
+
+static void close_inputs(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    (void)argv;
+    if (node->data)
+    {
+        syslog_close_input((syslog_input_t *)node->data);
+        node->data = NULL;
+    }
+}
+
 static void unsubscribe(bst_node_t *node, void **args, int argc)
 {
     (void)argc;
@@ -56,50 +789,72 @@ static void unsubscribe(bst_node_t *node, void **args, int argc)
 }
 int main(int argc, char **argv)
 {
-    int fd, sock_fd;
+    int fd;
     tunnel_msg_t msg;
     fd_set fd_in;
-    int status, maxfd, length;
+    int status, maxfd;
     char buff[BUFFLEN + 1];
-    void *fargv[2];
-    struct sockaddr_un saddr, caddr;
+    void *fargv[4];
+    char *spec;
+    int pending = 0;
+    uint32_t from, to;
+    syslog_input_t *in;
+    list_t closed, accepted;
+    item_t item;
+    struct timeval timeout;
+    unsigned long long now, deadline;
     uint8_t *tmp;
     LOG_INIT(MODULE_NAME);
 
     if (argc != 4)
     {
-        printf("Usage: %s path/to/hotline/socket channel_name input_file\n", argv[0]);
+        printf("Usage: %s path/to/hotline/socket channel_name input[,input...]\n", argv[0]);
+        printf("Input: [dgram:]/path/to/socket, stream:/path/to/socket or kmsg[:/dev/kmsg]\n");
         return -1;
     }
     signal(SIGPIPE, SIG_IGN);
     signal(SIGABRT, SIG_IGN);
     signal(SIGINT, int_handler);
-    // create the unix domain socket
-    (void)unlink(argv[3]);
-    if ((sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-        M_ERROR(MODULE_NAME, "Unable to create socket %s: %s", argv[3], strerror(errno));
-        return -1;
+    repeat_flush = env_uint("repeat_flush", SL_DEFAULT_REPEAT_FLUSH);
+    rate_limit = env_uint("rate_limit", 0);
+    rate_burst = env_uint("rate_burst", rate_limit);
+    source_tag = env_uint("source_tag", 0);
+    if (rate_burst < 1)
+    {
+        rate_burst = 1;
     }
-
-    /* bind to the socket path */
-    saddr.sun_family = AF_UNIX;
-    snprintf(saddr.sun_path, (strlen(argv[3])+1), "%s", argv[3]);
-
-    if (0 != (bind(sock_fd, (struct sockaddr *)&saddr, sizeof(struct sockaddr_un)))) {
-        M_ERROR(MODULE_NAME, "Unable to bind socket %s: %s", argv[3], strerror(errno));
-        (void) close(sock_fd);
-        return -1;
+    M_LOG(MODULE_NAME, "Repeat flush: %u ms, rate limit: %u msg/s (burst %u)", repeat_flush, rate_limit, rate_burst);
+    if (getenv("store") != NULL && strlen(getenv("store")) > 0)
+    {
+        // historical queries are answered from the on-disk store
+        if (store_open(getenv("store"), argv[2],
+                       env_uint("store_segment_size", STORE_DEFAULT_SEGMENT_SIZE),
+                       env_uint("store_segments", STORE_DEFAULT_SEGMENTS)) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to open log store %s, history is disabled", getenv("store"));
+        }
+    }
+    // open all the inputs
+    for (spec = strtok(argv[3], ","); spec != NULL; spec = strtok(NULL, ","))
+    {
+        in = syslog_open_input(spec);
+        if (in == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to open input: %s", spec);
+            bst_for_each(inputs, close_inputs, NULL, 0);
+            bst_free(inputs);
+            return -1;
+        }
+        inputs = bst_insert(inputs, in->fd, in);
     }
-    (void)chmod(argv[3], 0777);
-
-    M_LOG(MODULE_NAME, "Unix domain socket: %s created", argv[3]);
     M_LOG(MODULE_NAME, "Hotline is: %s", argv[1]);
     // now try to request new channel from hotline
     fd = open_socket(argv[1]);
     if (fd == -1)
     {
         M_ERROR(MODULE_NAME, "Unable to open the hotline: %s", argv[1]);
-        (void)close(sock_fd);
+        bst_for_each(inputs, close_inputs, NULL, 0);
+        bst_free(inputs);
         return -1;
     }
     msg.header.type = CHANNEL_OPEN;
@@ -113,7 +868,8 @@ int main(int argc, char **argv)
     {
         M_ERROR(MODULE_NAME, "Unable to write message to hotline");
         (void)close(fd);
-        (void)close(sock_fd);
+        bst_for_each(inputs, close_inputs, NULL, 0);
+        bst_free(inputs);
         return -1;
     }
     M_LOG(MODULE_NAME, "Wait for comfirm creation of %s", argv[2]);
@@ -122,7 +878,8 @@ int main(int argc, char **argv)
     {
         M_ERROR(MODULE_NAME, "Unable to read message from hotline");
         (void)close(fd);
-        (void)close(sock_fd);
+        bst_for_each(inputs, close_inputs, NULL, 0);
+        bst_free(inputs);
         return -1;
     }
     if (msg.header.type == CHANNEL_OK)
@@ -139,16 +896,36 @@ int main(int argc, char **argv)
         running = 0;
     }
 
-    length = sizeof(struct sockaddr_un);
     // now read data
     while (running)
     {
         FD_ZERO(&fd_in);
         FD_SET(fd, &fd_in);
-        FD_SET(sock_fd, &fd_in);
-        maxfd = fd > sock_fd ? fd : sock_fd;
+        maxfd = fd;
+        fargv[0] = (void *)&fd_in;
+        fargv[1] = (void *)&maxfd;
+        bst_for_each(inputs, prepare_fd_set, fargv, 2);
+
+        // flush expired duplicate counters and find the next deadline
+        now = now_ms();
+        deadline = 0;
+        fargv[0] = (void *)&fd;
+        fargv[1] = (void *)&now;
+        fargv[2] = (void *)&deadline;
+        bst_for_each(sources, flush_repeats, fargv, 3);
+        if (pending)
+        {
+            // pending queries are served between live wakeups
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+        }
+        else if (deadline > 0)
+        {
+            timeout.tv_sec = (deadline - now) / 1000u;
+            timeout.tv_usec = ((deadline - now) % 1000u) * 1000u;
+        }
 
-        status = select(maxfd + 1, &fd_in, NULL, NULL, NULL);
+        status = select(maxfd + 1, &fd_in, NULL, NULL, (pending || deadline > 0) ? &timeout : NULL);
 
         switch (status)
         {
@@ -179,6 +956,30 @@ int main(int argc, char **argv)
                     case CHANNEL_UNSUBSCRIBE:
                         M_LOG(MODULE_NAME, "Client %d unsubscribes to the chanel", msg.header.client_id);
                         clients = bst_delete(clients, msg.header.client_id);
+                        store_query_cancel(msg.header.client_id);
+                        break;
+
+                    case CHANNEL_CTRL:
+                        if (msg.header.size > 0 && msg.data[0] == SL_CTRL_STATS)
+                        {
+                            tmp = msg.data;
+                            syslog_send_stats(fd, &msg);
+                            msg.data = tmp;
+                        }
+                        else if (msg.header.size == 10 && msg.data[0] == STORE_CTRL_QUERY)
+                        {
+                            // [code][4 bytes from][4 bytes to][max severity]
+                            (void)memcpy(&from, msg.data + 1, sizeof(from));
+                            (void)memcpy(&to, msg.data + 5, sizeof(to));
+                            from = ntohl(from);
+                            to = ntohl(to);
+                            M_LOG(MODULE_NAME, "Client %d queries log from %u to %u, severity <= %d", msg.header.client_id, from, to, msg.data[9]);
+                            (void)store_query(fd, msg.header.client_id, from, to, msg.data[9]);
+                        }
+                        else
+                        {
+                            M_ERROR(MODULE_NAME, "Invalid control message from client %d", msg.header.client_id);
+                        }
                         break;
 
                     default:
@@ -192,33 +993,44 @@ int main(int argc, char **argv)
                     }
                 }
             }
-            else if (FD_ISSET(sock_fd, &fd_in))
+            // on the inputs side
+            closed = list_init();
+            accepted = list_init();
+            fargv[0] = (void *)&fd;
+            fargv[1] = (void *)&fd_in;
+            fargv[2] = (void *)&closed;
+            fargv[3] = (void *)&accepted;
+            bst_for_each(inputs, monitor_inputs, fargv, 4);
+            list_for_each(item, closed)
             {
-                // read data to buffer
-                memset(buff, 0, sizeof(buff));
-                status = recvfrom(sock_fd, buff, sizeof(buff) -1 , 0, (struct sockaddr *)&caddr, &length);
-                // on the fifo side
-                if (status == -1)
-                {
-                    M_ERROR(MODULE_NAME, "Unable to read data from the UDP socket %s: %s", argv[3], strerror(errno));
-                    running = 0;
-                }
-                else
+                in = (syslog_input_t *)item->value.ptr;
+                if (in->type != SL_INPUT_CONN)
                 {
-                    msg.header.type = CHANNEL_DATA;
-                    msg.header.size = status;
-                    msg.data = (uint8_t *)buff;
-                    fargv[0] = (void *)&msg;
-                    fargv[1] = (void *)&fd;
-                    bst_for_each(clients, send_data, fargv, 2);
+                    M_ERROR(MODULE_NAME, "Input %s is closed", in->path);
                 }
+                inputs = bst_delete(inputs, in->fd);
+                syslog_close_input(in);
+                item->value.ptr = NULL;
+            }
+            list_for_each(item, accepted)
+            {
+                in = (syslog_input_t *)item->value.ptr;
+                inputs = bst_insert(inputs, in->fd, in);
             }
+            list_free(&closed);
+            list_free(&accepted);
+            store_flush();
         }
+        pending = store_query_step(fd);
     }
     // unsubscribe all client
     fargv[0] = (void *)&fd;
     bst_for_each(clients, unsubscribe, fargv, 1);
     bst_free(clients);
+    M_LOG(MODULE_NAME, "Received: %u, forwarded: %u, suppressed: %u, dropped: %u",
+          stats.received, stats.forwarded, stats.suppressed, stats.dropped);
+    bst_for_each(sources, free_sources, NULL, 0);
+    bst_free(sources);
     // close the channel
     M_LOG(MODULE_NAME, "Close the channel %s (%d)", argv[2], fd);
     msg.header.type = CHANNEL_CLOSE;
@@ -232,6 +1044,8 @@ int main(int argc, char **argv)
 
     (void)msg_read(fd, &msg);
     (void)close(fd);
-    (void)close(sock_fd);
+    bst_for_each(inputs, close_inputs, NULL, 0);
+    bst_free(inputs);
+    store_close();
     return 0;
 }
\ No newline at end of file
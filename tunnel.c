@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
 
@@ -15,6 +16,8 @@
 #undef MAX_PATH_LEN
 #endif
 #define MAX_PATH_LEN 108
+#define MSG_HEADER_SIZE 11
+#define MSG_FANOUT_BATCH 64
 
 static int guard_read(int fd, void* buffer, size_t size)
 {
@@ -64,6 +67,33 @@ static int guard_write(int fd, void* buffer, size_t size)
     return n;
 }
 
+static int guard_writev(int fd, struct iovec* iov, int count)
+{
+    ssize_t st;
+    while(count > 0)
+    {
+        st = writev(fd, iov, count);
+        if(st == -1)
+        {
+            M_ERROR(MODULE_NAME,"Unable to write to #%d: %s", fd, strerror(errno));
+            return -1;
+        }
+        // skip what is written, the rest of a partial vector is sent again
+        while(count > 0 && st >= (ssize_t)iov->iov_len)
+        {
+            st -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + st;
+            iov->iov_len -= st;
+        }
+    }
+    return 0;
+}
+
 static int msg_check_number(int fd, uint16_t number)
 {
     uint16_t value;
@@ -262,7 +292,7 @@ int msg_read(int fd, tunnel_msg_t* msg)
     return 0;
 }
 
-int msg_write(int fd, tunnel_msg_t* msg)
+int msg_write_header(int fd, tunnel_msg_t* msg)
 {
     // write begin magic number
     uint16_t net16;
@@ -300,6 +330,66 @@ int msg_write(int fd, tunnel_msg_t* msg)
         M_ERROR(MODULE_NAME, "Unable to write msg payload length: %s", strerror(errno));
         return -1;
     }
+    return 0;
+}
+
+int msg_write_end(int fd)
+{
+    uint16_t net16 = htons(MSG_MAGIC_END);
+    if(guard_write(fd,&net16, sizeof(net16)) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write end magic number: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int msg_write_fanout(int fd, tunnel_msg_t* msg, const uint16_t* client_ids, int n)
+{
+    uint8_t headers[MSG_FANOUT_BATCH][MSG_HEADER_SIZE];
+    struct iovec iov[MSG_FANOUT_BATCH * 3];
+    uint16_t end = htons(MSG_MAGIC_END);
+    uint16_t net16;
+    uint32_t net32;
+    int i, count;
+    while(n > 0)
+    {
+        count = n > MSG_FANOUT_BATCH ? MSG_FANOUT_BATCH : n;
+        for(i = 0; i < count; i++)
+        {
+            net16 = htons(MSG_MAGIC_BEGIN);
+            (void)memcpy(headers[i], &net16, sizeof(net16));
+            headers[i][2] = msg->header.type;
+            net16 = htons(msg->header.channel_id);
+            (void)memcpy(headers[i] + 3, &net16, sizeof(net16));
+            net16 = htons(client_ids[i]);
+            (void)memcpy(headers[i] + 5, &net16, sizeof(net16));
+            net32 = htonl(msg->header.size);
+            (void)memcpy(headers[i] + 7, &net32, sizeof(net32));
+            iov[3 * i].iov_base = headers[i];
+            iov[3 * i].iov_len = MSG_HEADER_SIZE;
+            iov[3 * i + 1].iov_base = msg->data;
+            iov[3 * i + 1].iov_len = msg->header.size;
+            iov[3 * i + 2].iov_base = &end;
+            iov[3 * i + 2].iov_len = sizeof(end);
+        }
+        if(guard_writev(fd, iov, count * 3) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to write msg to %d clients: %s", count, strerror(errno));
+            return -1;
+        }
+        client_ids += count;
+        n -= count;
+    }
+    return 0;
+}
+
+int msg_write(int fd, tunnel_msg_t* msg)
+{
+    if(msg_write_header(fd, msg) == -1)
+    {
+        return -1;
+    }
     // write payload data
     if(msg->header.size > 0)
     {
@@ -309,13 +399,7 @@ int msg_write(int fd, tunnel_msg_t* msg)
             return -1;
         }
     }
-    net16 = htons(MSG_MAGIC_END);
-    if(guard_write(fd,&net16, sizeof(net16)) == -1)
-    {
-        M_ERROR(MODULE_NAME, "Unable to write end magic number: %s", strerror(errno));
-        return -1;
-    }
-    return 0;
+    return msg_write_end(fd);
 }
 
 
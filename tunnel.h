@@ -34,6 +34,17 @@ typedef struct{
 
 int open_socket(char* path);
 int msg_write(int fd, tunnel_msg_t* msg);
+/**
+ * write the frame header (magic to payload size) and the end magic
+ * number separately, the payload is written by the caller in between
+ */
+int msg_write_header(int fd, tunnel_msg_t* msg);
+int msg_write_end(int fd);
+/**
+ * write the same frame to several clients with one writev() per batch
+ * of clients, the client id of msg is ignored
+ */
+int msg_write_fanout(int fd, tunnel_msg_t* msg, const uint16_t* client_ids, int n);
 int msg_read(int fd, tunnel_msg_t* msg);
 int regex_match(const char* expr,const char* search, int msize, regmatch_t* matches);
 
@@ -0,0 +1,824 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/videodev2.h>
+#include <jpeglib.h>
+
+#include "../log.h"
+#include "yuv.h"
+#include "encoder.h"
+
+#define MODULE_NAME "v4l2cam"
+/** luma rows of an MCU, the slices are made of whole MCU rows */
+#define MCU_SIZE 16
+#define MAX_JOBS (ENCODER_MAX_WORKERS * ENCODER_MAX_RENDITIONS * ENCODER_MAX_SLICES)
+#define MARKER_SOF0 0xC0
+#define MARKER_RST0 0xD0
+#define MARKER_EOI 0xD9
+#define MARKER_SOS 0xDA
+#define MARKER_DRI 0xDD
+
+/**
+ * @brief Output of a slice, kept between frames and grown when a slice
+ * does not fit
+ */
+typedef struct
+{
+    uint8_t *buffer;
+    unsigned long capacity;
+    unsigned long size;
+    unsigned long long convert_us;
+    unsigned long long encode_us;
+} enc_slice_t;
+
+/**
+ * @brief Rendition of a frame in flight
+ */
+typedef struct
+{
+    enc_rendition_t rendition;
+    /** more than one only at the size of the capture */
+    int n_slices;
+    enc_slice_t slices[ENCODER_MAX_SLICES];
+    /** the slices joined by restart markers */
+    uint8_t *buffer;
+    size_t capacity;
+} enc_stream_t;
+
+typedef struct
+{
+    enc_frame_t frame;
+    const uint8_t *raw;
+    /** slices not encoded yet, all streams included */
+    int pending;
+    enc_stream_t streams[ENCODER_MAX_RENDITIONS];
+} enc_slot_t;
+
+typedef struct
+{
+    int width;
+    int height;
+    uint32_t pixelformat;
+    int bytesperline;
+    /** the frames are YUYV or NV12, fed as raw YCbCr */
+    int raw;
+    /** rows of all the slices but the last one */
+    int slice_rows;
+    int n_slices;
+    /** MCUs per slice, written in the DRI marker */
+    int interval;
+    unsigned int generation;
+} enc_setting_t;
+
+/**
+ * @brief JPEG compressor of a worker set up for one rendition (width and
+ * quality) of a capture generation
+ */
+typedef struct
+{
+    struct jpeg_compress_struct cinfo;
+    enc_rendition_t rendition;
+    unsigned int generation;
+} enc_context_t;
+
+/**
+ * @brief Encoder context of a worker, one compressor per rendition so that
+ * the slices of several renditions do not set the parameters up in turn
+ */
+typedef struct
+{
+    pthread_t thread;
+    struct jpeg_error_mgr jerror;
+    enc_context_t contexts[ENCODER_MAX_RENDITIONS];
+    /** compressor set up again when no rendition matches */
+    int next_context;
+    /** capture generation of the scaler scratch */
+    unsigned int generation;
+    /** the captured frame split at full size, for the scaled renditions */
+    yuv_planes_t frame;
+    /** input of the encoder, by size of the renditions */
+    enc_rendition_t sizes[ENCODER_MAX_RENDITIONS];
+    yuv_planes_t planes[ENCODER_MAX_RENDITIONS];
+    uint8_t *rgb[ENCODER_MAX_RENDITIONS];
+    size_t rgb_size[ENCODER_MAX_RENDITIONS];
+    /** input replaced when no size matches */
+    int next_size;
+    /** scratch of the scaler */
+    uint16_t *sums;
+} enc_worker_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/** signaled when jobs are queued */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+/** signaled when a frame is encoded */
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static enc_worker_t workers[ENCODER_MAX_WORKERS];
+static int n_workers = 0;
+static int max_slices = 1;
+static int running = 0;
+static int notify_fd = -1;
+static enc_setting_t setting;
+/** frames in flight, one per worker, the oldest at head */
+static enc_slot_t slots[ENCODER_MAX_WORKERS];
+static int head = 0;
+static int count = 0;
+/** slices to encode: (slot * ENCODER_MAX_RENDITIONS + stream) * ENCODER_MAX_SLICES + slice */
+static int jobs[MAX_JOBS];
+static int job_head = 0;
+static int job_count = 0;
+
+static unsigned long long now_us()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+/**
+ * @return compressor set up for the rendition, the least recently set up
+ * one is set up again when none matches, NULL on error
+ */
+static struct jpeg_compress_struct *worker_setup(enc_worker_t *worker, const enc_setting_t *current,
+                                                 const enc_rendition_t *rendition)
+{
+    enc_context_t *context;
+    struct jpeg_compress_struct *cinfo;
+    int i;
+    if (worker->generation != current->generation)
+    {
+        // scaler scratch for a row of RGB samples
+        free(worker->sums);
+        worker->sums = (uint16_t *)malloc(current->width * 3 * sizeof(uint16_t));
+        if (worker->sums == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate the scaler buffer: %s", strerror(errno));
+            return NULL;
+        }
+        worker->generation = current->generation;
+    }
+    for (i = 0; i < ENCODER_MAX_RENDITIONS; i++)
+    {
+        context = &worker->contexts[i];
+        if (context->generation == current->generation && context->rendition.width == rendition->width &&
+            context->rendition.quality == rendition->quality)
+        {
+            return &context->cinfo;
+        }
+    }
+    context = &worker->contexts[worker->next_context];
+    worker->next_context = (worker->next_context + 1) % ENCODER_MAX_RENDITIONS;
+    cinfo = &context->cinfo;
+    cinfo->image_width = rendition->width;
+    cinfo->image_height = rendition->height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = current->raw ? JCS_YCbCr : JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, rendition->quality, true);
+#ifdef JPEG_SIMD
+    // as fast as the others with the libjpeg-turbo SIMD routines
+    cinfo->dct_method = JDCT_ISLOW;
+#else
+    cinfo->dct_method = JDCT_IFAST;
+#endif
+    if (current->raw)
+    {
+        // the chroma planes are already downsampled 2x2
+        cinfo->raw_data_in = true;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+    }
+    context->rendition = *rendition;
+    context->generation = current->generation;
+    return cinfo;
+}
+
+/**
+ * @brief Keep the planes when they can hold height rows of the given
+ * width, allocate them again otherwise
+ */
+static int worker_planes(yuv_planes_t *planes, int width, int height, uint32_t pixelformat)
+{
+    if (planes->buffer && planes->width == width && planes->max_height >= height &&
+        (pixelformat != V4L2_PIX_FMT_YUYV || planes->scratch))
+    {
+        return 0;
+    }
+    yuv_planes_free(planes);
+    if (yuv_planes_init(planes, width, height, pixelformat) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate YCbCr planes: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return input buffers of the size of the rendition, the least recently
+ * added ones are replaced by a new size
+ */
+static int worker_buffers(enc_worker_t *worker, const enc_rendition_t *rendition)
+{
+    int i;
+    for (i = 0; i < ENCODER_MAX_RENDITIONS; i++)
+    {
+        if (worker->sizes[i].width == rendition->width && worker->sizes[i].height == rendition->height)
+        {
+            return i;
+        }
+    }
+    i = worker->next_size;
+    worker->next_size = (worker->next_size + 1) % ENCODER_MAX_RENDITIONS;
+    worker->sizes[i] = *rendition;
+    return i;
+}
+
+/**
+ * @brief Prepare the input of a slice: the rows of the frame, split in
+ * planes for YUYV and NV12, or the whole frame scaled down to the
+ * rendition
+ *
+ * @return the RGB rows to encode, or the captured ones, NULL on error
+ */
+static const uint8_t *worker_input(enc_worker_t *worker, const enc_setting_t *current, const uint8_t *raw,
+                                   const enc_rendition_t *rendition, int input, int first, int rows, int *stride)
+{
+    int scaled = rendition->width != current->width || rendition->height != current->height;
+    const uint8_t *chroma = NULL;
+    uint8_t *rgb;
+    size_t size;
+    *stride = current->bytesperline;
+    if (current->raw)
+    {
+        if (current->pixelformat == V4L2_PIX_FMT_NV12)
+        {
+            chroma = raw + current->height * current->bytesperline;
+        }
+        if (!scaled)
+        {
+            if (worker_planes(&worker->planes[input], current->width, current->slice_rows, current->pixelformat) == -1)
+            {
+                return NULL;
+            }
+            yuv_split(&worker->planes[input], raw + first * current->bytesperline,
+                      chroma ? chroma + first / 2 * current->bytesperline : NULL, current->bytesperline, rows,
+                      current->pixelformat);
+            return raw;
+        }
+        if (worker_planes(&worker->frame, current->width, current->height, current->pixelformat) == -1 ||
+            worker_planes(&worker->planes[input], rendition->width, rendition->height, V4L2_PIX_FMT_NV12) == -1)
+        {
+            return NULL;
+        }
+        yuv_split(&worker->frame, raw, chroma, current->bytesperline, current->height, current->pixelformat);
+        yuv_scale(&worker->frame, &worker->planes[input], rendition->height, worker->sums);
+        return raw;
+    }
+    if (!scaled)
+    {
+        return raw + first * current->bytesperline;
+    }
+    size = (size_t)rendition->width * 3 * rendition->height;
+    if (worker->rgb_size[input] < size)
+    {
+        rgb = (uint8_t *)realloc(worker->rgb[input], size);
+        if (rgb == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate the scaled frame: %s", strerror(errno));
+            return NULL;
+        }
+        worker->rgb[input] = rgb;
+        worker->rgb_size[input] = size;
+    }
+    yuv_scale_plane(raw, current->width, current->height, current->bytesperline, worker->rgb[input],
+                    rendition->width, rendition->height, rendition->width * 3, 3, worker->sums);
+    *stride = rendition->width * 3;
+    return worker->rgb[input];
+}
+
+/**
+ * @brief Feed the YCbCr planes to libjpeg, one MCU row at a time. The
+ * rows past the bottom of the image repeat the last one
+ */
+static void write_planes(struct jpeg_compress_struct *cinfo, yuv_planes_t *planes)
+{
+    JSAMPROW y[2 * DCTSIZE], u[DCTSIZE], v[DCTSIZE];
+    JSAMPARRAY data[3] = {y, u, v};
+    int rows = 2 * DCTSIZE;
+    int line, i, row;
+    for (line = 0; line < planes->height; line += rows)
+    {
+        for (i = 0; i < rows; i++)
+        {
+            row = line + i < planes->height ? line + i : planes->height - 1;
+            y[i] = planes->y + row * planes->y_stride;
+        }
+        for (i = 0; i < DCTSIZE; i++)
+        {
+            row = line / 2 + i;
+            row = row < planes->c_height ? row : planes->c_height - 1;
+            u[i] = planes->u + row * planes->c_stride;
+            v[i] = planes->v + row * planes->c_stride;
+        }
+        (void)jpeg_write_raw_data(cinfo, data, rows);
+    }
+}
+
+/**
+ * @brief Encode the rows of a slice as a JPEG image of its own, only the
+ * first slice has the tables
+ */
+static void encode_slice(enc_worker_t *worker, const enc_setting_t *current, enc_slot_t *slot, int stream, int index)
+{
+    enc_rendition_t *rendition = &slot->streams[stream].rendition;
+    enc_slice_t *slice = &slot->streams[stream].slices[index];
+    struct jpeg_compress_struct *cinfo;
+    int first = index * current->slice_rows;
+    int rows = rendition->height - first < current->slice_rows ? rendition->height - first : current->slice_rows;
+    unsigned long capacity;
+    unsigned long long start = now_us();
+    const uint8_t *frame;
+    uint8_t *buffer;
+    unsigned long size;
+    int stride, input;
+    JSAMPROW row_pointer[1];
+
+    slice->size = 0;
+    slice->convert_us = 0;
+    slice->encode_us = 0;
+    cinfo = worker_setup(worker, current, rendition);
+    if (cinfo == NULL)
+    {
+        return;
+    }
+    // a scaled rendition is a single slice
+    if (slot->streams[stream].n_slices == 1)
+    {
+        rows = rendition->height;
+    }
+    capacity = (unsigned long)rendition->width * rows / 4;
+    // first guess of the slice size, adjusted to the previous frames
+    if (slice->capacity < capacity)
+    {
+        buffer = (uint8_t *)realloc(slice->buffer, capacity);
+        if (buffer == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate the JPEG buffer: %s", strerror(errno));
+            return;
+        }
+        slice->buffer = buffer;
+        slice->capacity = capacity;
+    }
+    input = worker_buffers(worker, rendition);
+    frame = worker_input(worker, current, slot->raw, rendition, input, first, rows, &stride);
+    if (frame == NULL)
+    {
+        return;
+    }
+    slice->convert_us = now_us() - start;
+    start = now_us();
+    buffer = slice->buffer;
+    size = slice->capacity;
+    cinfo->image_height = rows;
+    jpeg_mem_dest(cinfo, &buffer, &size);
+    if (index > 0)
+    {
+        jpeg_suppress_tables(cinfo, true);
+    }
+    jpeg_start_compress(cinfo, index == 0);
+    if (current->raw)
+    {
+        write_planes(cinfo, &worker->planes[input]);
+    }
+    while (!current->raw && cinfo->next_scanline < cinfo->image_height)
+    {
+        row_pointer[0] = (JSAMPROW)(frame + cinfo->next_scanline * stride);
+        jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(cinfo);
+    slice->encode_us = now_us() - start;
+    // the slice did not fit, libjpeg moved it to a larger buffer of its own
+    if (buffer != slice->buffer)
+    {
+        free(slice->buffer);
+        // with some room for the next frames
+        slice->buffer = (uint8_t *)realloc(buffer, size + size / 4);
+        slice->capacity = size + size / 4;
+        if (slice->buffer == NULL)
+        {
+            slice->buffer = buffer;
+            slice->capacity = size;
+        }
+    }
+    slice->size = size;
+}
+
+static void *encoder_worker(void *arg)
+{
+    enc_worker_t *worker = (enc_worker_t *)arg;
+    enc_setting_t current;
+    enc_slot_t *slot;
+    uint64_t one = 1;
+    int job;
+    (void)pthread_mutex_lock(&lock);
+    while (1)
+    {
+        while (running && job_count == 0)
+        {
+            (void)pthread_cond_wait(&work, &lock);
+        }
+        if (!running)
+        {
+            break;
+        }
+        job = jobs[job_head];
+        job_head = (job_head + 1) % MAX_JOBS;
+        job_count--;
+        current = setting;
+        slot = &slots[job / ENCODER_MAX_SLICES / ENCODER_MAX_RENDITIONS];
+        (void)pthread_mutex_unlock(&lock);
+
+        encode_slice(worker, &current, slot, job / ENCODER_MAX_SLICES % ENCODER_MAX_RENDITIONS,
+                     job % ENCODER_MAX_SLICES);
+
+        (void)pthread_mutex_lock(&lock);
+        slot->pending--;
+        if (slot->pending == 0)
+        {
+            if (write(notify_fd, &one, sizeof(one)) != (int)sizeof(one))
+            {
+                M_ERROR(MODULE_NAME, "Unable to notify the encoded frame: %s", strerror(errno));
+            }
+            (void)pthread_cond_broadcast(&idle);
+        }
+    }
+    (void)pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @return offset of the first marker of the given type before the
+ * entropy coded data, -1 if there is none
+ */
+static long find_marker(const uint8_t *data, unsigned long size, uint8_t marker)
+{
+    unsigned long pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xFF)
+    {
+        if (data[pos + 1] == marker)
+        {
+            return (long)pos;
+        }
+        if (data[pos + 1] == MARKER_SOS)
+        {
+            return -1;
+        }
+        pos += 2 + (data[pos + 2] << 8 | data[pos + 3]);
+    }
+    return -1;
+}
+
+/**
+ * @brief Join the slices into one image: the headers of the first slice,
+ * with the height of the frame and a restart interval of one slice, then
+ * the entropy coded data of each slice separated by RSTn markers
+ *
+ * @return 0 on success, -1 on error
+ */
+static int join_slices(enc_stream_t *stream, enc_output_t *output)
+{
+    size_t size = 2 + 6;
+    long sof, sos;
+    size_t offset, length;
+    uint8_t *out;
+    int i;
+    for (i = 0; i < stream->n_slices; i++)
+    {
+        if (stream->slices[i].size < 4)
+        {
+            return -1;
+        }
+        size += stream->slices[i].size;
+    }
+    if (size > stream->capacity)
+    {
+        out = (uint8_t *)realloc(stream->buffer, size + size / 4);
+        if (out == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate the JPEG buffer: %s", strerror(errno));
+            return -1;
+        }
+        stream->buffer = out;
+        stream->capacity = size + size / 4;
+    }
+    out = stream->buffer;
+    sof = find_marker(stream->slices[0].buffer, stream->slices[0].size, MARKER_SOF0);
+    sos = find_marker(stream->slices[0].buffer, stream->slices[0].size, MARKER_SOS);
+    if (sof == -1 || sos == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unexpected JPEG headers in the first slice");
+        return -1;
+    }
+    (void)memcpy(out, stream->slices[0].buffer, sos);
+    out[sof + 5] = (uint8_t)(setting.height >> 8);
+    out[sof + 6] = (uint8_t)setting.height;
+    offset = sos;
+    out[offset++] = 0xFF;
+    out[offset++] = MARKER_DRI;
+    out[offset++] = 0;
+    out[offset++] = 4;
+    out[offset++] = (uint8_t)(setting.interval >> 8);
+    out[offset++] = (uint8_t)setting.interval;
+    // SOS header and data, up to the EOI marker
+    length = stream->slices[0].size - 2 - sos;
+    (void)memcpy(out + offset, stream->slices[0].buffer + sos, length);
+    offset += length;
+    for (i = 1; i < stream->n_slices; i++)
+    {
+        sos = find_marker(stream->slices[i].buffer, stream->slices[i].size, MARKER_SOS);
+        if (sos == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unexpected JPEG headers in slice %d", i);
+            return -1;
+        }
+        sos += 2 + (stream->slices[i].buffer[sos + 2] << 8 | stream->slices[i].buffer[sos + 3]);
+        out[offset++] = 0xFF;
+        out[offset++] = (uint8_t)(MARKER_RST0 + (i - 1) % 8);
+        length = stream->slices[i].size - 2 - sos;
+        (void)memcpy(out + offset, stream->slices[i].buffer + sos, length);
+        offset += length;
+    }
+    out[offset++] = 0xFF;
+    out[offset++] = MARKER_EOI;
+    output->data = out;
+    output->size = offset;
+    return 0;
+}
+
+int encoder_init(int n, int slices)
+{
+    sigset_t mask, old;
+    int i, j;
+    n_workers = n < 1 ? 1 : (n > ENCODER_MAX_WORKERS ? ENCODER_MAX_WORKERS : n);
+    max_slices = slices < 1 ? 1 : (slices > ENCODER_MAX_SLICES ? ENCODER_MAX_SLICES : slices);
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create the encoder eventfd: %s", strerror(errno));
+        return -1;
+    }
+    running = 1;
+    // signals are handled by the event loop
+    (void)sigfillset(&mask);
+    (void)pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for (i = 0; i < n_workers; i++)
+    {
+        (void)jpeg_std_error(&workers[i].jerror);
+        for (j = 0; j < ENCODER_MAX_RENDITIONS; j++)
+        {
+            workers[i].contexts[j].cinfo.err = &workers[i].jerror;
+            jpeg_create_compress(&workers[i].contexts[j].cinfo);
+        }
+        if (pthread_create(&workers[i].thread, NULL, encoder_worker, &workers[i]) != 0)
+        {
+            M_ERROR(MODULE_NAME, "Unable to start encoder worker %d", i);
+            for (j = 0; j < ENCODER_MAX_RENDITIONS; j++)
+            {
+                jpeg_destroy_compress(&workers[i].contexts[j].cinfo);
+            }
+            break;
+        }
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (i == 0)
+    {
+        (void)close(notify_fd);
+        notify_fd = -1;
+        running = 0;
+        return -1;
+    }
+    n_workers = i;
+    M_LOG(MODULE_NAME, "Encode with %d workers, up to %d slices per frame", n_workers, max_slices);
+    return notify_fd;
+}
+
+void encoder_setup(int width, int height, uint32_t pixelformat, int bytesperline)
+{
+    int mcu_rows = (height + MCU_SIZE - 1) / MCU_SIZE;
+    int mcu_cols = (width + MCU_SIZE - 1) / MCU_SIZE;
+    int per_slice;
+    (void)pthread_mutex_lock(&lock);
+    setting.width = width;
+    setting.height = height;
+    setting.pixelformat = pixelformat;
+    setting.raw = pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_NV12;
+    if (bytesperline == 0)
+    {
+        bytesperline = pixelformat == V4L2_PIX_FMT_YUYV ? width * 2 : (pixelformat == V4L2_PIX_FMT_NV12 ? width : width * 3);
+    }
+    setting.bytesperline = bytesperline;
+    per_slice = (mcu_rows + max_slices - 1) / max_slices;
+    // the restart interval is a 16 bits count of MCUs
+    if (per_slice * mcu_cols > 0xFFFF)
+    {
+        per_slice = mcu_rows;
+    }
+    setting.slice_rows = per_slice * MCU_SIZE;
+    setting.n_slices = (mcu_rows + per_slice - 1) / per_slice;
+    setting.interval = per_slice * mcu_cols;
+    setting.generation++;
+    (void)pthread_mutex_unlock(&lock);
+    if (setting.n_slices > 1)
+    {
+        M_LOG(MODULE_NAME, "Encode %d slices of %d rows per frame", setting.n_slices, setting.slice_rows);
+    }
+}
+
+int encoder_submit(int index, const uint8_t *frame, const enc_rendition_t *renditions, int n)
+{
+    enc_slot_t *slot;
+    enc_stream_t *stream;
+    int slot_index, i, j;
+    (void)pthread_mutex_lock(&lock);
+    if (count == n_workers)
+    {
+        (void)pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    slot_index = (head + count) % n_workers;
+    slot = &slots[slot_index];
+    slot->frame.index = index;
+    slot->frame.slot = slot_index;
+    slot->frame.n_outputs = n < ENCODER_MAX_RENDITIONS ? n : ENCODER_MAX_RENDITIONS;
+    slot->raw = frame;
+    slot->pending = 0;
+    for (i = 0; i < slot->frame.n_outputs; i++)
+    {
+        stream = &slot->streams[i];
+        stream->rendition = renditions[i];
+        // never scaled up
+        if (stream->rendition.width == 0 || stream->rendition.width > setting.width)
+        {
+            stream->rendition.width = setting.width;
+        }
+        if (stream->rendition.height == 0 || stream->rendition.height > setting.height)
+        {
+            stream->rendition.height = setting.height;
+        }
+        stream->n_slices = 1;
+        if (stream->rendition.width == setting.width && stream->rendition.height == setting.height)
+        {
+            stream->n_slices = setting.n_slices;
+        }
+        for (j = 0; j < stream->n_slices; j++)
+        {
+            jobs[(job_head + job_count) % MAX_JOBS] =
+                (slot_index * ENCODER_MAX_RENDITIONS + i) * ENCODER_MAX_SLICES + j;
+            job_count++;
+        }
+        slot->pending += stream->n_slices;
+    }
+    count++;
+    (void)pthread_cond_broadcast(&work);
+    (void)pthread_mutex_unlock(&lock);
+    return slot_index;
+}
+
+enc_frame_t *encoder_done(void)
+{
+    enc_slot_t *slot;
+    enc_stream_t *stream;
+    enc_output_t *output;
+    uint64_t value;
+    int i, j;
+    // cleared before looking at the frames, a frame encoded after that
+    // notifies again
+    if (read(notify_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    {
+        M_ERROR(MODULE_NAME, "Unable to read the encoder eventfd: %s", strerror(errno));
+    }
+    (void)pthread_mutex_lock(&lock);
+    if (count == 0 || slots[head].pending > 0)
+    {
+        (void)pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    slot = &slots[head];
+    (void)pthread_mutex_unlock(&lock);
+    slot->frame.convert_us = 0;
+    slot->frame.encode_us = 0;
+    for (i = 0; i < slot->frame.n_outputs; i++)
+    {
+        stream = &slot->streams[i];
+        output = &slot->frame.outputs[i];
+        output->rendition = stream->rendition;
+        output->data = NULL;
+        output->size = 0;
+        for (j = 0; j < stream->n_slices; j++)
+        {
+            slot->frame.convert_us += stream->slices[j].convert_us;
+            slot->frame.encode_us += stream->slices[j].encode_us;
+        }
+        if (stream->n_slices == 1)
+        {
+            output->data = stream->slices[0].buffer;
+            output->size = stream->slices[0].size;
+        }
+        else
+        {
+            (void)join_slices(stream, output);
+        }
+    }
+    return &slot->frame;
+}
+
+void encoder_release(enc_frame_t *frame)
+{
+    (void)frame;
+    (void)pthread_mutex_lock(&lock);
+    head = (head + 1) % n_workers;
+    count--;
+    (void)pthread_mutex_unlock(&lock);
+}
+
+void encoder_flush(void)
+{
+    uint64_t value;
+    int i;
+    (void)pthread_mutex_lock(&lock);
+    // drop the slices not started yet, wait for the others
+    while (job_count > 0)
+    {
+        slots[jobs[job_head] / ENCODER_MAX_SLICES / ENCODER_MAX_RENDITIONS].pending--;
+        job_head = (job_head + 1) % MAX_JOBS;
+        job_count--;
+    }
+    for (i = 0; i < count; i++)
+    {
+        while (slots[(head + i) % n_workers].pending > 0)
+        {
+            (void)pthread_cond_wait(&idle, &lock);
+        }
+    }
+    head = 0;
+    count = 0;
+    (void)pthread_mutex_unlock(&lock);
+    if (read(notify_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    {
+        M_ERROR(MODULE_NAME, "Unable to read the encoder eventfd: %s", strerror(errno));
+    }
+}
+
+void encoder_close(void)
+{
+    enc_stream_t *stream;
+    int i, j, k;
+    if (!running)
+    {
+        return;
+    }
+    encoder_flush();
+    (void)pthread_mutex_lock(&lock);
+    running = 0;
+    (void)pthread_cond_broadcast(&work);
+    (void)pthread_mutex_unlock(&lock);
+    for (i = 0; i < n_workers; i++)
+    {
+        (void)pthread_join(workers[i].thread, NULL);
+        yuv_planes_free(&workers[i].frame);
+        free(workers[i].sums);
+        workers[i].sums = NULL;
+        for (j = 0; j < ENCODER_MAX_RENDITIONS; j++)
+        {
+            jpeg_destroy_compress(&workers[i].contexts[j].cinfo);
+            (void)memset(&workers[i].contexts[j].rendition, 0, sizeof(workers[i].contexts[j].rendition));
+            yuv_planes_free(&workers[i].planes[j]);
+            (void)memset(&workers[i].sizes[j], 0, sizeof(workers[i].sizes[j]));
+            free(workers[i].rgb[j]);
+            workers[i].rgb[j] = NULL;
+            workers[i].rgb_size[j] = 0;
+            stream = &slots[i].streams[j];
+            for (k = 0; k < ENCODER_MAX_SLICES; k++)
+            {
+                free(stream->slices[k].buffer);
+                stream->slices[k].buffer = NULL;
+                stream->slices[k].capacity = 0;
+            }
+            free(stream->buffer);
+            stream->buffer = NULL;
+            stream->capacity = 0;
+        }
+    }
+    (void)close(notify_fd);
+    notify_fd = -1;
+}
@@ -0,0 +1,80 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define ENCODER_MAX_WORKERS 16
+#define ENCODER_MAX_SLICES 16
+#define ENCODER_MAX_RENDITIONS 8
+
+/**
+ * @brief Size and quality of a stream, at most the size of the capture
+ */
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    uint8_t quality;
+} enc_rendition_t;
+
+typedef struct
+{
+    enc_rendition_t rendition;
+    /** JPEG frame, NULL or empty if the encoding failed */
+    uint8_t *data;
+    size_t size;
+} enc_output_t;
+
+/**
+ * @brief Frame handed to the pool, returned by encoder_done() in the
+ * order of submission
+ */
+typedef struct
+{
+    /** capture buffer of the frame, queued again once it is encoded */
+    int index;
+    /** position of the frame in the pool, as returned by encoder_submit() */
+    int slot;
+    /** one per rendition asked for */
+    enc_output_t outputs[ENCODER_MAX_RENDITIONS];
+    int n_outputs;
+    /** CPU time spent deinterleaving, scaling and encoding, all outputs
+     * included */
+    unsigned long long convert_us;
+    unsigned long long encode_us;
+} enc_frame_t;
+
+/**
+ * @brief Start the workers, the renditions of the capture size are
+ * encoded in slices restart intervals by as many workers
+ *
+ * @return a descriptor readable when a frame is encoded, -1 on error
+ */
+int encoder_init(int workers, int slices);
+/**
+ * @brief Format of the captured frames, the pool must be idle
+ */
+void encoder_setup(int width, int height, uint32_t pixelformat, int bytesperline);
+/**
+ * @brief Queue a captured frame, each rendition is scaled down from it
+ * and encoded once
+ *
+ * @return slot of the frame, less than ENCODER_MAX_WORKERS, -1 if all
+ * workers are busy
+ */
+int encoder_submit(int index, const uint8_t *frame, const enc_rendition_t *renditions, int n);
+/**
+ * @return the oldest frame if it is encoded, NULL otherwise
+ */
+enc_frame_t *encoder_done(void);
+/**
+ * @brief Free the slot of the frame returned by encoder_done()
+ */
+void encoder_release(enc_frame_t *frame);
+/**
+ * @brief Wait for the frames in progress and drop them
+ */
+void encoder_flush(void);
+void encoder_close(void);
+
+#endif
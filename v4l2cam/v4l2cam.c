@@ -1,5 +1,6 @@
 #include <linux/videodev2.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -11,35 +12,150 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <stdio.h>
-#include <jpeglib.h>
 #include <sys/ioctl.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <sys/time.h>
 
 #include "../tunnel.h"
+#include "encoder.h"
 
 #define MODULE_NAME "v4l2cam"
 #define DEV_SIZE 32
+#define DEFAULT_N_BUFFERS 4
+/** setting of a new client */
+#define DEFAULT_WIDTH 640
+#define DEFAULT_HEIGHT 480
+#define DEFAULT_FPS 5
+#define DEFAULT_QUALITY 60
+/** seconds between two logs of the capture statistics */
+#define STATS_PERIOD 10
+/** frame path reported in the CTRL settings reply */
+#define CAM_PATH_ENCODE 0
+#define CAM_PATH_MJPEG 1
+#define CAM_PATH_YUYV 2
+#define CAM_PATH_NV12 3
 
 typedef struct
 {
+    uint8_t *start;
+    int length;
+} cam_buffer_t;
+
+/**
+ * @brief Setting of a client, each distinct size and quality is encoded
+ * once per frame for all the clients asking for it
+ */
+typedef struct
+{
+    /** as asked for in the CTRL message */
+    uint16_t width;
+    uint16_t height;
+    uint8_t fps;
+    uint8_t quality;
+    /** what the client gets, at most the size of the capture */
+    enc_rendition_t rendition;
+    /** the client gets a frame at the current tick */
+    uint8_t due;
+    /** time of the next frame, in us */
+    unsigned long long next_at;
+    /** bit n is set while the frame in encoder slot n is for the client */
+    uint32_t frames;
+} cam_client_t;
+
+typedef struct
+{
+    /** capture size, the largest one asked for, adjusted by the driver */
     uint16_t width;
     uint16_t height;
+    /** capture rate, the highest one asked for */
     uint8_t fps;
-    uint8_t jpeg_quality;
+    /** largest size asked for, before the driver adjusts it */
+    uint16_t request_width;
+    uint16_t request_height;
+    /** all the clients ask for the same size */
+    uint8_t same_size;
+    /** distinct sizes and qualities of the clients */
+    enc_rendition_t renditions[ENCODER_MAX_RENDITIONS];
+    int n_renditions;
+    /** capture format chosen by cam_set_format() */
+    uint32_t pixelformat;
+    int bytesperline;
+    /** forward the MJPEG frames of the camera when it supports it and all
+     * the clients ask for the same size */
+    uint8_t mjpeg;
+    /** encode the YUYV or NV12 frames of the camera without RGB conversion */
+    uint8_t yuv;
+    /** frame being sent */
     uint8_t *raw_buffer;
     int fd;
     int timerfd;
-    int raw_size;
+    /** readable when the encoder workers have a frame ready */
+    int encoderfd;
     char dev_name[DEV_SIZE];
-    uint8_t queued;
+    /** mmapped capture buffers, all queued but the ready one and the
+     * ones being encoded */
+    cam_buffer_t buffers[VIDEO_MAX_FRAME];
+    int n_buffers;
+    int n_mapped;
+    /** index of the most recent filled buffer, -1 if none */
+    int ready;
+    /** bytes used in the ready buffer */
+    int ready_size;
+    /** the timer expired without a ready frame or a free encoder worker,
+     * send the next one */
+    uint8_t due;
+    uint8_t streaming;
+    /** sequence number of the last dequeued frame */
+    uint32_t sequence;
+    /** sent frames, frames replaced by a newer one or lost by the driver
+     * and timer periods missed since the last log */
+    unsigned long frames;
+    unsigned long dropped;
+    unsigned long late;
+    /** CPU time spent deinterleaving and encoding the sent frames */
+    unsigned long long convert_us;
+    unsigned long long encode_us;
+    unsigned long long stats_at;
 } cam_setting_t;
 
 static bst_node_t *clients = NULL;
+/** fan out list of the frames, one entry per client */
+static uint16_t *client_ids = NULL;
+static int n_clients = 0;
 static cam_setting_t video_setting;
 static volatile int running = 1;
 
+static unsigned long long now_us()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static unsigned long long now_ms()
+{
+    return now_us() / 1000u;
+}
+
+/**
+ * @return 1 if the device captures in pixelformat, 0 otherwise
+ */
+static int cam_has_format(int fd, uint32_t pixelformat)
+{
+    struct v4l2_fmtdesc desc = {0};
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0)
+    {
+        if (desc.pixelformat == pixelformat)
+        {
+            return 1;
+        }
+        desc.index++;
+    }
+    return 0;
+}
+
 static int cam_set_format(cam_setting_t *opts)
 {
     struct v4l2_format format = {0};
@@ -47,13 +163,39 @@ static int cam_set_format(cam_setting_t *opts)
     format.fmt.pix.width = (unsigned int)opts->width;
     format.fmt.pix.height = (unsigned int)opts->height;
     format.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
+    // the camera frames are sent as is, without encoding
+    if (opts->mjpeg && opts->same_size && cam_has_format(opts->fd, V4L2_PIX_FMT_MJPEG))
+    {
+        format.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+    }
+    // or encoded from the YCbCr samples of the sensor
+    else if (opts->yuv && cam_has_format(opts->fd, V4L2_PIX_FMT_YUYV))
+    {
+        format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    }
+    else if (opts->yuv && cam_has_format(opts->fd, V4L2_PIX_FMT_NV12))
+    {
+        format.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    }
     format.fmt.pix.field = V4L2_FIELD_ANY;
     int res = ioctl(opts->fd, VIDIOC_S_FMT, &format);
+    if (res == 0 && format.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG && format.fmt.pix.pixelformat != V4L2_PIX_FMT_RGB24 &&
+        format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV && format.fmt.pix.pixelformat != V4L2_PIX_FMT_NV12)
+    {
+        format.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24;
+        res = ioctl(opts->fd, VIDIOC_S_FMT, &format);
+    }
     if (res == -1)
     {
         M_ERROR(MODULE_NAME, "Could not set image format: %s", strerror(errno));
         return -1;
     }
+    // the driver may adjust the size to the closest one it supports
+    opts->pixelformat = format.fmt.pix.pixelformat;
+    opts->width = (uint16_t)format.fmt.pix.width;
+    opts->height = (uint16_t)format.fmt.pix.height;
+    opts->bytesperline = format.fmt.pix.bytesperline;
+    M_LOG(MODULE_NAME, "Capture %dx%d in %.4s", opts->width, opts->height, (char *)&opts->pixelformat);
     /*
    * set framerate
    */
@@ -65,6 +207,7 @@ static int cam_set_format(cam_setting_t *opts)
     setfps->parm.capture.timeperframe.numerator = 1;
     setfps->parm.capture.timeperframe.denominator = (unsigned int)opts->fps;
     res = ioctl(opts->fd, VIDIOC_S_PARM, setfps);
+    free(setfps);
     if (res == -1)
     {
         M_ERROR(MODULE_NAME, "Could not set image format: %s", strerror(errno));
@@ -74,6 +217,9 @@ static int cam_set_format(cam_setting_t *opts)
     return 0;
 }
 
+/**
+ * @return number of buffers allocated by the driver, -1 on error
+ */
 static int cam_request_buffer(int fd, int count)
 {
     struct v4l2_requestbuffers req = {0};
@@ -85,225 +231,424 @@ static int cam_request_buffer(int fd, int count)
         M_ERROR(MODULE_NAME, "Unable to request cam buffer: %s", strerror(errno));
         return -1;
     }
-    return 0;
+    return req.count > VIDEO_MAX_FRAME ? VIDEO_MAX_FRAME : (int)req.count;
 }
 
-static int cam_query_buffer(cam_setting_t *opts)
+static int cam_query_buffer(cam_setting_t *opts, int index)
 {
     struct v4l2_buffer buf = {0};
+    void *start;
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = 0;
+    buf.index = index;
     int res = ioctl(opts->fd, VIDIOC_QUERYBUF, &buf);
     if (res == -1)
     {
-        M_ERROR(MODULE_NAME, "Could not query buffer: %s", strerror(errno));
+        M_ERROR(MODULE_NAME, "Could not query buffer %d: %s", index, strerror(errno));
         return -1;
     }
-    opts->raw_buffer = (u_int8_t *)mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, opts->fd, buf.m.offset);
-    opts->raw_size = buf.length;
+    start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, opts->fd, buf.m.offset);
+    if (start == MAP_FAILED)
+    {
+        M_ERROR(MODULE_NAME, "Unable to map buffer %d: %s", index, strerror(errno));
+        return -1;
+    }
+    opts->buffers[index].start = (uint8_t *)start;
+    opts->buffers[index].length = buf.length;
     return buf.length;
 }
 
 static int cam_release_buffer(cam_setting_t *opts)
 {
-    if (opts->raw_buffer == NULL)
+    int status = 0;
+    while (opts->n_mapped > 0)
     {
-        return 0;
-    }
-    if (munmap(opts->raw_buffer, opts->raw_size) == -1)
-    {
-        M_ERROR(MODULE_NAME, "Error munmap: %s", strerror(errno));
-        return -1;
+        opts->n_mapped--;
+        if (munmap(opts->buffers[opts->n_mapped].start, opts->buffers[opts->n_mapped].length) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Error munmap: %s", strerror(errno));
+            status = -1;
+        }
     }
     opts->raw_buffer = NULL;
-    opts->raw_size = 0;
-    return 0;
+    opts->ready = -1;
+    return status;
 }
 
-int cam_start_streaming(int fd)
+int cam_queue_buffer(int fd, int index)
 {
-    unsigned int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(fd, VIDIOC_STREAMON, &type) == -1)
+    struct v4l2_buffer bufd = {0};
+    bufd.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bufd.memory = V4L2_MEMORY_MMAP;
+    bufd.index = index;
+    if (-1 == ioctl(fd, VIDIOC_QBUF, &bufd))
     {
-        M_ERROR(MODULE_NAME, "Unable to start VIDIOC_STREAMON: %s", strerror(errno));
+        M_ERROR(MODULE_NAME, "Unable to queue buffer %d on %d: %s", index, fd, strerror(errno));
         return -1;
     }
     return 0;
 }
 
-int cam_queue_buffer(int fd)
+/**
+ * @brief Dequeue a filled buffer, the device is non blocking
+ *
+ * @return 1 if a buffer is dequeued, 0 if none is filled, -1 on error
+ */
+int cam_dequeue_buffer(int fd, struct v4l2_buffer *bufd)
 {
-    struct v4l2_buffer bufd = {0};
-    bufd.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufd.memory = V4L2_MEMORY_MMAP;
-    bufd.index = 0;
-    if (-1 == ioctl(fd, VIDIOC_QBUF, &bufd))
+    (void)memset(bufd, 0, sizeof(*bufd));
+    bufd->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bufd->memory = V4L2_MEMORY_MMAP;
+    if (-1 == ioctl(fd, VIDIOC_DQBUF, bufd))
     {
-        M_ERROR(MODULE_NAME, "Unable to queue buffer on %d: %s", fd, strerror(errno));
+        if (errno == EAGAIN)
+        {
+            return 0;
+        }
+        M_ERROR(MODULE_NAME, "Unable to dequeue buffer: %s", strerror(errno));
         return -1;
     }
-    return bufd.bytesused;
+    return 1;
 }
 
-int cam_dequeue_buffer(int fd)
+/**
+ * @brief Queue all the buffers and start the capture
+ */
+int cam_start_streaming(cam_setting_t *opts)
 {
-    struct v4l2_buffer bufd = {0};
-    bufd.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufd.memory = V4L2_MEMORY_MMAP;
-    bufd.index = 0;
-    if (-1 == ioctl(fd, VIDIOC_DQBUF, &bufd))
+    unsigned int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int i;
+    for (i = 0; i < opts->n_mapped; i++)
     {
-        M_ERROR(MODULE_NAME, "Unable to dequeue buffer: %s", strerror(errno));
+        if (cam_queue_buffer(opts->fd, i) == -1)
+        {
+            return -1;
+        }
+    }
+    if (ioctl(opts->fd, VIDIOC_STREAMON, &type) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to start VIDIOC_STREAMON: %s", strerror(errno));
         return -1;
     }
-    return bufd.bytesused;
+    opts->streaming = 1;
+    opts->ready = -1;
+    opts->due = 0;
+    opts->sequence = 0;
+    opts->frames = 0;
+    opts->dropped = 0;
+    opts->late = 0;
+    opts->convert_us = 0;
+    opts->encode_us = 0;
+    opts->stats_at = now_ms();
+    return 0;
 }
 
-int cam_jpeg_commpress(cam_setting_t *opts, uint8_t **out)
+/**
+ * @brief Dequeue the filled buffers and keep the most recent one, the
+ * older ones are queued again right away
+ */
+static int cam_collect_frames(cam_setting_t *opts)
 {
-    uint8_t *tmp = opts->raw_buffer;
-    struct jpeg_compress_struct cinfo = {0};
-    struct jpeg_error_mgr jerror = {0};
-    cinfo.err = jpeg_std_error(&jerror);
-    jerror.trace_level = 10;
-    cinfo.err->trace_level = 10;
-    jpeg_create_compress(&cinfo);
-
-    unsigned long outbuffer_size = 0;
-    jpeg_mem_dest(&cinfo, out, &outbuffer_size);
-    cinfo.image_width = opts->width;
-    cinfo.image_height = opts->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, opts->jpeg_quality, true);
-    jpeg_start_compress(&cinfo, true);
-    //unsigned counter = 0;
-    JSAMPROW row_pointer[1];
-    row_pointer[0] = NULL;
-
-    while (cinfo.next_scanline < cinfo.image_height)
+    struct v4l2_buffer bufd;
+    int rc;
+    while ((rc = cam_dequeue_buffer(opts->fd, &bufd)) == 1)
     {
-        row_pointer[0] = (JSAMPROW)(&tmp[cinfo.next_scanline * opts->width * 3]);
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        // frames the driver had no buffer for
+        if (opts->sequence != 0 && bufd.sequence > opts->sequence + 1)
+        {
+            opts->dropped += bufd.sequence - opts->sequence - 1;
+        }
+        opts->sequence = bufd.sequence;
+        if (opts->ready != -1)
+        {
+            opts->dropped++;
+            if (cam_queue_buffer(opts->fd, opts->ready) == -1)
+            {
+                return -1;
+            }
+        }
+        opts->ready = bufd.index;
+        opts->ready_size = bufd.bytesused;
     }
+    return rc;
+}
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    return outbuffer_size;
+static int cam_same_rendition(const enc_rendition_t *a, const enc_rendition_t *b)
+{
+    return a->width == b->width && a->height == b->height && a->quality == b->quality;
 }
 
-int cam_grab_frame(cam_setting_t *opts)
+/**
+ * @brief Mark the clients due for a frame at this tick and the
+ * renditions they get
+ */
+static void cam_due_client(bst_node_t *node, void **argv, int argc)
 {
-    if (cam_queue_buffer(opts->fd) == -1)
-        return -1;
-    //Wait for io operation
-    fd_set fds;
-    uint8_t *jpeg_frame = NULL;
-    FD_ZERO(&fds);
-    FD_SET(opts->fd, &fds);
-    struct timeval tv = {0};
-    tv.tv_sec = 2; //set timeout to 2 second
-    int r = select(opts->fd + 1, &fds, NULL, NULL, &tv);
-    if (r == -1)
-    {
-        M_ERROR(MODULE_NAME, "Error on Waiting for Frame: %s", strerror(errno));
-        return -1;
-    }
-    if (r == 0)
+    (void)argc;
+    cam_client_t *client = (cam_client_t *)node->data;
+    unsigned long long now = *(unsigned long long *)argv[0];
+    int *due = (int *)argv[1];
+    cam_setting_t *opts = (cam_setting_t *)argv[2];
+    unsigned long long period;
+    int i;
+    if (client == NULL)
     {
-        // time out
-        return -1;
+        return;
     }
-    size_t size = cam_jpeg_commpress(opts, &jpeg_frame);
-    // send to other endpoint
-    int file = open("/home/root/output.jpeg", O_RDWR | O_CREAT, 0777);
-    if (file == -1)
+    // within half a period, the ticks of the timer are not exactly
+    // aligned with the ones of the client
+    period = 1000000u / client->fps;
+    client->due = now + period / 2 >= client->next_at;
+    if (!client->due)
     {
-        M_ERROR(MODULE_NAME, "Unable to open file for save: %s", strerror(errno));
+        return;
     }
-    else
+    for (i = 0; i < opts->n_renditions; i++)
     {
-        if (write(file, jpeg_frame, size) == -1)
+        if (cam_same_rendition(&opts->renditions[i], &client->rendition))
         {
-            M_ERROR(MODULE_NAME, "Unable to write frame to file: %s", strerror(errno));
+            *due |= 1 << i;
         }
-        close(file);
-        M_LOG(MODULE_NAME, "written %d bytes to file", (int)size);
     }
+}
 
-    free(jpeg_frame);
-    //size is obtained from the query_buffer function
-    return cam_dequeue_buffer(opts->fd);
+/**
+ * @brief Schedule the next frame of a due client, the frame in slot is
+ * for it
+ */
+static void cam_advance_client(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    cam_client_t *client = (cam_client_t *)node->data;
+    unsigned long long now = *(unsigned long long *)argv[0];
+    int slot = *(int *)argv[1];
+    unsigned long long period;
+    if (client == NULL || !client->due)
+    {
+        return;
+    }
+    period = 1000000u / client->fps;
+    // a client missing a whole period starts again from now, without a
+    // burst of frames to catch up
+    client->next_at = client->next_at + period > now ? client->next_at + period : now + period;
+    if (slot != -1)
+    {
+        client->frames |= 1u << slot;
+    }
 }
 
-static void send_data(bst_node_t *node, void **argv, int argc)
+/**
+ * @brief List the clients a frame goes to: the due ones for slot -1,
+ * those waiting for the rendition in the slot otherwise
+ */
+static void cam_frame_clients(bst_node_t *node, void **argv, int argc)
 {
     (void)argc;
-    tunnel_msg_t *msg = (tunnel_msg_t *)argv[0];
-    int *fd = (int *)argv[1];
-    msg->header.client_id = node->key;
-    if (msg_write(*fd, msg) == -1)
+    cam_client_t *client = (cam_client_t *)node->data;
+    int slot = *(int *)argv[0];
+    enc_rendition_t *rendition = (enc_rendition_t *)argv[1];
+    int *n = (int *)argv[2];
+    if (client == NULL)
     {
-        M_ERROR(MODULE_NAME, "Unable to write data message to client %d", node->key);
+        return;
+    }
+    if (slot == -1 ? client->due
+                   : (client->frames & (1u << slot)) &&
+                         cam_same_rendition(rendition, &client->rendition))
+    {
+        client_ids[(*n)++] = (uint16_t)node->key;
     }
 }
-static int cam_send_frame_client(cam_setting_t *opts, int sock, bst_node_t *client)
+
+static void cam_clear_slot(bst_node_t *node, void **argv, int argc)
 {
-    if (opts->queued == 0)
+    (void)argc;
+    int slot = *(int *)argv[0];
+    if (node->data)
     {
-        return 0;
+        ((cam_client_t *)node->data)->frames &= ~(1u << slot);
     }
+}
+
+/**
+ * @brief Send a JPEG frame to the clients of a slot and rendition, or to
+ * the due clients when slot is -1
+ */
+static void cam_send_jpeg(int sock, int slot, enc_rendition_t *rendition, uint8_t *data, size_t size)
+{
     tunnel_msg_t msg;
-    uint8_t *jpeg_frame = NULL;
-    if (clients)
+    void *args[3];
+    int n = 0;
+    args[0] = (void *)&slot;
+    args[1] = (void *)rendition;
+    args[2] = (void *)&n;
+    // a corrupted capture may have no data
+    if (clients == NULL || size == 0)
     {
-        size_t size = cam_jpeg_commpress(opts, &jpeg_frame);
-        // send to other endpoint
-        //size is obtained from the query_buffer function
+        return;
+    }
+    bst_for_each(clients, cam_frame_clients, args, 3);
+    if (n == 0)
+    {
+        return;
+    }
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.client_id = 0;
+    msg.header.size = size;
+    msg.data = data;
+    if (msg_write_fanout(sock, &msg, client_ids, n) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write data message to %d clients", n);
+    }
+}
 
-        msg.header.type = CHANNEL_DATA;
-        msg.header.size = size;
-        msg.data = (uint8_t *)jpeg_frame;
-        void *args[2];
-        args[0] = (void *)&msg;
-        args[1] = (void *)&sock;
-        bst_for_each(clients, send_data, args, 2);
-        free(jpeg_frame);
+/**
+ * @brief Hand the ready frame to the encoder workers with the renditions
+ * of the clients due at this tick, or send it as is to them when the
+ * camera captures in MJPEG and queue its buffer again
+ */
+static int cam_send_frame_client(cam_setting_t *opts, int sock, bst_node_t *client)
+{
+    enc_rendition_t renditions[ENCODER_MAX_RENDITIONS];
+    unsigned long long now = now_us();
+    void *args[3];
+    int due = 0, n = 0, slot = -1, i;
+    if (opts->ready == -1 || client == NULL)
+    {
+        return 0;
+    }
+    args[0] = (void *)&now;
+    args[1] = (void *)&due;
+    args[2] = (void *)opts;
+    bst_for_each(client, cam_due_client, args, 3);
+    // no client wants a frame yet, a newer one may replace it
+    if (due == 0)
+    {
+        return 0;
+    }
+    if (opts->pixelformat != V4L2_PIX_FMT_MJPEG)
+    {
+        for (i = 0; i < opts->n_renditions; i++)
+        {
+            if (due & (1 << i))
+            {
+                renditions[n++] = opts->renditions[i];
+            }
+        }
+        // the buffer is queued again once the frame is encoded
+        slot = encoder_submit(opts->ready, opts->buffers[opts->ready].start, renditions, n);
+        if (slot == -1)
+        {
+            opts->due = 1;
+            return 0;
+        }
+        opts->ready = -1;
+        args[1] = (void *)&slot;
+        bst_for_each(client, cam_advance_client, args, 2);
+        return 0;
     }
-    if (cam_dequeue_buffer(opts->fd) == -1)
+    opts->raw_buffer = opts->buffers[opts->ready].start;
+    cam_send_jpeg(sock, -1, NULL, opts->raw_buffer, opts->ready_size);
+    opts->raw_buffer = NULL;
+    opts->frames++;
+    args[1] = (void *)&slot;
+    bst_for_each(client, cam_advance_client, args, 2);
+    if (cam_queue_buffer(opts->fd, opts->ready) == -1)
     {
         return -1;
     }
-    opts->queued = 0;
+    opts->ready = -1;
     return 0;
 }
 
-static int cam_stop_streaming(int fd)
+/**
+ * @brief Send the renditions of the encoded frames in capture order and
+ * queue their buffers again
+ */
+static int cam_send_encoded(cam_setting_t *opts, int sock)
+{
+    enc_frame_t *frame;
+    void *args[1];
+    int status = 0;
+    int i;
+    while ((frame = encoder_done()) != NULL)
+    {
+        for (i = 0; i < frame->n_outputs; i++)
+        {
+            cam_send_jpeg(sock, frame->slot, &frame->outputs[i].rendition, frame->outputs[i].data,
+                          frame->outputs[i].size);
+        }
+        args[0] = (void *)&frame->slot;
+        bst_for_each(clients, cam_clear_slot, args, 1);
+        opts->frames++;
+        opts->convert_us += frame->convert_us;
+        opts->encode_us += frame->encode_us;
+        if (cam_queue_buffer(opts->fd, frame->index) == -1)
+        {
+            status = -1;
+        }
+        encoder_release(frame);
+    }
+    return status;
+}
+
+/**
+ * @brief Stop the capture, the driver takes back all the buffers, the
+ * frames being encoded are dropped
+ */
+static int cam_stop_streaming(cam_setting_t *opts)
 {
     int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(fd, VIDIOC_STREAMON, &type) == -1)
+    void *args[1];
+    int slot;
+    if (!opts->streaming)
+    {
+        return 0;
+    }
+    encoder_flush();
+    args[0] = (void *)&slot;
+    for (slot = 0; slot < ENCODER_MAX_WORKERS; slot++)
+    {
+        bst_for_each(clients, cam_clear_slot, args, 1);
+    }
+    opts->streaming = 0;
+    opts->ready = -1;
+    if (ioctl(opts->fd, VIDIOC_STREAMOFF, &type) == -1)
     {
         M_ERROR(MODULE_NAME, "Error on VIDIOC_STREAMOFF: %s", strerror(errno));
         return -1;
     }
     return 0;
 }
-static int cam_cleanup(cam_setting_t *opts, int close_fd)
+
+static void cam_log_stats(cam_setting_t *opts)
 {
-    if (video_setting.queued == 1)
+    unsigned long long now = now_ms();
+    if (opts->stats_at == 0)
     {
-        if (cam_dequeue_buffer(video_setting.fd) == -1)
-        {
-            return -1;
-        }
-        else
-        {
-            video_setting.queued = 0;
-        }
+        opts->stats_at = now;
+        return;
+    }
+    if (now < opts->stats_at + STATS_PERIOD * 1000u)
+    {
+        return;
     }
-    if (cam_stop_streaming(opts->fd) == -1)
+    M_LOG(MODULE_NAME, "%.1f fps (requested %d), %lu dropped, %lu late frames, %.2f ms convert, %.2f ms encode per frame",
+          opts->frames * 1000.0 / (now - opts->stats_at), opts->fps, opts->dropped, opts->late,
+          opts->frames ? opts->convert_us / 1000.0 / opts->frames : 0.0,
+          opts->frames ? opts->encode_us / 1000.0 / opts->frames : 0.0);
+    opts->convert_us = 0;
+    opts->encode_us = 0;
+    opts->frames = 0;
+    opts->dropped = 0;
+    opts->late = 0;
+    opts->stats_at = now;
+}
+
+static int cam_cleanup(cam_setting_t *opts, int close_fd)
+{
+    if (cam_stop_streaming(opts) == -1)
     {
         M_ERROR(MODULE_NAME, "Unable to stop streaming");
         return -1;
@@ -316,10 +661,12 @@ static int cam_cleanup(cam_setting_t *opts, int close_fd)
     if (close_fd && opts->fd > 0)
     {
         (void)close(opts->fd);
+        opts->fd = -1;
     }
     if (close_fd && opts->timerfd > 0)
     {
         (void)close(opts->timerfd);
+        opts->timerfd = -1;
     }
     return 0;
 }
@@ -358,7 +705,8 @@ static int cam_init_timer(cam_setting_t* opts)
 }
 static int cam_apply_setting(cam_setting_t *opts)
 {
-    if (opts->raw_buffer != NULL)
+    int i, count;
+    if (opts->fd != -1)
     {
         if (cam_cleanup(opts, 1) == -1)
         {
@@ -366,7 +714,8 @@ static int cam_apply_setting(cam_setting_t *opts)
             return -1;
         }
     }
-    opts->fd = open(opts->dev_name, O_RDWR);
+    // frames are dequeued until EAGAIN
+    opts->fd = open(opts->dev_name, O_RDWR | O_NONBLOCK);
     if (opts->fd == -1)
     {
         M_ERROR(MODULE_NAME, "Unable to open device: %s", video_setting.dev_name);
@@ -377,24 +726,213 @@ static int cam_apply_setting(cam_setting_t *opts)
         M_ERROR(MODULE_NAME, "Unable to set format");
         return -1;
     }
-    // 2 request buffer
-    if (cam_request_buffer(opts->fd, 1) == -1)
+    // 2 request buffers, the driver may allocate more or less
+    count = cam_request_buffer(opts->fd, opts->n_buffers);
+    if (count < 2)
     {
-        M_ERROR(MODULE_NAME, "Unable to request buffer");
+        M_ERROR(MODULE_NAME, "Unable to request %d buffers", opts->n_buffers);
         return -1;
     }
-    // 3 query buffer
-    int buffer_size = cam_query_buffer(opts);
-    if (buffer_size == -1)
+    // 3 query and map buffers
+    for (i = 0; i < count; i++)
     {
-        M_ERROR(MODULE_NAME, "Unable to query buffer");
-        return -1;
+        if (cam_query_buffer(opts, i) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to query buffer");
+            return -1;
+        }
+        opts->n_mapped++;
+    }
+    M_LOG(MODULE_NAME, "Capture with %d buffers", count);
+    if (opts->pixelformat != V4L2_PIX_FMT_MJPEG)
+    {
+        encoder_setup(opts->width, opts->height, opts->pixelformat, opts->bytesperline);
     }
     (void) cam_init_timer(opts);
 
     return 0;
 }
 
+/**
+ * @brief Largest size and rate asked for by the clients
+ */
+static void cam_max_request(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    cam_client_t *client = (cam_client_t *)node->data;
+    cam_client_t *max = (cam_client_t *)argv[0];
+    int *same_size = (int *)argv[1];
+    if (client == NULL)
+    {
+        return;
+    }
+    if (max->fps == 0)
+    {
+        *max = *client;
+        return;
+    }
+    if (client->width != max->width || client->height != max->height)
+    {
+        *same_size = 0;
+    }
+    max->width = client->width > max->width ? client->width : max->width;
+    max->height = client->height > max->height ? client->height : max->height;
+    max->fps = client->fps > max->fps ? client->fps : max->fps;
+}
+
+/**
+ * @brief Size and quality of the frames of a client: its own ones, but
+ * never larger than the capture
+ */
+static void cam_set_rendition(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    cam_client_t *client = (cam_client_t *)node->data;
+    cam_setting_t *opts = (cam_setting_t *)argv[0];
+    enc_rendition_t *rendition;
+    int i;
+    if (client == NULL)
+    {
+        return;
+    }
+    rendition = &client->rendition;
+    rendition->quality = client->quality;
+    // the largest size asked for is the capture, whatever the driver
+    // adjusted it to
+    rendition->width = client->width >= opts->request_width || client->width > opts->width ? opts->width : client->width;
+    rendition->height =
+        client->height >= opts->request_height || client->height > opts->height ? opts->height : client->height;
+    // the frames of the camera are not encoded
+    if (opts->pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        rendition->width = opts->width;
+        rendition->height = opts->height;
+    }
+    for (i = 0; i < opts->n_renditions; i++)
+    {
+        if (cam_same_rendition(&opts->renditions[i], rendition))
+        {
+            return;
+        }
+    }
+    if (opts->n_renditions == ENCODER_MAX_RENDITIONS)
+    {
+        M_LOG(MODULE_NAME, "Too many renditions, client %d gets %dx%d", node->key, opts->renditions[0].width,
+              opts->renditions[0].height);
+        *rendition = opts->renditions[0];
+        return;
+    }
+    opts->renditions[opts->n_renditions++] = *rendition;
+}
+
+/**
+ * @brief Capture at the largest size and rate asked for, the device is
+ * set up again only when they change
+ *
+ * @return 1 if the device is set up again, 0 if not, -1 on error
+ */
+static int cam_update_capture(cam_setting_t *opts)
+{
+    cam_client_t max = {0};
+    int same_size = 1;
+    int status = 0;
+    void *args[2];
+    args[0] = (void *)&max;
+    args[1] = (void *)&same_size;
+    bst_for_each(clients, cam_max_request, args, 2);
+    if (max.fps != 0 &&
+        (max.width != opts->request_width || max.height != opts->request_height || max.fps != opts->fps ||
+         (same_size != opts->same_size && opts->mjpeg && cam_has_format(opts->fd, V4L2_PIX_FMT_MJPEG))))
+    {
+        M_LOG(MODULE_NAME, "Capture for the clients: %dx%d@%d", max.width, max.height, max.fps);
+        opts->width = opts->request_width = max.width;
+        opts->height = opts->request_height = max.height;
+        opts->fps = max.fps;
+        opts->same_size = same_size;
+        if (cam_apply_setting(opts) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to apply video setting");
+            return -1;
+        }
+        // restart the streaming
+        if (clients != NULL && cam_start_streaming(opts) == -1)
+        {
+            return -1;
+        }
+        status = 1;
+    }
+    opts->n_renditions = 0;
+    args[0] = (void *)opts;
+    bst_for_each(clients, cam_set_rendition, args, 1);
+    return status;
+}
+
+/**
+ * @brief Settings sent back to a client: [w_16,h_16,fps_8,q_8,path_8],
+ * the size of its frames and path being one of CAM_PATH_*
+ *
+ * @return size of the message
+ */
+static int cam_setting_reply(cam_setting_t *opts, cam_client_t *client, char *buff)
+{
+    uint16_t net16;
+    net16 = htons(client->rendition.width);
+    (void)memcpy(buff, &net16, sizeof(net16));
+    net16 = htons(client->rendition.height);
+    (void)memcpy(buff + sizeof(net16), &net16, sizeof(net16));
+    buff[4] = client->fps;
+    buff[5] = client->rendition.quality;
+    switch (opts->pixelformat)
+    {
+    case V4L2_PIX_FMT_MJPEG:
+        buff[6] = CAM_PATH_MJPEG;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        buff[6] = CAM_PATH_YUYV;
+        break;
+    case V4L2_PIX_FMT_NV12:
+        buff[6] = CAM_PATH_NV12;
+        break;
+    default:
+        buff[6] = CAM_PATH_ENCODE;
+        break;
+    }
+    return 7;
+}
+
+static void send_setting(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    cam_setting_t *opts = (cam_setting_t *)argv[0];
+    int *fd = (int *)argv[1];
+    tunnel_msg_t msg;
+    char buff[8];
+    if (node->data == NULL)
+    {
+        return;
+    }
+    msg.header.type = CHANNEL_CTRL;
+    msg.header.channel_id = 0;
+    msg.header.client_id = node->key;
+    msg.header.size = cam_setting_reply(opts, (cam_client_t *)node->data, buff);
+    msg.data = (uint8_t *)buff;
+    if (msg_write(*fd, &msg) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write setting message to client %d", node->key);
+    }
+}
+
+static void free_clients(bst_node_t *node, void **args, int argc)
+{
+    (void)args;
+    (void)argc;
+    if (node->data)
+    {
+        free(node->data);
+        node->data = NULL;
+    }
+}
+
 static void int_handler(int dummy)
 {
     (void)dummy;
@@ -423,9 +961,12 @@ int main(const int argc, const char **argv)
     int status;
     fd_set fd_in;
     uint64_t expirations_count;
-    uint16_t net16;
     void *fargv[2];
     unsigned int offset = 0;
+    int workers = 1;
+    bst_node_t *node;
+    cam_client_t *client;
+    uint16_t *ids;
     if (argc != 4)
     {
         printf("Usage: %s path/to/hotline/socket channel_name video_dev\n", argv[0]);
@@ -438,12 +979,40 @@ int main(const int argc, const char **argv)
     strncpy(video_setting.dev_name, argv[3], DEV_SIZE - 1);
 
     // default setting
-    video_setting.width = 640;
-    video_setting.height = 480;
-    video_setting.fps = 5;
-    video_setting.jpeg_quality = 60;
+    video_setting.width = video_setting.request_width = DEFAULT_WIDTH;
+    video_setting.height = video_setting.request_height = DEFAULT_HEIGHT;
+    video_setting.fps = DEFAULT_FPS;
+    video_setting.same_size = 1;
     video_setting.raw_buffer = NULL;
-    video_setting.queued = 0;
+    video_setting.fd = -1;
+    video_setting.timerfd = -1;
+    video_setting.encoderfd = -1;
+    video_setting.ready = -1;
+    video_setting.n_buffers = DEFAULT_N_BUFFERS;
+    video_setting.mjpeg = getenv("mjpeg") == NULL || atoi(getenv("mjpeg")) != 0;
+    video_setting.yuv = getenv("yuv") == NULL || atoi(getenv("yuv")) != 0;
+    if (getenv("buffers") != NULL && atoi(getenv("buffers")) > 0)
+    {
+        video_setting.n_buffers = atoi(getenv("buffers"));
+    }
+    if (getenv("workers") != NULL && atoi(getenv("workers")) > 0)
+    {
+        workers = atoi(getenv("workers"));
+    }
+    video_setting.encoderfd = encoder_init(workers, getenv("slices") ? atoi(getenv("slices")) : 1);
+    if (video_setting.encoderfd == -1)
+    {
+        exit(1);
+    }
+    // one buffer per worker, one is filled while the ready one waits
+    if (video_setting.n_buffers < workers + 2)
+    {
+        video_setting.n_buffers = workers + 2;
+    }
+    if (video_setting.n_buffers > VIDEO_MAX_FRAME)
+    {
+        video_setting.n_buffers = VIDEO_MAX_FRAME;
+    }
     // apply the default setting
     if (cam_apply_setting(&video_setting) == -1)
     {
@@ -493,34 +1062,38 @@ int main(const int argc, const char **argv)
             free(msg.data);
         running = 0;
     }
-    // start streaming
-    if (cam_start_streaming(video_setting.fd) == -1)
-    {
-        running = 0;
-    }
     while (running)
     {
-        FD_ZERO(&fd_in);
-        FD_SET(sock, &fd_in);
-        FD_SET(video_setting.fd, &fd_in);
-        maxfd = sock > video_setting.fd ? sock : video_setting.fd;
-
-        if (clients != NULL && video_setting.queued == 0)
+        // the capture runs only while there are clients
+        if (clients != NULL && !video_setting.streaming && cam_start_streaming(&video_setting) == -1)
         {
-            if (cam_queue_buffer(video_setting.fd) == -1)
-            {
-                running = 0;
-            }
-            else
-            {
-                video_setting.queued = 1;
-            }
+            running = 0;
+            break;
+        }
+        if (clients == NULL && video_setting.streaming)
+        {
+            (void)cam_stop_streaming(&video_setting);
         }
         if(clients == NULL && video_setting.timerfd != -1)
         {
             (void) close(video_setting.timerfd);
             video_setting.timerfd = -1;
         }
+        FD_ZERO(&fd_in);
+        FD_SET(sock, &fd_in);
+        maxfd = sock;
+        if (video_setting.streaming)
+        {
+            FD_SET(video_setting.fd, &fd_in);
+            maxfd = video_setting.fd > maxfd ? video_setting.fd : maxfd;
+        }
+        if (video_setting.timerfd != -1)
+        {
+            FD_SET(video_setting.timerfd, &fd_in);
+            maxfd = video_setting.timerfd > maxfd ? video_setting.timerfd : maxfd;
+        }
+        FD_SET(video_setting.encoderfd, &fd_in);
+        maxfd = video_setting.encoderfd > maxfd ? video_setting.encoderfd : maxfd;
 
         status = select(maxfd + 1, &fd_in, NULL, NULL, NULL);
         switch (status)
@@ -545,80 +1118,121 @@ int main(const int argc, const char **argv)
                     {
                     case CHANNEL_SUBSCRIBE:
                         M_LOG(MODULE_NAME, "Client %d subscribes to the chanel", msg.header.client_id);
+                        fargv[0] = (void *)&video_setting;
+                        fargv[1] = (void *)&sock;
+                        node = bst_find(clients, msg.header.client_id);
+                        if (node != NULL)
+                        {
+                            send_setting(node, fargv, 2);
+                            break;
+                        }
+                        client = (cam_client_t *)calloc(1, sizeof(cam_client_t));
+                        ids = (uint16_t *)realloc(client_ids, (n_clients + 1) * sizeof(uint16_t));
+                        if (client == NULL || ids == NULL)
+                        {
+                            M_ERROR(MODULE_NAME, "Unable to allocate client %d: %s", msg.header.client_id, strerror(errno));
+                            free(client);
+                            client_ids = ids ? ids : client_ids;
+                            break;
+                        }
+                        client_ids = ids;
+                        n_clients++;
                         if(clients == NULL)
                         {
                             (void) cam_init_timer(&video_setting);
                         }
-                        clients = bst_insert(clients, msg.header.client_id, NULL);
-                        // send back the ctl message
-                        msg.header.type = CHANNEL_CTRL;
-                        msg.header.size = 6;
-                        msg.data = (uint8_t *)buff;
-                        net16 = htons(video_setting.width);
-                        (void)memcpy(buff, &net16, sizeof(video_setting.width));
-                        net16 = htons(video_setting.height);
-                        (void)memcpy(buff + sizeof(video_setting.height), &net16, sizeof(video_setting.height));
-                        buff[sizeof(video_setting.width) + sizeof(video_setting.height)] = video_setting.fps;
-                        buff[sizeof(video_setting.width) + sizeof(video_setting.height) + 1] = video_setting.jpeg_quality;
-                        if (msg_write(sock, &msg) == -1)
+                        client->width = DEFAULT_WIDTH;
+                        client->height = DEFAULT_HEIGHT;
+                        client->fps = DEFAULT_FPS;
+                        client->quality = DEFAULT_QUALITY;
+                        clients = bst_insert(clients, msg.header.client_id, client);
+                        status = cam_update_capture(&video_setting);
+                        if (status == -1)
                         {
+                            cam_cleanup(&video_setting, 0);
                             running = 0;
+                            break;
+                        }
+                        // send back the ctl message, to all the clients if the capture changed
+                        node = bst_find(clients, msg.header.client_id);
+                        if (status == 1)
+                        {
+                            bst_for_each(clients, send_setting, fargv, 2);
+                        }
+                        else if (node)
+                        {
+                            send_setting(node, fargv, 2);
                         }
                         break;
 
                     case CHANNEL_UNSUBSCRIBE:
                         M_LOG(MODULE_NAME, "Client %d unsubscribes to the chanel", msg.header.client_id);
+                        node = bst_find(clients, msg.header.client_id);
+                        if (node == NULL)
+                        {
+                            break;
+                        }
+                        free_clients(node, NULL, 0);
                         clients = bst_delete(clients, msg.header.client_id);
+                        n_clients--;
+                        status = cam_update_capture(&video_setting);
+                        if (status == -1)
+                        {
+                            cam_cleanup(&video_setting, 0);
+                            running = 0;
+                        }
+                        else if (status == 1)
+                        {
+                            fargv[0] = (void *)&video_setting;
+                            fargv[1] = (void *)&sock;
+                            bst_for_each(clients, send_setting, fargv, 2);
+                        }
                         break;
                     case CHANNEL_CTRL:
-                        // apply setting here
+                        // setting of the sender only
                         // [w_16,h_16,fps_8,q_8]
-                        if (msg.header.size == 6)
+                        node = bst_find(clients, msg.header.client_id);
+                        if (msg.header.size == 6 && node && node->data)
                         {
+                            client = (cam_client_t *)node->data;
                             offset = 0;
-                            (void)memcpy(&video_setting.width, msg.data, 2);
-                            video_setting.width = ntohs(video_setting.width);
+                            (void)memcpy(&client->width, msg.data, 2);
+                            client->width = ntohs(client->width);
                             offset += 2;
-                            (void)memcpy(&video_setting.height, msg.data + offset, 2);
-                            video_setting.height = ntohs(video_setting.height);
+                            (void)memcpy(&client->height, msg.data + offset, 2);
+                            client->height = ntohs(client->height);
                             offset += 2;
-                            (void)memcpy(&video_setting.fps, msg.data + offset, 1);
+                            (void)memcpy(&client->fps, msg.data + offset, 1);
                             offset++;
-                            (void)memcpy(&video_setting.jpeg_quality, msg.data + offset, 1);
-                            M_LOG(MODULE_NAME, "Client request width: %d, height: %d, FPS: %d, JPEG quality: %d",
-                                  video_setting.width,
-                                  video_setting.height,
-                                  video_setting.fps,
-                                  video_setting.jpeg_quality);
-                            if (cam_apply_setting(&video_setting) == -1)
+                            (void)memcpy(&client->quality, msg.data + offset, 1);
+                            client->width = client->width ? client->width : 1;
+                            client->height = client->height ? client->height : 1;
+                            client->fps = client->fps ? client->fps : 1;
+                            client->quality = client->quality > 100 ? 100 : client->quality;
+                            client->next_at = 0;
+                            M_LOG(MODULE_NAME, "Client %d request width: %d, height: %d, FPS: %d, JPEG quality: %d",
+                                  msg.header.client_id,
+                                  client->width,
+                                  client->height,
+                                  client->fps,
+                                  client->quality);
+                            status = cam_update_capture(&video_setting);
+                            if (status == -1)
                             {
-                                M_ERROR(MODULE_NAME, "Unable to apply video setting");
                                 cam_cleanup(&video_setting, 0);
                                 running = 0;
+                                break;
+                            }
+                            // send back the ctl message
+                            fargv[0] = (void *)&video_setting;
+                            fargv[1] = (void *)&sock;
+                            if (status == 1)
+                            {
+                                bst_for_each(clients, send_setting, fargv, 2);
                             }
                             else
                             {
-                                // restart the streaming
-                                if (cam_start_streaming(video_setting.fd) == -1)
-                                {
-                                    running = 0;
-                                }
-                                else
-                                {
-                                    // send back the ctl message
-                                    msg.header.type = CHANNEL_CTRL;
-                                    msg.header.size = 6;
-                                    msg.data = (uint8_t *)buff;
-                                    net16 = htons(video_setting.width);
-                                    (void)memcpy(buff, &net16, sizeof(video_setting.width));
-                                    net16 = htons(video_setting.height);
-                                    (void)memcpy(buff + sizeof(video_setting.height), &net16, sizeof(video_setting.height));
-                                    buff[sizeof(video_setting.width) + sizeof(video_setting.height)] = video_setting.fps;
-                                    buff[sizeof(video_setting.width) + sizeof(video_setting.height) + 1] = video_setting.jpeg_quality;
-                                    fargv[0] = (void *)&msg;
-                                    fargv[1] = (void *)&sock;
-                                    bst_for_each(clients, send_data, fargv, 2);
-                                }
+                                send_setting(node, fargv, 2);
                             }
                         }
                         else
@@ -632,42 +1246,76 @@ int main(const int argc, const char **argv)
                               msg.header.client_id, msg.header.type);
                         break;
                     }
+                    if (msg.data)
+                    {
+                        free(msg.data);
+                    }
                 }
             }
-            else if (FD_ISSET(video_setting.fd, &fd_in) && clients != NULL)
+            if (video_setting.streaming && FD_ISSET(video_setting.fd, &fd_in))
             {
-                if (cam_send_frame_client(&video_setting, sock, clients) == -1)
+                if (cam_collect_frames(&video_setting) == -1)
                 {
                     running = 0;
                 }
+                // the timer expired before this frame was filled
+                else if ((video_setting.due || video_setting.timerfd == -1) && video_setting.ready != -1)
+                {
+                    video_setting.due = 0;
+                    if (cam_send_frame_client(&video_setting, sock, clients) == -1)
+                    {
+                        running = 0;
+                    }
+                }
+            }
+            if (video_setting.timerfd != -1 && FD_ISSET(video_setting.timerfd, &fd_in))
+            {
+                if(read(video_setting.timerfd, &expirations_count, sizeof(expirations_count)) != (int)sizeof(expirations_count))
+                {
+                    M_ERROR(MODULE_NAME, "Unable to read timer: %s", strerror(errno));
+                }
                 else
                 {
-                    // check timeout
-                    if(video_setting.timerfd > 0)
+                    // periods missed while encoding or sending
+                    video_setting.late += expirations_count - 1u;
+                    if (video_setting.ready == -1)
                     {
-                        if(read(video_setting.timerfd, &expirations_count, sizeof(expirations_count)) != (int)sizeof(expirations_count))
-                        {
-                            M_ERROR(MODULE_NAME, "Unable to read timer: %s", strerror(errno));
-                        }
-                        else if (expirations_count > 1u)
-                        {
-                            M_ERROR(MODULE_NAME, "LOOP OVERFLOW COUNT: %lu", (long unsigned int)expirations_count);
-                        }
+                        video_setting.due = 1;
                     }
+                    else if (cam_send_frame_client(&video_setting, sock, clients) == -1)
+                    {
+                        running = 0;
+                    }
+                }
+            }
+            if (video_setting.streaming && FD_ISSET(video_setting.encoderfd, &fd_in))
+            {
+                if (cam_send_encoded(&video_setting, sock) == -1)
+                {
+                    running = 0;
+                }
+                // a worker is free for the frame the timer asked for
+                else if (video_setting.due && video_setting.ready != -1)
+                {
+                    video_setting.due = 0;
+                    (void)cam_send_frame_client(&video_setting, sock, clients);
                 }
             }
-            else
+            if (video_setting.streaming)
             {
-                // sleep to save CPU 100 ms
-                usleep(100000);
+                cam_log_stats(&video_setting);
             }
         }
     }
 
     (void)cam_cleanup(&video_setting, 1);
+    encoder_close();
     // unsubscribe all client
     fargv[0] = (void *)&sock;
     bst_for_each(clients, unsubscribe, fargv, 1);
+    bst_for_each(clients, free_clients, NULL, 0);
+    bst_free(clients);
+    free(client_ids);
     // close the channel
     M_LOG(MODULE_NAME, "Close the channel %s (%d)", argv[2], sock);
     msg.header.type = CHANNEL_CLOSE;
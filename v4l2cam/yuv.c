@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define YUV_SSE2 1
+#endif
+
+#include "yuv.h"
+
+/** luma samples per MCU row, the chroma ones are half of it */
+#define MCU_WIDTH 16
+
+static int round_up(int value, int align)
+{
+    return (value + align - 1) / align * align;
+}
+
+int yuv_planes_init(yuv_planes_t *planes, int width, int height, uint32_t pixelformat)
+{
+    (void)memset(planes, 0, sizeof(*planes));
+    planes->width = width;
+    planes->height = height;
+    planes->max_height = height;
+    planes->y_stride = round_up(width, MCU_WIDTH);
+    planes->c_stride = planes->y_stride / 2;
+    planes->c_height = (height + 1) / 2;
+    planes->buffer = (uint8_t *)malloc(planes->y_stride * height + 2 * planes->c_stride * planes->c_height);
+    if (planes->buffer == NULL)
+    {
+        return -1;
+    }
+    if (pixelformat == V4L2_PIX_FMT_YUYV)
+    {
+        planes->scratch = (uint8_t *)malloc(2 * planes->c_stride);
+        if (planes->scratch == NULL)
+        {
+            free(planes->buffer);
+            planes->buffer = NULL;
+            return -1;
+        }
+    }
+    planes->y = planes->buffer;
+    planes->u = planes->buffer + planes->y_stride * height;
+    planes->v = planes->u + planes->c_stride * planes->c_height;
+    return 0;
+}
+
+void yuv_planes_free(yuv_planes_t *planes)
+{
+    if (planes->buffer)
+    {
+        free(planes->buffer);
+    }
+    if (planes->scratch)
+    {
+        free(planes->scratch);
+    }
+    (void)memset(planes, 0, sizeof(*planes));
+}
+
+/**
+ * @brief Y0 U Y1 V... to Y0 Y1..., U... and V..., for width pixels
+ */
+static void split_yuyv_row(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+    int i = 0;
+#if defined(YUV_NEON)
+    uint8x16x4_t in;
+    uint8x16x2_t luma;
+    for (; i + 32 <= width; i += 32)
+    {
+        in = vld4q_u8(src + 2 * i);
+        luma.val[0] = in.val[0];
+        luma.val[1] = in.val[2];
+        vst2q_u8(y + i, luma);
+        vst1q_u8(u + i / 2, in.val[1]);
+        vst1q_u8(v + i / 2, in.val[3]);
+    }
+#elif defined(YUV_SSE2)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, c;
+    for (; i + 16 <= width; i += 16)
+    {
+        a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        // U V U V...
+        c = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        _mm_storel_epi64((__m128i *)(u + i / 2), _mm_packus_epi16(_mm_and_si128(c, mask), zero));
+        _mm_storel_epi64((__m128i *)(v + i / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+    }
+#endif
+    for (; i + 1 < width; i += 2)
+    {
+        y[i] = src[2 * i];
+        u[i / 2] = src[2 * i + 1];
+        y[i + 1] = src[2 * i + 2];
+        v[i / 2] = src[2 * i + 3];
+    }
+}
+
+/**
+ * @brief U V U V... to U... and V..., for n pairs
+ */
+static void split_uv_row(const uint8_t *src, uint8_t *u, uint8_t *v, int n)
+{
+    int i = 0;
+#if defined(YUV_NEON)
+    uint8x16x2_t in;
+    for (; i + 16 <= n; i += 16)
+    {
+        in = vld2q_u8(src + 2 * i);
+        vst1q_u8(u + i, in.val[0]);
+        vst1q_u8(v + i, in.val[1]);
+    }
+#elif defined(YUV_SSE2)
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i a, b;
+    for (; i + 16 <= n; i += 16)
+    {
+        a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        u[i] = src[2 * i];
+        v[i] = src[2 * i + 1];
+    }
+}
+
+/**
+ * @brief dst = (dst + src + 1) / 2, for n samples
+ */
+static void average_row(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i = 0;
+#if defined(YUV_NEON)
+    for (; i + 16 <= n; i += 16)
+    {
+        vst1q_u8(dst + i, vrhaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#elif defined(YUV_SSE2)
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(dst + i)),
+                                                            _mm_loadu_si128((const __m128i *)(src + i))));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[i] = (uint8_t)((dst[i] + src[i] + 1) >> 1);
+    }
+}
+
+static void pad_row(uint8_t *row, int width, int stride)
+{
+    if (width > 0 && width < stride)
+    {
+        (void)memset(row + width, row[width - 1], stride - width);
+    }
+}
+
+void yuv_split(yuv_planes_t *planes, const uint8_t *frame, const uint8_t *chroma, int bytesperline, int height,
+               uint32_t pixelformat)
+{
+    int row;
+    int c_width = (planes->width + 1) / 2;
+    uint8_t *u, *v;
+    planes->height = height < planes->max_height ? height : planes->max_height;
+    planes->c_height = (planes->height + 1) / 2;
+    if (pixelformat == V4L2_PIX_FMT_YUYV)
+    {
+        for (row = 0; row < planes->height; row++)
+        {
+            u = planes->u + row / 2 * planes->c_stride;
+            v = planes->v + row / 2 * planes->c_stride;
+            if (row & 1)
+            {
+                split_yuyv_row(frame + row * bytesperline, planes->y + row * planes->y_stride,
+                               planes->scratch, planes->scratch + planes->c_stride, planes->width);
+                average_row(u, planes->scratch, c_width);
+                average_row(v, planes->scratch + planes->c_stride, c_width);
+            }
+            else
+            {
+                split_yuyv_row(frame + row * bytesperline, planes->y + row * planes->y_stride, u, v, planes->width);
+            }
+            pad_row(planes->y + row * planes->y_stride, planes->width, planes->y_stride);
+            pad_row(u, c_width, planes->c_stride);
+            pad_row(v, c_width, planes->c_stride);
+        }
+        return;
+    }
+    // NV12: the luma rows are used in place when no padding is needed
+    if (planes->width % MCU_WIDTH == 0)
+    {
+        planes->y = (uint8_t *)frame;
+        planes->y_stride = bytesperline;
+    }
+    else
+    {
+        planes->y = planes->buffer;
+        planes->y_stride = round_up(planes->width, MCU_WIDTH);
+        for (row = 0; row < planes->height; row++)
+        {
+            (void)memcpy(planes->y + row * planes->y_stride, frame + row * bytesperline, planes->width);
+            pad_row(planes->y + row * planes->y_stride, planes->width, planes->y_stride);
+        }
+    }
+    for (row = 0; row < planes->c_height; row++)
+    {
+        split_uv_row(chroma + row * bytesperline,
+                     planes->u + row * planes->c_stride,
+                     planes->v + row * planes->c_stride, c_width);
+        pad_row(planes->u + row * planes->c_stride, c_width, planes->c_stride);
+        pad_row(planes->v + row * planes->c_stride, c_width, planes->c_stride);
+    }
+}
+
+/**
+ * @brief sums[i] += row[i], for n samples
+ */
+static void accumulate_row(uint16_t *sums, const uint8_t *row, int n)
+{
+    int i = 0;
+#if defined(YUV_NEON)
+    uint8x16_t in;
+    for (; i + 16 <= n; i += 16)
+    {
+        in = vld1q_u8(row + i);
+        vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(in)));
+        vst1q_u16(sums + i + 8, vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(in)));
+    }
+#elif defined(YUV_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i in;
+    for (; i + 16 <= n; i += 16)
+    {
+        in = _mm_loadu_si128((const __m128i *)(row + i));
+        _mm_storeu_si128((__m128i *)(sums + i), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sums + i)),
+                                                              _mm_unpacklo_epi8(in, zero)));
+        _mm_storeu_si128((__m128i *)(sums + i + 8), _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sums + i + 8)),
+                                                                  _mm_unpacklo_epi8(_mm_srli_si128(in, 8), zero)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        sums[i] += row[i];
+    }
+}
+
+/**
+ * @brief dst[x] = (sums[2x] + sums[2x + 1]) * scale, rounded, for n
+ * destination samples
+ */
+static int halve_row(uint8_t *dst, const uint16_t *sums, int n, float scale)
+{
+    int x = 0;
+#if defined(YUV_NEON)
+    const float32x4_t factor = vdupq_n_f32(scale);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    uint32x4_t lo, hi;
+    uint16x8_t out;
+    for (; x + 8 <= n; x += 8)
+    {
+        lo = vpaddlq_u16(vld1q_u16(sums + 2 * x));
+        hi = vpaddlq_u16(vld1q_u16(sums + 2 * x + 8));
+        lo = vcvtq_u32_f32(vmlaq_f32(half, vcvtq_f32_u32(lo), factor));
+        hi = vcvtq_u32_f32(vmlaq_f32(half, vcvtq_f32_u32(hi), factor));
+        out = vcombine_u16(vmovn_u32(lo), vmovn_u32(hi));
+        vst1_u8(dst + x, vqmovn_u16(out));
+    }
+#elif defined(YUV_SSE2)
+    const __m128 factor = _mm_set1_ps(scale);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    __m128i a, b, lo, hi;
+    for (; x + 8 <= n; x += 8)
+    {
+        a = _mm_loadu_si128((const __m128i *)(sums + 2 * x));
+        b = _mm_loadu_si128((const __m128i *)(sums + 2 * x + 8));
+        // even + odd samples, as 32 bits integers
+        lo = _mm_add_epi32(_mm_and_si128(a, mask), _mm_srli_epi32(a, 16));
+        hi = _mm_add_epi32(_mm_and_si128(b, mask), _mm_srli_epi32(b, 16));
+        lo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), factor), half));
+        hi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), factor), half));
+        lo = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(lo, lo));
+    }
+#else
+    (void)dst;
+    (void)sums;
+    (void)n;
+    (void)scale;
+#endif
+    return x;
+}
+
+void yuv_scale_plane(const uint8_t *src, int src_width, int src_height, int src_stride, uint8_t *dst, int dst_width,
+                     int dst_height, int dst_stride, int components, uint16_t *sums)
+{
+    int x, y, c, i, row, rows, end, col, cols, carry;
+    int n = src_width * components;
+    int min_cols = src_width / dst_width;
+    float scale[2];
+    unsigned int total;
+    uint8_t *out;
+    for (y = 0; y < dst_height; y++)
+    {
+        row = (int)((long)y * src_height / dst_height);
+        end = (int)((long)(y + 1) * src_height / dst_height);
+        // the sums of 257 rows of 255 fit in 16 bits
+        rows = end - row > 257 ? 257 : end - row;
+        (void)memset(sums, 0, n * sizeof(uint16_t));
+        for (i = 0; i < rows; i++)
+        {
+            accumulate_row(sums, src + (row + i) * src_stride, n);
+        }
+        // the source columns of a destination sample are min_cols or one more
+        scale[0] = 1.0f / (rows * min_cols);
+        scale[1] = 1.0f / (rows * (min_cols + 1));
+        out = dst + y * dst_stride;
+        x = 0;
+        if (components == 1 && src_width == 2 * dst_width)
+        {
+            x = halve_row(out, sums, dst_width, scale[0]);
+        }
+        // columns x * src_width / dst_width, stepped without division
+        i = x * min_cols + (int)((long)x * (src_width % dst_width) / dst_width);
+        carry = (int)((long)x * (src_width % dst_width) % dst_width);
+        for (; x < dst_width; x++)
+        {
+            carry += src_width % dst_width;
+            cols = min_cols;
+            if (carry >= dst_width)
+            {
+                carry -= dst_width;
+                cols++;
+            }
+            for (c = 0; c < components; c++)
+            {
+                total = 0;
+                for (col = i; col < i + cols; col++)
+                {
+                    total += sums[col * components + c];
+                }
+                out[x * components + c] = (uint8_t)(total * scale[cols - min_cols] + 0.5f);
+            }
+            i += cols;
+        }
+    }
+}
+
+void yuv_scale(const yuv_planes_t *src, yuv_planes_t *dst, int height, uint16_t *sums)
+{
+    int row;
+    int c_width = (dst->width + 1) / 2;
+    // the luma of NV12 may have been left in the capture buffer by yuv_split()
+    dst->y = dst->buffer;
+    dst->y_stride = round_up(dst->width, MCU_WIDTH);
+    dst->height = height < dst->max_height ? height : dst->max_height;
+    dst->c_height = (dst->height + 1) / 2;
+    yuv_scale_plane(src->y, src->width, src->height, src->y_stride, dst->y, dst->width, dst->height, dst->y_stride,
+                    1, sums);
+    yuv_scale_plane(src->u, (src->width + 1) / 2, src->c_height, src->c_stride, dst->u, c_width, dst->c_height,
+                    dst->c_stride, 1, sums);
+    yuv_scale_plane(src->v, (src->width + 1) / 2, src->c_height, src->c_stride, dst->v, c_width, dst->c_height,
+                    dst->c_stride, 1, sums);
+    for (row = 0; row < dst->height; row++)
+    {
+        pad_row(dst->y + row * dst->y_stride, dst->width, dst->y_stride);
+    }
+    for (row = 0; row < dst->c_height; row++)
+    {
+        pad_row(dst->u + row * dst->c_stride, c_width, dst->c_stride);
+        pad_row(dst->v + row * dst->c_stride, c_width, dst->c_stride);
+    }
+}
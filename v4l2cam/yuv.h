@@ -0,0 +1,62 @@
+#ifndef YUV_H
+#define YUV_H
+#include <stdint.h>
+
+/**
+ * @brief Planar 4:2:0 YCbCr frame fed to libjpeg as raw data. The rows
+ * are padded to a whole number of MCUs with copies of their last sample
+ */
+typedef struct
+{
+    /** luma rows, in the captured frame when they need no padding */
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;
+    int width;
+    /** rows of the last split frame, at most max_height */
+    int height;
+    int max_height;
+    int y_stride;
+    int c_stride;
+    int c_height;
+    uint8_t *buffer;
+    /** chroma of the odd rows of a YUYV frame, averaged with the even ones */
+    uint8_t *scratch;
+} yuv_planes_t;
+
+/**
+ * @brief Allocate the planes of a YUYV or NV12 frame of up to height rows
+ *
+ * @return 0 on success, -1 on error
+ */
+int yuv_planes_init(yuv_planes_t *planes, int width, int height, uint32_t pixelformat);
+void yuv_planes_free(yuv_planes_t *planes);
+/**
+ * @brief Deinterleave height rows of a captured frame into the planes,
+ * the 4:2:2 chroma of a YUYV frame is averaged over pairs of rows
+ *
+ * @param frame first row to split, of the luma plane for NV12
+ * @param chroma first chroma row of an NV12 frame, NULL for YUYV
+ * @param bytesperline stride of the frame, of its luma plane for NV12
+ * @param height even number of rows, or the last rows of the frame
+ */
+void yuv_split(yuv_planes_t *planes, const uint8_t *frame, const uint8_t *chroma, int bytesperline, int height,
+               uint32_t pixelformat);
+/**
+ * @brief Box filter downscale of an image of interleaved samples, each
+ * destination sample is the mean of the source ones it covers
+ *
+ * @param components samples per pixel, 1 for a plane, 3 for RGB
+ * @param sums scratch of src_width * components samples
+ */
+void yuv_scale_plane(const uint8_t *src, int src_width, int src_height, int src_stride, uint8_t *dst, int dst_width,
+                     int dst_height, int dst_stride, int components, uint16_t *sums);
+/**
+ * @brief Downscale the planes of a frame into height rows of planes of
+ * a smaller width, at most max_height
+ *
+ * @param sums scratch of src->width samples
+ */
+void yuv_scale(const yuv_planes_t *src, yuv_planes_t *dst, int height, uint16_t *sums);
+
+#endif
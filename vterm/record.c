@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include <antd/bst.h>
+#include <antd/utils.h>
+
+#include "../log.h"
+#include "record.h"
+
+#define MODULE_NAME "vterm"
+
+#define RECORD_OPEN 0
+#define RECORD_OUTPUT 1
+#define RECORD_RESIZE 2
+#define RECORD_END 3
+
+#define RECORD_MIN_BUFFER 65536
+/** ring bytes the output never takes, kept for the open, resize and end events */
+#define RECORD_RESERVE 4096
+/** the writer sleeps this long when the ring is empty (ms) */
+#define RECORD_POLL 20
+/** the buffered events of a file are written out at this size */
+#define RECORD_FLUSH_SIZE 65536
+/** nice value of the writer thread */
+#define RECORD_NICE 19
+
+#ifdef HAVE_LIBZ
+#define RECORD_EXT ".cast.gz"
+#else
+#define RECORD_EXT ".cast"
+#endif
+
+/**
+ * @brief Event in the ring buffer, followed by its payload padded to 8
+ * bytes
+ */
+typedef struct
+{
+    uint32_t id;
+    uint32_t type;
+    uint32_t size;
+    uint32_t pad;
+    /** monotonic time in us */
+    uint64_t time;
+} record_event_t;
+
+typedef struct
+{
+    int32_t cols;
+    int32_t rows;
+    int64_t timestamp;
+    char user[64];
+    char token[33];
+} record_header_t;
+
+/**
+ * @brief Recording of a session, owned by the writer thread
+ */
+typedef struct
+{
+    int fd;
+#ifdef HAVE_LIBZ
+    gzFile gz;
+#endif
+    uint64_t start;
+    /** encoded events not yet written */
+    uint8_t *buff;
+    int len;
+    int cap;
+    /** incomplete UTF-8 sequence at the end of the last output */
+    uint8_t pending[4];
+    int n_pending;
+    int dirty;
+} record_file_t;
+
+/**
+ * @brief Single producer (event loop), single consumer (writer) ring,
+ * head and tail only grow and are masked on access
+ */
+static struct
+{
+    uint8_t *data;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+} ring = {NULL, 0, 0, 0, 0};
+
+static char record_dir[BUFFLEN];
+static int record_sync = RECORD_DEFAULT_SYNC;
+static int enabled = 0;
+static int writer_running = 0;
+static pthread_t writer;
+static uint32_t last_id = 0;
+/** recordings by id, writer thread only */
+static bst_node_t *files = NULL;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static void ring_copy_in(uint64_t pos, const void *src, uint32_t size)
+{
+    uint64_t offset = pos & ring.mask;
+    uint64_t first = ring.mask + 1 - offset;
+    if (first >= size)
+    {
+        (void)memcpy(ring.data + offset, src, size);
+        return;
+    }
+    (void)memcpy(ring.data + offset, src, first);
+    (void)memcpy(ring.data, (const uint8_t *)src + first, size - first);
+}
+
+static void ring_copy_out(uint64_t pos, void *dst, uint32_t size)
+{
+    uint64_t offset = pos & ring.mask;
+    uint64_t first = ring.mask + 1 - offset;
+    if (first >= size)
+    {
+        (void)memcpy(dst, ring.data + offset, size);
+        return;
+    }
+    (void)memcpy(dst, ring.data + offset, first);
+    (void)memcpy((uint8_t *)dst + first, ring.data, size - first);
+}
+
+static void record_push(uint32_t id, uint32_t type, const void *data, uint32_t size)
+{
+    record_event_t event;
+    uint64_t head = ring.head;
+    uint64_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    uint64_t len = sizeof(event) + ((size + 7u) & ~7u);
+    uint64_t reserve = type == RECORD_OUTPUT ? RECORD_RESERVE : 0;
+    if (ring.mask + 1 - (head - tail) < len + reserve)
+    {
+        __atomic_add_fetch(&ring.dropped, size, __ATOMIC_RELAXED);
+        return;
+    }
+    event.id = id;
+    event.type = type;
+    event.size = size;
+    event.pad = 0;
+    event.time = now_us();
+    ring_copy_in(head, &event, sizeof(event));
+    ring_copy_in(head + sizeof(event), data, size);
+    __atomic_store_n(&ring.head, head + len, __ATOMIC_RELEASE);
+}
+
+uint32_t record_open(const char *user, const char *token, int cols, int rows)
+{
+    record_header_t header;
+    if (!enabled)
+    {
+        return 0;
+    }
+    if (++last_id == 0)
+    {
+        last_id = 1;
+    }
+    (void)memset(&header, 0, sizeof(header));
+    header.cols = cols;
+    header.rows = rows;
+    header.timestamp = (int64_t)time(NULL);
+    (void)snprintf(header.user, sizeof(header.user), "%s", user);
+    (void)snprintf(header.token, sizeof(header.token), "%s", token);
+    record_push(last_id, RECORD_OPEN, &header, sizeof(header));
+    return last_id;
+}
+
+int record_room(void)
+{
+    uint64_t used;
+    if (!enabled)
+    {
+        return INT_MAX;
+    }
+    used = ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) + RECORD_RESERVE;
+    if (ring.mask + 1 < used + sizeof(record_event_t) + 8)
+    {
+        return 0;
+    }
+    used = ring.mask + 1 - used - sizeof(record_event_t) - 7;
+    return used > INT_MAX ? INT_MAX : (int)used;
+}
+
+void record_output(uint32_t id, const uint8_t *data, int size)
+{
+    record_push(id, RECORD_OUTPUT, data, size);
+}
+
+void record_resize(uint32_t id, int cols, int rows)
+{
+    int32_t size[2];
+    size[0] = cols;
+    size[1] = rows;
+    record_push(id, RECORD_RESIZE, size, sizeof(size));
+}
+
+void record_end(uint32_t id)
+{
+    record_push(id, RECORD_END, NULL, 0);
+}
+
+static int file_reserve(record_file_t *file, int size)
+{
+    uint8_t *buff;
+    int cap;
+    if (file->len + size <= file->cap)
+    {
+        return 0;
+    }
+    cap = file->cap ? file->cap : RECORD_FLUSH_SIZE;
+    while (cap < file->len + size)
+    {
+        cap *= 2;
+    }
+    buff = (uint8_t *)realloc(file->buff, cap);
+    if (buff == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate recording buffer: %s", strerror(errno));
+        return -1;
+    }
+    file->buff = buff;
+    file->cap = cap;
+    return 0;
+}
+
+static int utf8_length(uint8_t c)
+{
+    if (c < 0x80)
+    {
+        return 1;
+    }
+    if (c >= 0xc2 && c <= 0xdf)
+    {
+        return 2;
+    }
+    if ((c & 0xf0) == 0xe0)
+    {
+        return 3;
+    }
+    if (c >= 0xf0 && c <= 0xf4)
+    {
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ * @brief Append data as the content of a JSON string. Bytes that are not
+ * part of a valid UTF-8 sequence are encoded as the code point of the
+ * same value
+ *
+ * @return number of bytes of an incomplete sequence left at the end
+ */
+static int file_escape(record_file_t *file, const uint8_t *data, int size)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t *out;
+    int i, k, n;
+    uint8_t c;
+    if (file_reserve(file, size * 6) == -1)
+    {
+        return 0;
+    }
+    out = file->buff + file->len;
+    for (i = 0; i < size; i++)
+    {
+        c = data[i];
+        if (c >= 0x20 && c < 0x7f)
+        {
+            if (c == '"' || c == '\\')
+            {
+                *out++ = '\\';
+            }
+            *out++ = c;
+            continue;
+        }
+        n = utf8_length(c);
+        if (n > 1 && i + n > size)
+        {
+            break;
+        }
+        for (k = 1; k < n && (data[i + k] & 0xc0) == 0x80; k++)
+            ;
+        if (n > 1 && k == n)
+        {
+            (void)memcpy(out, data + i, n);
+            out += n;
+            i += n - 1;
+            continue;
+        }
+        *out++ = '\\';
+        switch (c)
+        {
+        case '\n':
+            *out++ = 'n';
+            break;
+        case '\r':
+            *out++ = 'r';
+            break;
+        case '\t':
+            *out++ = 't';
+            break;
+        default:
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0x0f];
+            break;
+        }
+    }
+    file->len = out - file->buff;
+    return size - i;
+}
+
+static void file_printf(record_file_t *file, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void file_printf(record_file_t *file, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+    if (file_reserve(file, 64) == -1)
+    {
+        return;
+    }
+    va_start(args, fmt);
+    len = vsnprintf((char *)file->buff + file->len, 64, fmt, args);
+    va_end(args);
+    if (len > 0 && len < 64)
+    {
+        file->len += len;
+    }
+}
+
+static int file_write(record_file_t *file)
+{
+    int status = 0;
+    if (file->len == 0)
+    {
+        return 0;
+    }
+#ifdef HAVE_LIBZ
+    if (gzwrite(file->gz, file->buff, file->len) != file->len)
+    {
+        status = -1;
+    }
+#else
+    int written = 0;
+    int rc;
+    while (written < file->len)
+    {
+        rc = write(file->fd, file->buff + written, file->len - written);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            status = -1;
+            break;
+        }
+        written += rc;
+    }
+#endif
+    if (status == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write session recording %d", file->fd);
+    }
+    file->len = 0;
+    file->dirty = 1;
+    return status;
+}
+
+static void file_sync(record_file_t *file)
+{
+    (void)file_write(file);
+    if (!file->dirty)
+    {
+        return;
+    }
+#ifdef HAVE_LIBZ
+    (void)gzflush(file->gz, Z_SYNC_FLUSH);
+#endif
+    (void)fsync(file->fd);
+    file->dirty = 0;
+}
+
+static void file_close(record_file_t *file)
+{
+    (void)file_write(file);
+#ifdef HAVE_LIBZ
+    (void)gzclose(file->gz);
+#else
+    (void)close(file->fd);
+#endif
+    if (file->buff)
+    {
+        free(file->buff);
+    }
+    free(file);
+}
+
+/**
+ * @brief User name usable as a file name in record_dir: '/' and a leading
+ * '.' are replaced so that the path cannot leave the directory
+ */
+static void file_user(char *name, int size, const char *user)
+{
+    int i;
+    (void)snprintf(name, size, "%s", user[0] ? user : "login");
+    for (i = 0; name[i] != '\0'; i++)
+    {
+        if (name[i] == '/' || (i == 0 && name[i] == '.'))
+        {
+            name[i] = '_';
+        }
+    }
+}
+
+static void file_open(uint32_t id, uint64_t time, const record_header_t *header)
+{
+    char path[BUFFLEN];
+    char date[32];
+    char user[sizeof(header->user)];
+    struct tm tm;
+    time_t timestamp = (time_t)header->timestamp;
+    record_file_t *file;
+    (void)strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime_r(&timestamp, &tm));
+    file_user(user, sizeof(user), header->user);
+    if (snprintf(path, sizeof(path), "%s/%s-%s-%.8s%s", record_dir, user, date, header->token, RECORD_EXT) >= (int)sizeof(path))
+    {
+        M_ERROR(MODULE_NAME, "Recording path is too long in %s", record_dir);
+        return;
+    }
+    file = (record_file_t *)calloc(1, sizeof(record_file_t));
+    if (file == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate recording: %s", strerror(errno));
+        return;
+    }
+    file->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (file->fd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create recording %s: %s", path, strerror(errno));
+        free(file);
+        return;
+    }
+#ifdef HAVE_LIBZ
+    file->gz = gzdopen(file->fd, "wb");
+    if (file->gz == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to compress recording %s", path);
+        (void)close(file->fd);
+        free(file);
+        return;
+    }
+#endif
+    file->start = time;
+    if (file_reserve(file, 256) == 0)
+    {
+        file->len += snprintf((char *)file->buff + file->len, 256,
+                              "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld, \"env\": {\"TERM\": \"linux\"}, \"title\": \"",
+                              header->cols, header->rows, (long long)header->timestamp);
+        (void)file_escape(file, (const uint8_t *)header->user, strlen(header->user));
+        if (file_reserve(file, 3) == 0)
+        {
+            (void)memcpy(file->buff + file->len, "\"}\n", 3);
+            file->len += 3;
+        }
+    }
+    files = bst_insert(files, (int)id, file);
+    M_LOG(MODULE_NAME, "Record session of %s to %s", header->user, path);
+}
+
+/**
+ * @param data payload, preceded by 4 writable bytes
+ */
+static void record_event(const record_event_t *event, uint8_t *data)
+{
+    bst_node_t *node;
+    record_file_t *file;
+    double time;
+    int32_t size[2];
+    int rest;
+    if (event->type == RECORD_OPEN)
+    {
+        file_open(event->id, event->time, (const record_header_t *)data);
+        return;
+    }
+    node = bst_find(files, (int)event->id);
+    if (node == NULL || node->data == NULL)
+    {
+        return;
+    }
+    file = (record_file_t *)node->data;
+    time = (double)(event->time - file->start) / 1000000.0;
+    switch (event->type)
+    {
+    case RECORD_OUTPUT:
+        // complete the sequence split by the previous read
+        data -= file->n_pending;
+        (void)memcpy(data, file->pending, file->n_pending);
+        file_printf(file, "[%.6f, \"%s\", \"", time, "o");
+        rest = file_escape(file, data, event->size + file->n_pending);
+        (void)memcpy(file->pending, data + event->size + file->n_pending - rest, rest);
+        file->n_pending = rest;
+        if (file_reserve(file, 3) == 0)
+        {
+            (void)memcpy(file->buff + file->len, "\"]\n", 3);
+            file->len += 3;
+        }
+        break;
+    case RECORD_RESIZE:
+        (void)memcpy(size, data, sizeof(size));
+        file_printf(file, "[%.6f, \"%s\", \"", time, "r");
+        if (file_reserve(file, 32) == 0)
+        {
+            file->len += snprintf((char *)file->buff + file->len, 32, "%dx%d\"]\n", size[0], size[1]);
+        }
+        break;
+    case RECORD_END:
+        file_close(file);
+        node->data = NULL;
+        files = bst_delete(files, (int)event->id);
+        return;
+    default:
+        break;
+    }
+    if (file->len >= RECORD_FLUSH_SIZE)
+    {
+        (void)file_write(file);
+    }
+}
+
+static void sync_files(bst_node_t *node, void **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    if (node->data)
+    {
+        file_sync((record_file_t *)node->data);
+    }
+}
+
+static void close_files(bst_node_t *node, void **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    if (node->data)
+    {
+        file_close((record_file_t *)node->data);
+        node->data = NULL;
+    }
+}
+
+static void *record_writer(void *arg)
+{
+    (void)arg;
+    record_event_t event;
+    uint8_t *payload = NULL;
+    uint8_t *tmp;
+    uint32_t cap = 0;
+    uint64_t head, tail = ring.tail;
+    uint64_t dropped = 0, count;
+    uint64_t last_sync = now_us();
+    struct timespec poll = {0, RECORD_POLL * 1000000L};
+    struct sched_param param = {0};
+    // the writer never preempts the event loop on wake up, the ring
+    // absorbs the delay
+    if (pthread_setschedparam(pthread_self(), SCHED_BATCH, &param) != 0 ||
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), RECORD_NICE) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to lower the priority of the recording writer: %s", strerror(errno));
+    }
+    while (1)
+    {
+        head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+            {
+                // the last events are pushed before the stop request
+                if (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail)
+                {
+                    break;
+                }
+                continue;
+            }
+            (void)nanosleep(&poll, NULL);
+        }
+        while (tail != head)
+        {
+            ring_copy_out(tail, &event, sizeof(event));
+            if (event.size + 4 > cap)
+            {
+                tmp = (uint8_t *)realloc(payload, event.size + 4);
+                if (tmp == NULL)
+                {
+                    M_ERROR(MODULE_NAME, "Unable to allocate recording event: %s", strerror(errno));
+                    tail += sizeof(event) + ((event.size + 7u) & ~7u);
+                    continue;
+                }
+                payload = tmp;
+                cap = event.size + 4;
+            }
+            ring_copy_out(tail + sizeof(event), payload + 4, event.size);
+            tail += sizeof(event) + ((event.size + 7u) & ~7u);
+            __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+            record_event(&event, payload + 4);
+        }
+        count = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+        if (count != dropped)
+        {
+            M_ERROR(MODULE_NAME, "Recording is too slow, %llu bytes of output dropped", (unsigned long long)(count - dropped));
+            dropped = count;
+        }
+        if (now_us() >= last_sync + (uint64_t)record_sync * 1000000u)
+        {
+            bst_for_each(files, sync_files, NULL, 0);
+            last_sync = now_us();
+        }
+    }
+    bst_for_each(files, close_files, NULL, 0);
+    bst_free(files);
+    files = NULL;
+    if (payload)
+    {
+        free(payload);
+    }
+    return NULL;
+}
+
+int record_init(const char *dir, int buffer, int sync)
+{
+    uint64_t size = RECORD_MIN_BUFFER;
+    sigset_t mask, old;
+    if (access(dir, W_OK) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write recordings to %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    (void)snprintf(record_dir, sizeof(record_dir), "%s", dir);
+    record_sync = sync > 0 ? sync : RECORD_DEFAULT_SYNC;
+    while (size < (uint64_t)buffer)
+    {
+        size <<= 1;
+    }
+    ring.data = (uint8_t *)malloc(size);
+    if (ring.data == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate recording buffer: %s", strerror(errno));
+        return -1;
+    }
+    ring.mask = size - 1;
+    ring.head = ring.tail = ring.dropped = 0;
+    writer_running = 1;
+    // signals are handled by the event loop
+    (void)sigfillset(&mask);
+    (void)pthread_sigmask(SIG_BLOCK, &mask, &old);
+    if (pthread_create(&writer, NULL, record_writer, NULL) != 0)
+    {
+        M_ERROR(MODULE_NAME, "Unable to start the recording writer");
+        (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+        free(ring.data);
+        ring.data = NULL;
+        return -1;
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+    enabled = 1;
+    M_LOG(MODULE_NAME, "Record sessions to %s", dir);
+    return 0;
+}
+
+void record_close(void)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    (void)pthread_join(writer, NULL);
+    free(ring.data);
+    ring.data = NULL;
+    enabled = 0;
+}
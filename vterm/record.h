@@ -0,0 +1,43 @@
+#ifndef RECORD_H
+#define RECORD_H
+#include <stdint.h>
+
+#define RECORD_DEFAULT_BUFFER (4 * 1024 * 1024)
+#define RECORD_DEFAULT_SYNC 5
+
+/**
+ * @brief Start the writer thread recording the sessions in asciicast v2
+ * format, one file per session in dir, gzip compressed when built with zlib
+ *
+ * @param buffer size of the ring buffer between the event loop and the
+ * writer, rounded up to a power of two
+ * @param sync seconds between two fsync() of the recordings
+ * @return 0 on success, -1 on error
+ */
+int record_init(const char *dir, int buffer, int sync);
+/**
+ * @brief Write the pending events and stop the writer thread
+ */
+void record_close(void);
+
+/**
+ * The functions below are called from the event loop only. They never
+ * block: an event not fitting in the ring buffer is dropped and counted,
+ * the event loop avoids it by not reading output beyond record_room()
+ */
+
+/**
+ * @return recording id of a new session, 0 if recording is disabled
+ */
+uint32_t record_open(const char *user, const char *token, int cols, int rows);
+/**
+ * @return size of the largest output event that fits in the ring buffer
+ * without taking the room kept for the other events, INT_MAX if
+ * recording is disabled
+ */
+int record_room(void);
+void record_output(uint32_t id, const uint8_t *data, int size);
+void record_resize(uint32_t id, int cols, int rows);
+void record_end(uint32_t id);
+
+#endif
@@ -0,0 +1,1126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "../log.h"
+#include "screen.h"
+
+#define MODULE_NAME "vterm"
+
+#define SCREEN_MAX_PARAMS 16
+#define SCREEN_TAB 8
+
+#define ATTR_BOLD 0x01
+#define ATTR_DIM 0x02
+#define ATTR_ITALIC 0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK 0x10
+#define ATTR_REVERSE 0x20
+
+/** fg/bg hold a palette index, the default color otherwise */
+#define CELL_FG 0x01
+#define CELL_BG 0x02
+
+/** worst case of an encoded cell: SGR with two 256 colors and UTF-8 */
+#define CELL_ENCODED_MAX 40
+
+enum
+{
+    S_GROUND,
+    S_ESC,
+    S_ESC_SKIP,
+    S_CSI,
+    S_STR,
+    S_STR_ESC
+};
+
+typedef struct
+{
+    uint32_t ch;
+    uint8_t fg;
+    uint8_t bg;
+    uint8_t attr;
+    uint8_t flags;
+} screen_cell_t;
+
+struct vterm_screen
+{
+    int rows;
+    int cols;
+    /** rows of the displayed buffer, scrolling rotates the pointers */
+    screen_cell_t **lines;
+    screen_cell_t **primary;
+    screen_cell_t **alt;
+    screen_cell_t *primary_cells;
+    screen_cell_t *alt_cells;
+    int alt_active;
+    int x;
+    int y;
+    int wrap_pending;
+    int top;
+    int bottom;
+    int autowrap;
+    int cursor_hidden;
+    screen_cell_t pen;
+    int saved_x;
+    int saved_y;
+    screen_cell_t saved_pen;
+    /** escape sequence parser */
+    int state;
+    int params[SCREEN_MAX_PARAMS];
+    int n_params;
+    char private;
+    uint32_t utf8;
+    int utf8_left;
+    /** scrollback ring of encoded lines */
+    uint8_t *sb;
+    int sb_cap;
+    int sb_head;
+    int sb_size;
+    /** encoding scratch of one row */
+    uint8_t *line;
+};
+
+static void blank_cells(vterm_screen_t *screen, screen_cell_t *cells, int n)
+{
+    int i;
+    screen_cell_t blank;
+    blank.ch = ' ';
+    blank.fg = 0;
+    blank.bg = screen->pen.flags & CELL_BG ? screen->pen.bg : 0;
+    blank.attr = 0;
+    blank.flags = screen->pen.flags & CELL_BG;
+    for (i = 0; i < n; i++)
+    {
+        cells[i] = blank;
+    }
+}
+
+static int alloc_buffer(vterm_screen_t *screen, screen_cell_t ***lines, screen_cell_t **cells, int rows, int cols)
+{
+    int i;
+    *cells = (screen_cell_t *)malloc(sizeof(screen_cell_t) * rows * cols);
+    *lines = (screen_cell_t **)malloc(sizeof(screen_cell_t *) * rows);
+    if (*cells == NULL || *lines == NULL)
+    {
+        free(*cells);
+        free(*lines);
+        *cells = NULL;
+        *lines = NULL;
+        return -1;
+    }
+    for (i = 0; i < rows; i++)
+    {
+        (*lines)[i] = *cells + i * cols;
+    }
+    blank_cells(screen, *cells, rows * cols);
+    return 0;
+}
+
+static int encode_utf8(uint32_t ch, uint8_t *out)
+{
+    if (ch < 0x80)
+    {
+        out[0] = ch;
+        return 1;
+    }
+    if (ch < 0x800)
+    {
+        out[0] = 0xC0 | (ch >> 6);
+        out[1] = 0x80 | (ch & 0x3F);
+        return 2;
+    }
+    if (ch < 0x10000)
+    {
+        out[0] = 0xE0 | (ch >> 12);
+        out[1] = 0x80 | ((ch >> 6) & 0x3F);
+        out[2] = 0x80 | (ch & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (ch >> 18);
+    out[1] = 0x80 | ((ch >> 12) & 0x3F);
+    out[2] = 0x80 | ((ch >> 6) & 0x3F);
+    out[3] = 0x80 | (ch & 0x3F);
+    return 4;
+}
+
+static int encode_sgr(const screen_cell_t *cell, uint8_t *out)
+{
+    int len = sprintf((char *)out, "\033[0");
+    if (cell->attr & ATTR_BOLD)
+        len += sprintf((char *)out + len, ";1");
+    if (cell->attr & ATTR_DIM)
+        len += sprintf((char *)out + len, ";2");
+    if (cell->attr & ATTR_ITALIC)
+        len += sprintf((char *)out + len, ";3");
+    if (cell->attr & ATTR_UNDERLINE)
+        len += sprintf((char *)out + len, ";4");
+    if (cell->attr & ATTR_BLINK)
+        len += sprintf((char *)out + len, ";5");
+    if (cell->attr & ATTR_REVERSE)
+        len += sprintf((char *)out + len, ";7");
+    if (cell->flags & CELL_FG)
+        len += sprintf((char *)out + len, ";38;5;%d", cell->fg);
+    if (cell->flags & CELL_BG)
+        len += sprintf((char *)out + len, ";48;5;%d", cell->bg);
+    out[len++] = 'm';
+    return len;
+}
+
+/**
+ * @brief fg/bg are 0 when their flag is not set, the style bytes can be
+ * compared at once
+ */
+static inline int same_style(const screen_cell_t *a, const screen_cell_t *b)
+{
+    return memcmp(&a->fg, &b->fg, 4) == 0;
+}
+
+/**
+ * @brief Encode a row starting and ending with the default attributes,
+ * trailing blanks are trimmed
+ */
+static int encode_row(const screen_cell_t *cells, int cols, uint8_t *out)
+{
+    screen_cell_t style;
+    int i, end, len = 0;
+    (void)memset(&style, 0, sizeof(style));
+    for (end = cols; end > 0; end--)
+    {
+        if (cells[end - 1].ch != ' ' || cells[end - 1].attr || cells[end - 1].flags)
+        {
+            break;
+        }
+    }
+    for (i = 0; i < end; i++)
+    {
+        if (!same_style(&cells[i], &style))
+        {
+            len += encode_sgr(&cells[i], out + len);
+            style = cells[i];
+        }
+        if (cells[i].ch < 0x80)
+        {
+            out[len++] = cells[i].ch;
+        }
+        else
+        {
+            len += encode_utf8(cells[i].ch, out + len);
+        }
+    }
+    if (style.attr || style.flags)
+    {
+        len += sprintf((char *)out + len, "\033[0m");
+    }
+    return len;
+}
+
+static void scrollback_push(vterm_screen_t *screen, const screen_cell_t *cells)
+{
+    int len, pos, first;
+    uint8_t *end;
+    if (screen->sb == NULL)
+    {
+        return;
+    }
+    len = encode_row(cells, screen->cols, screen->line);
+    screen->line[len++] = '\r';
+    screen->line[len++] = '\n';
+    if (len > screen->sb_cap)
+    {
+        return;
+    }
+    pos = (screen->sb_head + screen->sb_size) % screen->sb_cap;
+    first = screen->sb_cap - pos > len ? len : screen->sb_cap - pos;
+    (void)memcpy(screen->sb + pos, screen->line, first);
+    (void)memcpy(screen->sb, screen->line + first, len - first);
+    screen->sb_size += len;
+    if (screen->sb_size > screen->sb_cap)
+    {
+        // drop the oldest bytes up to a line boundary
+        screen->sb_head = (screen->sb_head + screen->sb_size - screen->sb_cap) % screen->sb_cap;
+        screen->sb_size = screen->sb_cap;
+        end = (uint8_t *)memchr(screen->sb + screen->sb_head, '\n', screen->sb_cap - screen->sb_head);
+        if (end == NULL)
+        {
+            end = (uint8_t *)memchr(screen->sb, '\n', screen->sb_head);
+        }
+        if (end != NULL)
+        {
+            pos = end - screen->sb + 1;
+            screen->sb_size -= pos > screen->sb_head ? pos - screen->sb_head : pos + screen->sb_cap - screen->sb_head;
+            screen->sb_head = pos % screen->sb_cap;
+        }
+    }
+}
+
+/**
+ * @brief Scroll a region up, with save the lines leaving the top of
+ * the primary screen go to the scrollback
+ */
+static void scroll_up(vterm_screen_t *screen, int top, int bottom, int n, int save)
+{
+    int i;
+    screen_cell_t *tmp;
+    if (n > bottom - top + 1)
+    {
+        n = bottom - top + 1;
+    }
+    while (n-- > 0)
+    {
+        tmp = screen->lines[top];
+        if (save && top == 0 && !screen->alt_active)
+        {
+            scrollback_push(screen, tmp);
+        }
+        for (i = top; i < bottom; i++)
+        {
+            screen->lines[i] = screen->lines[i + 1];
+        }
+        screen->lines[bottom] = tmp;
+        blank_cells(screen, tmp, screen->cols);
+    }
+}
+
+static void scroll_down(vterm_screen_t *screen, int top, int bottom, int n)
+{
+    int i;
+    screen_cell_t *tmp;
+    if (n > bottom - top + 1)
+    {
+        n = bottom - top + 1;
+    }
+    while (n-- > 0)
+    {
+        tmp = screen->lines[bottom];
+        for (i = bottom; i > top; i--)
+        {
+            screen->lines[i] = screen->lines[i - 1];
+        }
+        screen->lines[top] = tmp;
+        blank_cells(screen, tmp, screen->cols);
+    }
+}
+
+static void line_feed(vterm_screen_t *screen)
+{
+    if (screen->y == screen->bottom)
+    {
+        scroll_up(screen, screen->top, screen->bottom, 1, 1);
+    }
+    else if (screen->y < screen->rows - 1)
+    {
+        screen->y++;
+    }
+}
+
+static void put_char(vterm_screen_t *screen, uint32_t ch)
+{
+    screen_cell_t *cell;
+    if (screen->wrap_pending)
+    {
+        screen->x = 0;
+        line_feed(screen);
+        screen->wrap_pending = 0;
+    }
+    cell = &screen->lines[screen->y][screen->x];
+    *cell = screen->pen;
+    cell->ch = ch;
+    if (screen->x == screen->cols - 1)
+    {
+        screen->wrap_pending = screen->autowrap;
+    }
+    else
+    {
+        screen->x++;
+    }
+}
+
+static void clamp_cursor(vterm_screen_t *screen)
+{
+    if (screen->x < 0)
+        screen->x = 0;
+    if (screen->x >= screen->cols)
+        screen->x = screen->cols - 1;
+    if (screen->y < 0)
+        screen->y = 0;
+    if (screen->y >= screen->rows)
+        screen->y = screen->rows - 1;
+    screen->wrap_pending = 0;
+}
+
+static void save_cursor(vterm_screen_t *screen)
+{
+    screen->saved_x = screen->x;
+    screen->saved_y = screen->y;
+    screen->saved_pen = screen->pen;
+}
+
+static void restore_cursor(vterm_screen_t *screen)
+{
+    screen->x = screen->saved_x;
+    screen->y = screen->saved_y;
+    screen->pen = screen->saved_pen;
+    clamp_cursor(screen);
+}
+
+static void reset(vterm_screen_t *screen)
+{
+    (void)memset(&screen->pen, 0, sizeof(screen->pen));
+    screen->pen.ch = ' ';
+    screen->x = screen->y = 0;
+    screen->wrap_pending = 0;
+    screen->top = 0;
+    screen->bottom = screen->rows - 1;
+    screen->autowrap = 1;
+    screen->cursor_hidden = 0;
+    screen->alt_active = 0;
+    screen->lines = screen->primary;
+    screen->state = S_GROUND;
+    screen->utf8_left = 0;
+    save_cursor(screen);
+    blank_cells(screen, screen->primary_cells, screen->rows * screen->cols);
+}
+
+static void set_alt(vterm_screen_t *screen, int active)
+{
+    if (active == screen->alt_active)
+    {
+        return;
+    }
+    screen->alt_active = active;
+    screen->lines = active ? screen->alt : screen->primary;
+    if (active)
+    {
+        blank_cells(screen, screen->alt_cells, screen->rows * screen->cols);
+    }
+}
+
+static int param(vterm_screen_t *screen, int i, int value)
+{
+    return i < screen->n_params && screen->params[i] > 0 ? screen->params[i] : value;
+}
+
+/**
+ * @brief Nearest color of the 256 colors palette
+ */
+static uint8_t rgb_color(int r, int g, int b)
+{
+    return 16 + 36 * (r * 5 / 255) + 6 * (g * 5 / 255) + (b * 5 / 255);
+}
+
+static void sgr(vterm_screen_t *screen)
+{
+    int i, p;
+    screen_cell_t *pen = &screen->pen;
+    if (screen->n_params == 0)
+    {
+        screen->params[0] = 0;
+        screen->n_params = 1;
+    }
+    for (i = 0; i < screen->n_params; i++)
+    {
+        p = screen->params[i];
+        if (p == 0)
+        {
+            pen->attr = 0;
+            pen->flags = 0;
+            pen->fg = 0;
+            pen->bg = 0;
+        }
+        else if (p == 1)
+            pen->attr |= ATTR_BOLD;
+        else if (p == 2)
+            pen->attr |= ATTR_DIM;
+        else if (p == 3)
+            pen->attr |= ATTR_ITALIC;
+        else if (p == 4)
+            pen->attr |= ATTR_UNDERLINE;
+        else if (p == 5)
+            pen->attr |= ATTR_BLINK;
+        else if (p == 7)
+            pen->attr |= ATTR_REVERSE;
+        else if (p == 22)
+            pen->attr &= ~(ATTR_BOLD | ATTR_DIM);
+        else if (p == 23)
+            pen->attr &= ~ATTR_ITALIC;
+        else if (p == 24)
+            pen->attr &= ~ATTR_UNDERLINE;
+        else if (p == 25)
+            pen->attr &= ~ATTR_BLINK;
+        else if (p == 27)
+            pen->attr &= ~ATTR_REVERSE;
+        else if (p >= 30 && p <= 37)
+        {
+            pen->fg = p - 30;
+            pen->flags |= CELL_FG;
+        }
+        else if (p == 39)
+        {
+            pen->flags &= ~CELL_FG;
+            pen->fg = 0;
+        }
+        else if (p >= 40 && p <= 47)
+        {
+            pen->bg = p - 40;
+            pen->flags |= CELL_BG;
+        }
+        else if (p == 49)
+        {
+            pen->flags &= ~CELL_BG;
+            pen->bg = 0;
+        }
+        else if (p >= 90 && p <= 97)
+        {
+            pen->fg = p - 90 + 8;
+            pen->flags |= CELL_FG;
+        }
+        else if (p >= 100 && p <= 107)
+        {
+            pen->bg = p - 100 + 8;
+            pen->flags |= CELL_BG;
+        }
+        else if ((p == 38 || p == 48) && i + 1 < screen->n_params)
+        {
+            uint8_t color;
+            if (screen->params[i + 1] == 5 && i + 2 < screen->n_params)
+            {
+                color = screen->params[i + 2];
+                i += 2;
+            }
+            else if (screen->params[i + 1] == 2 && i + 4 < screen->n_params)
+            {
+                color = rgb_color(screen->params[i + 2] & 0xFF, screen->params[i + 3] & 0xFF, screen->params[i + 4] & 0xFF);
+                i += 4;
+            }
+            else
+            {
+                break;
+            }
+            if (p == 38)
+            {
+                pen->fg = color;
+                pen->flags |= CELL_FG;
+            }
+            else
+            {
+                pen->bg = color;
+                pen->flags |= CELL_BG;
+            }
+        }
+    }
+}
+
+static void set_mode(vterm_screen_t *screen, int on)
+{
+    int i;
+    if (screen->private != '?')
+    {
+        return;
+    }
+    for (i = 0; i < screen->n_params; i++)
+    {
+        switch (screen->params[i])
+        {
+        case 7:
+            screen->autowrap = on;
+            break;
+        case 25:
+            screen->cursor_hidden = !on;
+            break;
+        case 1049:
+            if (on)
+            {
+                save_cursor(screen);
+                set_alt(screen, 1);
+            }
+            else
+            {
+                set_alt(screen, 0);
+                restore_cursor(screen);
+            }
+            break;
+        case 47:
+        case 1047:
+            set_alt(screen, on);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void erase(vterm_screen_t *screen, int row, int from, int to)
+{
+    if (from < to)
+    {
+        blank_cells(screen, screen->lines[row] + from, to - from);
+    }
+}
+
+static void csi_dispatch(vterm_screen_t *screen, uint8_t final)
+{
+    int n = param(screen, 0, 1);
+    int i;
+    screen_cell_t *row;
+    if (screen->private && final != 'h' && final != 'l')
+    {
+        return;
+    }
+    switch (final)
+    {
+    case '@':
+        row = screen->lines[screen->y];
+        n = n > screen->cols - screen->x ? screen->cols - screen->x : n;
+        (void)memmove(row + screen->x + n, row + screen->x, (screen->cols - screen->x - n) * sizeof(screen_cell_t));
+        erase(screen, screen->y, screen->x, screen->x + n);
+        break;
+    case 'A':
+        screen->y = screen->y >= screen->top && screen->y - n < screen->top ? screen->top : screen->y - n;
+        clamp_cursor(screen);
+        break;
+    case 'B':
+    case 'e':
+        screen->y = screen->y <= screen->bottom && screen->y + n > screen->bottom ? screen->bottom : screen->y + n;
+        clamp_cursor(screen);
+        break;
+    case 'C':
+    case 'a':
+        screen->x += n;
+        clamp_cursor(screen);
+        break;
+    case 'D':
+        screen->x -= n;
+        clamp_cursor(screen);
+        break;
+    case 'E':
+        screen->x = 0;
+        screen->y += n;
+        clamp_cursor(screen);
+        break;
+    case 'F':
+        screen->x = 0;
+        screen->y -= n;
+        clamp_cursor(screen);
+        break;
+    case 'G':
+    case '`':
+        screen->x = n - 1;
+        clamp_cursor(screen);
+        break;
+    case 'H':
+    case 'f':
+        screen->y = param(screen, 0, 1) - 1;
+        screen->x = param(screen, 1, 1) - 1;
+        clamp_cursor(screen);
+        break;
+    case 'd':
+        screen->y = n - 1;
+        clamp_cursor(screen);
+        break;
+    case 'J':
+        switch (screen->n_params > 0 ? screen->params[0] : 0)
+        {
+        case 0:
+            erase(screen, screen->y, screen->x, screen->cols);
+            for (i = screen->y + 1; i < screen->rows; i++)
+                erase(screen, i, 0, screen->cols);
+            break;
+        case 1:
+            for (i = 0; i < screen->y; i++)
+                erase(screen, i, 0, screen->cols);
+            erase(screen, screen->y, 0, screen->x + 1);
+            break;
+        case 3:
+            screen->sb_size = 0;
+            screen->sb_head = 0;
+            /* fall through */
+        case 2:
+            for (i = 0; i < screen->rows; i++)
+                erase(screen, i, 0, screen->cols);
+            break;
+        default:
+            break;
+        }
+        break;
+    case 'K':
+        switch (screen->n_params > 0 ? screen->params[0] : 0)
+        {
+        case 0:
+            erase(screen, screen->y, screen->x, screen->cols);
+            break;
+        case 1:
+            erase(screen, screen->y, 0, screen->x + 1);
+            break;
+        case 2:
+            erase(screen, screen->y, 0, screen->cols);
+            break;
+        default:
+            break;
+        }
+        break;
+    case 'L':
+        if (screen->y >= screen->top && screen->y <= screen->bottom)
+            scroll_down(screen, screen->y, screen->bottom, n);
+        break;
+    case 'M':
+        // deleted lines do not go to the scrollback
+        if (screen->y >= screen->top && screen->y <= screen->bottom)
+            scroll_up(screen, screen->y, screen->bottom, n, 0);
+        break;
+    case 'P':
+        row = screen->lines[screen->y];
+        n = n > screen->cols - screen->x ? screen->cols - screen->x : n;
+        (void)memmove(row + screen->x, row + screen->x + n, (screen->cols - screen->x - n) * sizeof(screen_cell_t));
+        erase(screen, screen->y, screen->cols - n, screen->cols);
+        break;
+    case 'X':
+        erase(screen, screen->y, screen->x, screen->x + n > screen->cols ? screen->cols : screen->x + n);
+        break;
+    case 'S':
+        scroll_up(screen, screen->top, screen->bottom, n, 1);
+        break;
+    case 'T':
+        scroll_down(screen, screen->top, screen->bottom, n);
+        break;
+    case 'm':
+        sgr(screen);
+        break;
+    case 'r':
+        screen->top = param(screen, 0, 1) - 1;
+        screen->bottom = param(screen, 1, screen->rows) - 1;
+        if (screen->bottom >= screen->rows)
+            screen->bottom = screen->rows - 1;
+        if (screen->top >= screen->bottom)
+        {
+            screen->top = 0;
+            screen->bottom = screen->rows - 1;
+        }
+        screen->x = screen->y = 0;
+        screen->wrap_pending = 0;
+        break;
+    case 's':
+        save_cursor(screen);
+        break;
+    case 'u':
+        restore_cursor(screen);
+        break;
+    case 'h':
+        set_mode(screen, 1);
+        break;
+    case 'l':
+        set_mode(screen, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+static void esc_dispatch(vterm_screen_t *screen, uint8_t c)
+{
+    screen->state = S_GROUND;
+    switch (c)
+    {
+    case '[':
+        screen->state = S_CSI;
+        screen->n_params = 0;
+        screen->params[0] = 0;
+        screen->private = 0;
+        break;
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        screen->state = S_STR;
+        break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case '#':
+    case '%':
+        screen->state = S_ESC_SKIP;
+        break;
+    case '7':
+        save_cursor(screen);
+        break;
+    case '8':
+        restore_cursor(screen);
+        break;
+    case 'D':
+        line_feed(screen);
+        break;
+    case 'E':
+        screen->x = 0;
+        line_feed(screen);
+        break;
+    case 'M':
+        if (screen->y == screen->top)
+            scroll_down(screen, screen->top, screen->bottom, 1);
+        else if (screen->y > 0)
+            screen->y--;
+        break;
+    case 'c':
+        reset(screen);
+        break;
+    default:
+        break;
+    }
+}
+
+static void control(vterm_screen_t *screen, uint8_t c)
+{
+    switch (c)
+    {
+    case '\b':
+        if (screen->x > 0)
+            screen->x--;
+        screen->wrap_pending = 0;
+        break;
+    case '\t':
+        screen->x = (screen->x / SCREEN_TAB + 1) * SCREEN_TAB;
+        if (screen->x >= screen->cols)
+            screen->x = screen->cols - 1;
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        line_feed(screen);
+        break;
+    case '\r':
+        screen->x = 0;
+        screen->wrap_pending = 0;
+        break;
+    case 0x1b:
+        screen->state = S_ESC;
+        break;
+    case 0x18:
+    case 0x1a:
+        screen->state = S_GROUND;
+        break;
+    default:
+        break;
+    }
+}
+
+void screen_feed(vterm_screen_t *screen, const uint8_t *data, int size)
+{
+    int i = 0;
+    uint8_t c;
+    while (i < size)
+    {
+        c = data[i];
+        if (screen->state == S_GROUND && screen->utf8_left == 0)
+        {
+            // fast path: runs of printable ASCII
+            while (c >= 0x20 && c < 0x7f)
+            {
+                if (screen->wrap_pending || screen->x == screen->cols - 1)
+                {
+                    put_char(screen, c);
+                }
+                else
+                {
+                    screen_cell_t *cell = &screen->lines[screen->y][screen->x++];
+                    *cell = screen->pen;
+                    cell->ch = c;
+                }
+                if (++i == size)
+                {
+                    return;
+                }
+                c = data[i];
+            }
+        }
+        i++;
+        switch (screen->state)
+        {
+        case S_GROUND:
+            if (c >= 0x80)
+            {
+                if (screen->utf8_left > 0 && (c & 0xC0) == 0x80)
+                {
+                    screen->utf8 = (screen->utf8 << 6) | (c & 0x3F);
+                    if (--screen->utf8_left == 0)
+                    {
+                        put_char(screen, screen->utf8);
+                    }
+                    continue;
+                }
+                if (screen->utf8_left > 0)
+                {
+                    put_char(screen, 0xFFFD);
+                }
+                if ((c & 0xE0) == 0xC0)
+                {
+                    screen->utf8 = c & 0x1F;
+                    screen->utf8_left = 1;
+                }
+                else if ((c & 0xF0) == 0xE0)
+                {
+                    screen->utf8 = c & 0x0F;
+                    screen->utf8_left = 2;
+                }
+                else if ((c & 0xF8) == 0xF0)
+                {
+                    screen->utf8 = c & 0x07;
+                    screen->utf8_left = 3;
+                }
+                else
+                {
+                    screen->utf8_left = 0;
+                    put_char(screen, 0xFFFD);
+                }
+                continue;
+            }
+            if (screen->utf8_left > 0)
+            {
+                screen->utf8_left = 0;
+                put_char(screen, 0xFFFD);
+            }
+            if (c < 0x20)
+            {
+                control(screen, c);
+            }
+            else if (c != 0x7f)
+            {
+                put_char(screen, c);
+            }
+            break;
+        case S_ESC:
+            if (c < 0x20)
+                control(screen, c);
+            else
+                esc_dispatch(screen, c);
+            break;
+        case S_ESC_SKIP:
+            screen->state = S_GROUND;
+            break;
+        case S_CSI:
+            if (c >= '0' && c <= '9')
+            {
+                if (screen->n_params == 0)
+                    screen->n_params = 1;
+                if (screen->params[screen->n_params - 1] < 10000)
+                    screen->params[screen->n_params - 1] = screen->params[screen->n_params - 1] * 10 + (c - '0');
+            }
+            else if (c == ';' || c == ':')
+            {
+                if (screen->n_params == 0)
+                    screen->n_params = 1;
+                if (screen->n_params < SCREEN_MAX_PARAMS)
+                    screen->params[screen->n_params++] = 0;
+            }
+            else if (c >= '<' && c <= '?')
+            {
+                screen->private = c;
+            }
+            else if (c >= 0x40 && c <= 0x7e)
+            {
+                screen->state = S_GROUND;
+                csi_dispatch(screen, c);
+            }
+            else if (c < 0x20)
+            {
+                control(screen, c);
+            }
+            break;
+        case S_STR:
+            // OSC/DCS strings end with BEL or ST
+            if (c == 0x07)
+                screen->state = S_GROUND;
+            else if (c == 0x1b)
+                screen->state = S_STR_ESC;
+            break;
+        case S_STR_ESC:
+            screen->state = c == '\\' ? S_GROUND : S_STR;
+            break;
+        default:
+            screen->state = S_GROUND;
+            break;
+        }
+    }
+}
+
+vterm_screen_t *screen_new(int rows, int cols, int scrollback)
+{
+    vterm_screen_t *screen = (vterm_screen_t *)calloc(1, sizeof(vterm_screen_t));
+    if (screen == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate screen: %s", strerror(errno));
+        return NULL;
+    }
+    screen->rows = rows;
+    screen->cols = cols;
+    screen->pen.ch = ' ';
+    if (scrollback > 0)
+    {
+        screen->sb = (uint8_t *)malloc(scrollback);
+        screen->sb_cap = scrollback;
+    }
+    screen->line = (uint8_t *)malloc(cols * CELL_ENCODED_MAX + 16);
+    if (screen->line == NULL ||
+        alloc_buffer(screen, &screen->primary, &screen->primary_cells, rows, cols) == -1 ||
+        alloc_buffer(screen, &screen->alt, &screen->alt_cells, rows, cols) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate screen buffers: %s", strerror(errno));
+        screen_free(screen);
+        return NULL;
+    }
+    reset(screen);
+    return screen;
+}
+
+void screen_free(vterm_screen_t *screen)
+{
+    if (screen == NULL)
+    {
+        return;
+    }
+    free(screen->primary);
+    free(screen->primary_cells);
+    free(screen->alt);
+    free(screen->alt_cells);
+    free(screen->sb);
+    free(screen->line);
+    free(screen);
+}
+
+static void copy_buffer(vterm_screen_t *screen, screen_cell_t **from, screen_cell_t **to, int rows, int cols, int shift)
+{
+    int i;
+    int n = screen->cols < cols ? screen->cols : cols;
+    for (i = 0; i < rows && i + shift < screen->rows; i++)
+    {
+        (void)memcpy(to[i], from[i + shift], n * sizeof(screen_cell_t));
+    }
+}
+
+void screen_resize(vterm_screen_t *screen, int rows, int cols)
+{
+    screen_cell_t **primary, **alt;
+    screen_cell_t *primary_cells, *alt_cells;
+    uint8_t *line;
+    int shift = 0;
+    int i;
+    if (rows <= 0 || cols <= 0 || (rows == screen->rows && cols == screen->cols))
+    {
+        return;
+    }
+    line = (uint8_t *)realloc(screen->line, cols * CELL_ENCODED_MAX + 16);
+    if (line == NULL)
+    {
+        return;
+    }
+    screen->line = line;
+    if (alloc_buffer(screen, &primary, &primary_cells, rows, cols) == -1)
+    {
+        return;
+    }
+    if (alloc_buffer(screen, &alt, &alt_cells, rows, cols) == -1)
+    {
+        free(primary);
+        free(primary_cells);
+        return;
+    }
+    // keep the cursor row visible, the rows above go to the scrollback
+    if (screen->y >= rows)
+    {
+        shift = screen->y - rows + 1;
+        for (i = 0; i < shift && !screen->alt_active; i++)
+        {
+            scrollback_push(screen, screen->primary[i]);
+        }
+    }
+    copy_buffer(screen, screen->primary, primary, rows, cols, screen->alt_active ? 0 : shift);
+    copy_buffer(screen, screen->alt, alt, rows, cols, screen->alt_active ? shift : 0);
+    free(screen->primary);
+    free(screen->primary_cells);
+    free(screen->alt);
+    free(screen->alt_cells);
+    screen->primary = primary;
+    screen->primary_cells = primary_cells;
+    screen->alt = alt;
+    screen->alt_cells = alt_cells;
+    screen->lines = screen->alt_active ? alt : primary;
+    screen->rows = rows;
+    screen->cols = cols;
+    screen->y -= shift;
+    screen->top = 0;
+    screen->bottom = rows - 1;
+    clamp_cursor(screen);
+    if (screen->saved_y >= rows)
+        screen->saved_y = rows - 1;
+    if (screen->saved_x >= cols)
+        screen->saved_x = cols - 1;
+}
+
+int screen_snapshot(vterm_screen_t *screen, uint8_t **out)
+{
+    int i, len, first;
+    size_t row = (size_t)screen->cols * CELL_ENCODED_MAX + 16;
+    size_t cap;
+    uint8_t *buff;
+    // the snapshot length is returned as an int
+    if (row > (INT_MAX - 256 - (size_t)screen->sb_size) / 2 / (size_t)screen->rows)
+    {
+        M_ERROR(MODULE_NAME, "Screen of %dx%d is too large for a snapshot", screen->cols, screen->rows);
+        return -1;
+    }
+    cap = (size_t)screen->sb_size + 2 * (size_t)screen->rows * row + 256;
+    buff = (uint8_t *)malloc(cap);
+    if (buff == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate screen snapshot: %s", strerror(errno));
+        return -1;
+    }
+    // reset the client terminal
+    len = sprintf((char *)buff, "\033c");
+    // the scrollback then the primary screen: the lines above the last
+    // rows printed end in the client scrollback
+    first = screen->sb_cap - screen->sb_head;
+    first = first > screen->sb_size ? screen->sb_size : first;
+    if (screen->sb_size > 0)
+    {
+        (void)memcpy(buff + len, screen->sb + screen->sb_head, first);
+        (void)memcpy(buff + len + first, screen->sb, screen->sb_size - first);
+        len += screen->sb_size;
+    }
+    for (i = 0; i < screen->rows; i++)
+    {
+        len += encode_row(screen->primary[i], screen->cols, buff + len);
+        if (i < screen->rows - 1)
+        {
+            buff[len++] = '\r';
+            buff[len++] = '\n';
+        }
+    }
+    if (screen->alt_active)
+    {
+        len += sprintf((char *)buff + len, "\033[?1049h");
+        for (i = 0; i < screen->rows; i++)
+        {
+            len += sprintf((char *)buff + len, "\033[%d;1H", i + 1);
+            len += encode_row(screen->alt[i], screen->cols, buff + len);
+        }
+    }
+    if (screen->top != 0 || screen->bottom != screen->rows - 1)
+    {
+        len += sprintf((char *)buff + len, "\033[%d;%dr", screen->top + 1, screen->bottom + 1);
+    }
+    len += sprintf((char *)buff + len, "\033[%d;%dH", screen->y + 1, screen->x + 1);
+    len += encode_sgr(&screen->pen, buff + len);
+    if (screen->cursor_hidden)
+    {
+        len += sprintf((char *)buff + len, "\033[?25l");
+    }
+    if (!screen->autowrap)
+    {
+        len += sprintf((char *)buff + len, "\033[?7l");
+    }
+    *out = buff;
+    return len;
+}
@@ -0,0 +1,33 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+#include <stdint.h>
+
+#define SCREEN_DEFAULT_ROWS 24
+#define SCREEN_DEFAULT_COLS 80
+#define SCREEN_DEFAULT_SCROLLBACK (64 * 1024)
+
+/**
+ * @brief VT100/xterm screen model of a terminal session, kept up to
+ * date by parsing the PTY output
+ */
+typedef struct vterm_screen vterm_screen_t;
+
+/**
+ * @param scrollback bytes of encoded lines kept once scrolled off the
+ * primary screen
+ */
+vterm_screen_t *screen_new(int rows, int cols, int scrollback);
+void screen_free(vterm_screen_t *screen);
+void screen_resize(vterm_screen_t *screen, int rows, int cols);
+void screen_feed(vterm_screen_t *screen, const uint8_t *data, int size);
+/**
+ * @brief Encode the scrollback, the screen content, the cursor and the
+ * current attributes as an output stream that rebuilds the same state
+ * on a reset terminal of the same size
+ *
+ * @param out allocated buffer, to be freed by the caller
+ * @return size of the snapshot, -1 on error
+ */
+int screen_snapshot(vterm_screen_t *screen, uint8_t **out);
+
+#endif
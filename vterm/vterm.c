@@ -10,305 +10,1580 @@
 #include <sys/select.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/random.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <antd/list.h>
 #include <antd/bst.h>
 #include <antd/utils.h>
 #include <sys/time.h>
 #include "../tunnel.h"
+#include "screen.h"
+#include "record.h"
 
 #define MODULE_NAME "vterm"
 
+#define DEFAULT_FLUSH_SIZE 16384
+#define DEFAULT_FLUSH_DELAY 5
+#define DEFAULT_QUEUE_SIZE 65536
+#define DEFAULT_BUDGET 32768
+
+#define DEFAULT_GRACE_PERIOD 60
+#define VT_TOKEN_SIZE 32
+#define VT_MAX_USER 64
+#define VT_MAX_POOL 16
+#define VT_MAX_OBSERVERS 16
+/** ms before reading again a PTY stopped by a full recording buffer */
+#define VT_RECORD_RETRY 10
+
+/** CTRL request of a screen snapshot, other CTRL of size 8 are resizes */
+#define VT_CTRL_SNAPSHOT 0x01
+/** CTRL [0x02][token] sent to the client owning a session */
+#define VT_CTRL_SESSION 0x02
+/** CTRL [0x03][token] reattach the client to a detached session */
+#define VT_CTRL_ATTACH 0x03
+/** CTRL [0x04][token] watch a session read-only */
+#define VT_CTRL_OBSERVE 0x04
+/**
+ * ms a new client has to attach or observe before its own session is
+ * started, any other message starts it at once
+ */
+#define VT_START_DELAY 200
+/** key of the shared session in processes, never a client id */
+#define VT_SHARED -1
+/** largest window accepted from a client, in rows and in columns */
+#define VT_MAX_WINSIZE 1000
+
 typedef struct
 {
     int fdm;
+    /** -1 once reaped */
     pid_t pid;
+    /** readable when the child exits, -1 with the SIGCHLD fallback */
+    int pidfd;
     int cid;
+    /** coalesced terminal output, queued from out_head */
+    uint8_t *out;
+    int out_head;
+    int out_size;
+    /** client input not yet accepted by the PTY */
+    uint8_t *in;
+    int in_size;
+    int in_capacity;
+    unsigned long long last_flush;
+    vterm_screen_t *screen;
+    char user[VT_MAX_USER];
+    char token[VT_TOKEN_SIZE + 1];
+    unsigned long long detached_at;
+    /**
+     * clients receiving the output without writing to the PTY from
+     * clients[1], clients[0] is set to the owner when sending
+     */
+    uint16_t *clients;
+    int n_observers;
+    int max_observers;
+    /** recording id, 0 if not recorded */
+    uint32_t rec;
 } vterm_proc_t;
 
+/**
+ * @brief PTY pair with a child on its slave side, not yet running the
+ * login program when pooled
+ */
+typedef struct
+{
+    int fdm;
+    pid_t pid;
+    /** write end of the pipe to a pooled helper, -1 otherwise */
+    int ctl;
+} vterm_helper_t;
+
+/**
+ * @brief Client subscribed without a session yet
+ */
+typedef struct
+{
+    char user[VT_MAX_USER];
+    unsigned long long since;
+} vterm_waiting_t;
+
 static bst_node_t *processes = NULL;
+/** sessions without client (cid -1) by token hash */
+static bst_node_t *detached = NULL;
+/** observed session by observer client id */
+static bst_node_t *observed = NULL;
+/** clients without a session yet by client id */
+static bst_node_t *waiting = NULL;
+/** observers of freed sessions, unsubscribed from the main loop */
+static list_t released;
+
+/** output is sent when this size is reached... */
+static int flush_size = DEFAULT_FLUSH_SIZE;
+/** ...or at most once per flush_delay ms */
+static unsigned long long flush_delay = DEFAULT_FLUSH_DELAY;
+/** the PTY of a session is not read while this much output is queued */
+static int queue_size = DEFAULT_QUEUE_SIZE;
+/** bytes read from and sent for a session per loop iteration */
+static int budget = DEFAULT_BUDGET;
+/** bytes of scrollback kept by the screen model of a session */
+static int scrollback = SCREEN_DEFAULT_SCROLLBACK;
+/** detached sessions are killed after this delay (ms) */
+static unsigned long long grace_period = DEFAULT_GRACE_PERIOD * 1000u;
+
+/** SIGCHLD through a signalfd when pidfd_open() is not available */
+static int sigchld_fd = -1;
+/** shared mode: the command run for all the subscribers of the channel */
+static const char *command = NULL;
+static int shared_cols = SCREEN_DEFAULT_COLS;
+static int shared_rows = SCREEN_DEFAULT_ROWS;
+/** pre-forked helpers */
+static vterm_helper_t pool[VT_MAX_POOL];
+static int pool_size = 0;
+static int pool_count = 0;
 
 static volatile int running = 1;
 
-static void int_handler(int dummy)
+static void int_handler(int dummy)
+{
+    (void)dummy;
+    running = 0;
+}
+
+static unsigned long long now_ms()
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000u + ts.tv_nsec / 1000000u;
+}
+
+static int terminal_token(char *token)
+{
+    uint8_t raw[VT_TOKEN_SIZE / 2];
+    int i;
+    if (getrandom(raw, sizeof(raw), 0) != sizeof(raw))
+    {
+        M_ERROR(MODULE_NAME, "Unable to generate session token: %s", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < (int)sizeof(raw); i++)
+    {
+        (void)sprintf(token + 2 * i, "%02x", raw[i]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Replace the helper by the login program of the user, or by the
+ * shared command
+ */
+static void terminal_exec(const char *user)
+{
+    (void)setenv("TERM", "linux", 1);
+    if (command)
+    {
+        (void)execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    }
+    else if (user[0] != '\0')
+    {
+        (void)execlp("su", "su", "-l", user, (char *)NULL);
+    }
+    else
+    {
+        (void)execlp("login", "login", (char *)NULL);
+    }
+    _exit(1);
+}
+
+/**
+ * @brief Open a PTY pair and fork a helper child attached to its slave side
+ *
+ * The helper execs the login program of user right away. Without user,
+ * it waits for the user name on the pipe helper->ctl, ended by a newline,
+ * and exits if the pipe is closed before.
+ */
+static int terminal_fork(const char *user, vterm_helper_t *helper)
+{
+    int fdm, fds, rc;
+    int ctl[2] = {-1, -1};
+    char name[VT_MAX_USER + 1];
+    ssize_t size;
+    int len = 0;
+    pid_t pid;
+    sigset_t mask;
+
+    fdm = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fdm < 0)
+    {
+        M_LOG(MODULE_NAME, "Error on posix_openpt(): %s\n", strerror(errno));
+        return -1;
+    }
+    if (grantpt(fdm) != 0 || unlockpt(fdm) != 0)
+    {
+        M_LOG(MODULE_NAME, "Error on grantpt()/unlockpt(): %s\n", strerror(errno));
+        (void)close(fdm);
+        return -1;
+    }
+    // the PTY of a session is not inherited by the next sessions
+    (void)fcntl(fdm, F_SETFD, FD_CLOEXEC);
+    // Open the slave side ot the PTY
+    fds = open(ptsname(fdm), O_RDWR | O_NOCTTY);
+    if (fds == -1)
+    {
+        M_LOG(MODULE_NAME, "Unable to open %s: %s\n", ptsname(fdm), strerror(errno));
+        (void)close(fdm);
+        return -1;
+    }
+    if (user == NULL && pipe2(ctl, O_CLOEXEC) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create helper pipe: %s", strerror(errno));
+        (void)close(fds);
+        (void)close(fdm);
+        return -1;
+    }
+
+    // Create the child process
+    pid = fork();
+    if (pid == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to fork terminal process: %s", strerror(errno));
+        (void)close(fds);
+        (void)close(fdm);
+        if (ctl[0] != -1)
+        {
+            (void)close(ctl[0]);
+            (void)close(ctl[1]);
+        }
+        return -1;
+    }
+    if (pid)
+    {
+        // parent
+        (void)close(fds);
+        if (ctl[0] != -1)
+        {
+            (void)close(ctl[0]);
+        }
+        helper->fdm = fdm;
+        helper->pid = pid;
+        helper->ctl = ctl[1];
+        return 0;
+    }
+    // CHILD
+    (void)close(fdm);
+    if (ctl[1] != -1)
+    {
+        (void)close(ctl[1]);
+    }
+    // the other pooled helpers must see the end of their pipe
+    for (rc = 0; rc < pool_count; rc++)
+    {
+        (void)close(pool[rc].ctl);
+        (void)close(pool[rc].fdm);
+    }
+    // The slave side of the PTY becomes the standard input and outputs of the child process
+    // we use cook mode here
+    rc = dup2(fds, 0);
+    rc = dup2(fds, 1);
+    rc = dup2(fds, 2);
+    (void)rc;
+    if (fds > 2)
+    {
+        close(fds);
+    }
+    // the login program starts with the default signal dispositions
+    (void)signal(SIGPIPE, SIG_DFL);
+    (void)signal(SIGABRT, SIG_DFL);
+    (void)signal(SIGINT, SIG_DFL);
+    (void)sigemptyset(&mask);
+    (void)sigprocmask(SIG_SETMASK, &mask, NULL);
+    // Make the current process a new session leader
+    setsid();
+    // As the child is a session leader, set the controlling terminal to be the slave side of the PTY
+    // (Mandatory for programs like the shell to make them manage correctly their outputs)
+    ioctl(0, TIOCSCTTY, 1);
+    if (user == NULL)
+    {
+        // pooled helper, wait to be bound to a user
+        while (len == 0 || name[len - 1] != '\n')
+        {
+            size = read(ctl[0], name + len, sizeof(name) - len);
+            if (size == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (size <= 0 || len + size > (int)sizeof(name) - 1)
+            {
+                _exit(1);
+            }
+            len += size;
+        }
+        name[len - 1] = '\0';
+        user = name;
+    }
+    terminal_exec(user);
+    return -1;
+}
+
+/**
+ * @brief Keep pool_size helpers ready to be bound to a user
+ */
+static void terminal_pool_fill()
+{
+    while (pool_count < pool_size && terminal_fork(NULL, &pool[pool_count]) == 0)
+    {
+        pool_count++;
+    }
+}
+
+static void terminal_pool_free()
+{
+    while (pool_count > 0)
+    {
+        pool_count--;
+        // the helper exits on end of file
+        (void)close(pool[pool_count].ctl);
+        (void)close(pool[pool_count].fdm);
+        (void)waitpid(pool[pool_count].pid, NULL, 0);
+    }
+}
+
+/**
+ * @brief Bind a pooled helper to user
+ *
+ * @return 0 on success, -1 if no live helper is available
+ */
+static int terminal_pool_take(const char *user, vterm_helper_t *helper)
+{
+    char name[VT_MAX_USER + 1];
+    int len = snprintf(name, sizeof(name), "%s\n", user);
+    pid_t wpid;
+    while (pool_count > 0)
+    {
+        pool_count--;
+        *helper = pool[pool_count];
+        // the pipe is empty, a write of this size never blocks
+        wpid = waitpid(helper->pid, NULL, WNOHANG);
+        if (wpid == 0 && write(helper->ctl, name, len) == len)
+        {
+            (void)close(helper->ctl);
+            helper->ctl = -1;
+            return 0;
+        }
+        M_ERROR(MODULE_NAME, "Pooled terminal helper %d is not available", helper->pid);
+        (void)close(helper->ctl);
+        (void)close(helper->fdm);
+        // an exited helper may already be reaped, its pid reused
+        if (wpid == 0)
+        {
+            (void)kill(helper->pid, SIGKILL);
+            (void)waitpid(helper->pid, NULL, 0);
+        }
+    }
+    return -1;
+}
+
+static int terminal_pidfd(pid_t pid)
+{
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    if (sigchld_fd == -1)
+    {
+        pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to watch process %d: %s", pid, strerror(errno));
+        }
+    }
+#else
+    (void)pid;
+#endif
+    return pidfd;
+}
+
+/**
+ * @brief Receive SIGCHLD through a signalfd if processes cannot be
+ * watched with a pidfd
+ */
+static int terminal_watch_init()
+{
+    sigset_t mask;
+#ifdef SYS_pidfd_open
+    int pidfd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (pidfd != -1)
+    {
+        (void)close(pidfd);
+        return 0;
+    }
+#endif
+    M_LOG(MODULE_NAME, "pidfd_open() is not available, use SIGCHLD");
+    (void)sigemptyset(&mask);
+    (void)sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to block SIGCHLD: %s", strerror(errno));
+        return -1;
+    }
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create signalfd: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void mark_reaped(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    pid_t *pid = (pid_t *)args[0];
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+    if (proc != NULL && proc->pid == *pid)
+    {
+        proc->pid = -1;
+    }
+}
+
+/**
+ * @brief Reap the exited children signaled on sigchld_fd, their sessions
+ * are marked with pid -1
+ */
+static void terminal_reap()
+{
+    struct signalfd_siginfo info;
+    pid_t pid;
+    void *args[1];
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+        ;
+    args[0] = (void *)&pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    {
+        bst_for_each(processes, mark_reaped, args, 1);
+        bst_for_each(detached, mark_reaped, args, 1);
+    }
+}
+
+static int terminal_exited(vterm_proc_t *proc, fd_set *fd_in)
+{
+    return proc->pid == -1 || (proc->pidfd != -1 && FD_ISSET(proc->pidfd, fd_in));
+}
+
+static void terminal_watch(vterm_proc_t *proc, fd_set *fd_in, int *max_fd)
+{
+    if (proc->pidfd != -1)
+    {
+        FD_SET(proc->pidfd, fd_in);
+        if (*max_fd < proc->pidfd)
+        {
+            *max_fd = proc->pidfd;
+        }
+    }
+}
+
+static vterm_proc_t *terminal_new(const char *user)
+{
+    vterm_helper_t helper;
+    vterm_proc_t *proc = NULL;
+    if (user == NULL)
+    {
+        user = "";
+    }
+    // su would read it as an option
+    if (user[0] == '-')
+    {
+        M_ERROR(MODULE_NAME, "Invalid user name: %s", user);
+        return NULL;
+    }
+    if (terminal_pool_take(user, &helper) == -1 && terminal_fork(user, &helper) == -1)
+    {
+        return NULL;
+    }
+    proc = (vterm_proc_t *)malloc(sizeof(vterm_proc_t));
+    if (proc == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate terminal process: %s", strerror(errno));
+        (void)close(helper.fdm);
+        (void)kill(helper.pid, SIGKILL);
+        (void)waitpid(helper.pid, NULL, 0);
+        return NULL;
+    }
+    // the output is drained until empty
+    (void)fcntl(helper.fdm, F_SETFL, fcntl(helper.fdm, F_GETFL) | O_NONBLOCK);
+    proc->fdm = helper.fdm;
+    proc->pid = helper.pid;
+    proc->pidfd = terminal_pidfd(helper.pid);
+    proc->out = NULL;
+    proc->out_head = 0;
+    proc->out_size = 0;
+    proc->in = NULL;
+    proc->in_size = 0;
+    proc->in_capacity = 0;
+    proc->last_flush = 0;
+    proc->screen = screen_new(SCREEN_DEFAULT_ROWS, SCREEN_DEFAULT_COLS, scrollback);
+    (void)snprintf(proc->user, sizeof(proc->user), "%s", user);
+    proc->detached_at = 0;
+    proc->clients = NULL;
+    proc->n_observers = 0;
+    proc->max_observers = 0;
+    if (terminal_token(proc->token) == -1)
+    {
+        proc->token[0] = '\0';
+    }
+    proc->rec = record_open(user, proc->token, SCREEN_DEFAULT_COLS, SCREEN_DEFAULT_ROWS);
+    return proc;
+}
+
+static void terminal_free(vterm_proc_t *proc)
+{
+    int i;
+    for (i = 0; i < proc->n_observers; i++)
+    {
+        observed = bst_delete(observed, proc->clients[1 + i]);
+        list_put_i(&released, proc->clients[1 + i]);
+    }
+    if (proc->clients)
+    {
+        free(proc->clients);
+    }
+    (void)close(proc->fdm);
+    if (proc->rec)
+    {
+        record_end(proc->rec);
+    }
+    if (proc->pid != -1)
+    {
+        M_LOG(MODULE_NAME, "Kill the process %d", proc->pid);
+        if (kill(proc->pid, SIGKILL) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to kill process %d: %s", proc->pid, strerror(errno));
+        }
+        else
+        {
+            (void)waitpid(proc->pid, NULL, 0);
+        }
+    }
+    if (proc->pidfd != -1)
+    {
+        (void)close(proc->pidfd);
+    }
+    if (proc->out)
+    {
+        free(proc->out);
+    }
+    if (proc->in)
+    {
+        free(proc->in);
+    }
+    screen_free(proc->screen);
+    free(proc);
+}
+
+static int terminal_add_observer(vterm_proc_t *proc, int cid)
+{
+    uint16_t *clients;
+    int size;
+    if (proc->n_observers == proc->max_observers)
+    {
+        size = proc->max_observers > 0 ? 2 * proc->max_observers : VT_MAX_OBSERVERS;
+        clients = (uint16_t *)realloc(proc->clients, (size + 1) * sizeof(uint16_t));
+        if (clients == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate observers of the session of %s: %s", proc->user, strerror(errno));
+            return -1;
+        }
+        proc->clients = clients;
+        proc->max_observers = size;
+    }
+    proc->clients[1 + proc->n_observers++] = (uint16_t)cid;
+    return 0;
+}
+
+static void terminal_kill(int client_id, int should_delete)
+{
+    // find the proc
+    bst_node_t *node = bst_find(processes, client_id);
+    vterm_proc_t *proc;
+    if (node != NULL)
+    {
+        proc = (vterm_proc_t *)node->data;
+        if (proc != NULL)
+        {
+            terminal_free(proc);
+            node->data = NULL;
+            if (should_delete)
+                processes = bst_delete(processes, node->key);
+            // wait child
+        }
+    }
+}
+
+/**
+ * @brief Queue the input the PTY did not take, at most queue_size bytes
+ * wait for the program to read its terminal, the rest is dropped
+ */
+static void terminal_queue_input(vterm_proc_t *proc, const uint8_t *data, int size)
+{
+    uint8_t *in;
+    int capacity;
+    if (proc->in_size + size > queue_size)
+    {
+        M_ERROR(MODULE_NAME, "Input queue of the session of %s is full, %d bytes dropped", proc->user,
+                proc->in_size + size - queue_size);
+        size = queue_size - proc->in_size;
+    }
+    if (proc->in_size + size > proc->in_capacity)
+    {
+        capacity = proc->in_capacity > 0 ? proc->in_capacity : BUFFLEN;
+        while (capacity < proc->in_size + size)
+        {
+            capacity *= 2;
+        }
+        in = (uint8_t *)realloc(proc->in, capacity);
+        if (in == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate input queue of the session of %s: %s", proc->user, strerror(errno));
+            return;
+        }
+        proc->in = in;
+        proc->in_capacity = capacity;
+    }
+    (void)memcpy(proc->in + proc->in_size, data, size);
+    proc->in_size += size;
+}
+
+/**
+ * @brief Write as much of data as the PTY takes without blocking
+ *
+ * @return written size, -1 on error
+ */
+static int terminal_input(vterm_proc_t *proc, const uint8_t *data, int size)
+{
+    ssize_t status;
+    int written = 0;
+    while (written < size)
+    {
+        status = write(proc->fdm, data + written, size - written);
+        if (status == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        written += status;
+    }
+    return written;
+}
+
+/**
+ * @brief Write the queued input once the PTY is writable again
+ *
+ * @return 0 on success, -1 on error
+ */
+static int terminal_drain(vterm_proc_t *proc)
+{
+    int written = terminal_input(proc, proc->in, proc->in_size);
+    if (written == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to write queued input to the terminal of client %d: %s", proc->cid, strerror(errno));
+        return -1;
+    }
+    proc->in_size -= written;
+    if (proc->in_size > 0 && written > 0)
+    {
+        (void)memmove(proc->in, proc->in + written, proc->in_size);
+    }
+    return 0;
+}
+
+/**
+ * @brief Write client data to the PTY, what the PTY does not take now is
+ * queued after the pending input and written when it becomes writable
+ */
+static int terminal_write(tunnel_msg_t *msg)
+{
+    // TODO: control frame e.g. for window resize
+    bst_node_t *node = bst_find(processes, msg->header.client_id);
+    vterm_proc_t *proc;
+    int written = 0;
+    if (node != NULL)
+    {
+        proc = (vterm_proc_t *)node->data;
+        if (proc != NULL)
+        {
+            // keep the order of the keystrokes
+            if (proc->in_size == 0)
+            {
+                written = terminal_input(proc, msg->data, msg->header.size);
+            }
+            if (written == -1)
+            {
+                M_ERROR(MODULE_NAME, "Unable to write data to the terminal corresponding to client %d: %s", msg->header.client_id,
+                        strerror(errno));
+                return -1;
+            }
+            if (written < (int)msg->header.size)
+            {
+                terminal_queue_input(proc, msg->data + written, msg->header.size - written);
+            }
+        }
+        else
+        {
+            M_ERROR(MODULE_NAME, "Unable to find the process linked to client %d", msg->header.client_id);
+            return -1;
+        }
+    }
+    else
+    {
+        M_ERROR(MODULE_NAME, "Unable to find the process from processes list for %d", msg->header.client_id);
+        return -1;
+    }
+    return 0;
+}
+
+static void unsubscribe(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    tunnel_msg_t msg;
+    int *ufd = (int *)args[0];
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+    if (proc != NULL)
+    {
+        msg.header.type = CHANNEL_UNSUBSCRIBE;
+        msg.header.client_id = proc->cid;
+        msg.header.size = 0;
+        terminal_kill(node->key, 0);
+        // the subscribers of the shared session are released as observers
+        if (node->key != VT_SHARED && msg_write(*ufd, &msg) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to request unsubscribe to client %d", proc->cid);
+        }
+    }
+}
+
+/**
+ * @brief Send at most budget bytes of the queued output to the owner and
+ * the observers of the session, in frames of at most flush_size bytes
+ */
+static int terminal_flush(int fd, vterm_proc_t *proc)
+{
+    tunnel_msg_t msg;
+    uint16_t owner = (uint16_t)proc->cid;
+    uint16_t *clients = &owner;
+    int n = proc->cid != -1;
+    int sent = 0;
+    proc->last_flush = now_ms();
+    if (proc->n_observers > 0)
+    {
+        clients = proc->clients + 1;
+        n = proc->n_observers;
+        if (proc->cid != -1)
+        {
+            proc->clients[0] = owner;
+            clients--;
+            n++;
+        }
+    }
+    // the output of a detached session only updates its screen
+    if (n == 0)
+    {
+        proc->out_head = 0;
+        proc->out_size = 0;
+        return 0;
+    }
+    msg.header.channel_id = 0;
+    msg.header.client_id = 0;
+    msg.header.type = CHANNEL_DATA;
+    while (proc->out_size > 0 && sent < budget)
+    {
+        msg.header.size = proc->out_size > flush_size ? flush_size : proc->out_size;
+        msg.data = proc->out + proc->out_head;
+        if (msg_write_fanout(fd, &msg, clients, n) == -1)
+        {
+            return -1;
+        }
+        proc->out_head += msg.header.size;
+        proc->out_size -= msg.header.size;
+        sent += msg.header.size;
+    }
+    if (proc->out_size == 0)
+    {
+        proc->out_head = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send the output queue once it holds a full frame or once
+ * flush_delay elapsed since the last flush
+ */
+static int terminal_flush_due(int fd, vterm_proc_t *proc, unsigned long long now)
+{
+    if (proc->out_size >= flush_size || (proc->out_size > 0 && now >= proc->last_flush + flush_delay))
+    {
+        return terminal_flush(fd, proc);
+    }
+    return 0;
+}
+
+/**
+ * @brief Read at most budget bytes of terminal output into the session
+ * queue. The queue is sent once it holds a full frame, or as soon as the
+ * last flush is older than flush_delay so that an isolated echo is not
+ * delayed. A full queue is not read until it drains, the PTY then blocks
+ * the program
+ *
+ * @return 0 on success, -1 on hotline error, 1 if the terminal is closed
+ */
+static int terminal_read(int fd, vterm_proc_t *proc)
+{
+    int rc, room;
+    int left = budget;
+    if (proc->out == NULL)
+    {
+        proc->out = (uint8_t *)malloc(queue_size);
+        if (proc->out == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate output queue of client %d: %s", proc->cid, strerror(errno));
+            return -1;
+        }
+    }
+    while (left > 0)
+    {
+        if (proc->out_head > 0 && proc->out_head + proc->out_size == queue_size)
+        {
+            (void)memmove(proc->out, proc->out + proc->out_head, proc->out_size);
+            proc->out_head = 0;
+        }
+        room = queue_size - proc->out_head - proc->out_size;
+        if (proc->rec && record_room() < room)
+        {
+            room = record_room();
+        }
+        if (room == 0)
+        {
+            break;
+        }
+        rc = read(proc->fdm, proc->out + proc->out_head + proc->out_size, room > left ? left : room);
+        if (rc > 0)
+        {
+            if (proc->screen)
+            {
+                screen_feed(proc->screen, proc->out + proc->out_head + proc->out_size, rc);
+            }
+            if (proc->rec)
+            {
+                record_output(proc->rec, proc->out + proc->out_head + proc->out_size, rc);
+            }
+            proc->out_size += rc;
+            left -= rc;
+            continue;
+        }
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        // EIO once the slave side is closed
+        if (rc == -1 && errno != EIO)
+        {
+            M_LOG(MODULE_NAME, "Error on read standard input: %s\n", strerror(errno));
+        }
+        while (proc->out_size > 0)
+        {
+            if (terminal_flush(fd, proc) == -1)
+            {
+                return -1;
+            }
+        }
+        return 1;
+    }
+    return terminal_flush_due(fd, proc, now_ms());
+}
+
+/**
+ * @brief Check that the output of a recorded session can be read without
+ * dropping it from the recording, otherwise retry after VT_RECORD_RETRY
+ */
+static int terminal_recordable(vterm_proc_t *proc, unsigned long long *now, unsigned long long *deadline)
+{
+    if (!proc->rec || record_room() > 0)
+    {
+        return 1;
+    }
+    if (*deadline == 0 || *now + VT_RECORD_RETRY < *deadline)
+    {
+        *deadline = *now + VT_RECORD_RETRY;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait for the PTY to be writable while input is queued
+ */
+static void terminal_watch_input(vterm_proc_t *proc, fd_set *fd_out, int *max_fd)
+{
+    if (proc->in_size > 0)
+    {
+        FD_SET(proc->fdm, fd_out);
+        if (*max_fd < proc->fdm)
+        {
+            *max_fd = proc->fdm;
+        }
+    }
+}
+
+/**
+ * @brief Wake up select() for the next flush of the output queue
+ */
+static void terminal_flush_deadline(vterm_proc_t *proc, unsigned long long *now, unsigned long long *deadline)
+{
+    if (proc->out_size >= flush_size)
+    {
+        // the rest of a full queue is sent at the next iteration
+        *deadline = *now;
+    }
+    else if (proc->out_size > 0 && (*deadline == 0 || proc->last_flush + flush_delay < *deadline))
+    {
+        *deadline = proc->last_flush + flush_delay;
+    }
+}
+
+static void set_sock_fd(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    fd_set *fd_in = (fd_set *)args[1];
+    int *max_fd = (int *)args[2];
+    list_t *list_p = (list_t *)args[3];
+    unsigned long long *now = (unsigned long long *)args[4];
+    unsigned long long *deadline = (unsigned long long *)args[5];
+    int *ufd = (int *)args[0];
+
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+
+    if (proc != NULL)
+    {
+        if (terminal_flush_due(*ufd, proc, *now) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to send data to client %d", proc->cid);
+            terminal_kill(node->key, 0);
+            list_put_i(list_p, node->key);
+        }
+        else
+        {
+            terminal_flush_deadline(proc, now, deadline);
+            terminal_watch(proc, fd_in, max_fd);
+            terminal_watch_input(proc, (fd_set *)args[6], max_fd);
+            // backpressure on the program until the queue drains
+            if (proc->out_size < queue_size && terminal_recordable(proc, now, deadline))
+            {
+                FD_SET(proc->fdm, fd_in);
+                if (*max_fd < proc->fdm)
+                {
+                    *max_fd = proc->fdm;
+                }
+            }
+        }
+    }
+}
+
+static void terminal_monitor(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    int *ufd = (int *)args[0];
+    fd_set *fd_in = (fd_set *)args[1];
+    list_t *list = (list_t *)args[3];
+    int rc = 0;
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+
+    if (proc != NULL)
+    {
+        if (proc->in_size > 0 && FD_ISSET(proc->fdm, (fd_set *)args[6]) && terminal_drain(proc) == -1)
+        {
+            rc = 1;
+        }
+        if (rc == 0 && FD_ISSET(proc->fdm, fd_in))
+        {
+            rc = terminal_read(*ufd, proc);
+        }
+        if (rc == 0 && terminal_exited(proc, fd_in))
+        {
+            M_LOG(MODULE_NAME, "Terminal linked to client %d exits\n", node->key);
+            rc = 1;
+        }
+        if (rc == -1)
+        {
+            terminal_kill(node->key, 0);
+            M_ERROR(MODULE_NAME, "Unable to send data to client %d", node->key);
+            list_put_i(list, node->key);
+        }
+        else if (rc == 1)
+        {
+            M_LOG(MODULE_NAME, "Terminal linked to client %d is closed\n", node->key);
+            unsubscribe(node, args, argc);
+            list_put_i(list, node->key);
+        }
+    }
+}
+
+static void set_detached_fd(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    fd_set *fd_in = (fd_set *)args[1];
+    int *max_fd = (int *)args[2];
+    list_t *expired = (list_t *)args[3];
+    unsigned long long *now = (unsigned long long *)args[4];
+    unsigned long long *deadline = (unsigned long long *)args[5];
+    int *ufd = (int *)args[0];
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+    if (proc == NULL)
+    {
+        return;
+    }
+    // observers get the output left since the last read
+    if (proc->pid == -1 || *now >= proc->detached_at + grace_period || terminal_flush_due(*ufd, proc, *now) == -1)
+    {
+        list_put_i(expired, node->key);
+        return;
+    }
+    if (*deadline == 0 || proc->detached_at + grace_period < *deadline)
+    {
+        *deadline = proc->detached_at + grace_period;
+    }
+    terminal_flush_deadline(proc, now, deadline);
+    terminal_watch(proc, fd_in, max_fd);
+    terminal_watch_input(proc, (fd_set *)args[6], max_fd);
+    if (!terminal_recordable(proc, now, deadline))
+    {
+        return;
+    }
+    FD_SET(proc->fdm, fd_in);
+    if (*max_fd < proc->fdm)
+    {
+        *max_fd = proc->fdm;
+    }
+}
+
+static void detached_monitor(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    int *ufd = (int *)args[0];
+    fd_set *fd_in = (fd_set *)args[1];
+    list_t *expired = (list_t *)args[3];
+    vterm_proc_t *proc = (vterm_proc_t *)node->data;
+    if (proc == NULL)
+    {
+        return;
+    }
+    // the PTY is still drained so that the program does not block
+    if ((proc->in_size > 0 && FD_ISSET(proc->fdm, (fd_set *)args[6]) && terminal_drain(proc) == -1) ||
+        (FD_ISSET(proc->fdm, fd_in) && terminal_read(*ufd, proc) != 0) || terminal_exited(proc, fd_in) ||
+        terminal_flush_due(*ufd, proc, now_ms()) == -1)
+    {
+        list_put_i(expired, node->key);
+    }
+}
+
+static void terminal_expire(list_t *expired)
+{
+    item_t item;
+    bst_node_t *node;
+    list_for_each(item, *expired)
+    {
+        node = bst_find(detached, item->value.i);
+        if (node && node->data)
+        {
+            M_LOG(MODULE_NAME, "Detached session of %s is closed", ((vterm_proc_t *)node->data)->user);
+            terminal_free((vterm_proc_t *)node->data);
+            node->data = NULL;
+            detached = bst_delete(detached, item->value.i);
+        }
+    }
+    list_free(expired);
+}
+
+static void free_detached(bst_node_t *node, void **args, int argc)
+{
+    (void)args;
+    (void)argc;
+    if (node->data)
+    {
+        terminal_free((vterm_proc_t *)node->data);
+        node->data = NULL;
+    }
+}
+
+/**
+ * @brief Keep the session of a leaving client for grace_period, the
+ * session stays addressable by its token
+ */
+static void terminal_detach(int fd, int cid)
+{
+    bst_node_t *node = bst_find(processes, cid);
+    vterm_proc_t *proc;
+    int hash;
+    if (node == NULL || node->data == NULL || grace_period == 0)
+    {
+        terminal_kill(cid, 1);
+        return;
+    }
+    proc = (vterm_proc_t *)node->data;
+    hash = simple_hash(proc->token);
+    if (proc->token[0] == '\0' || bst_find(detached, hash) != NULL)
+    {
+        terminal_kill(cid, 1);
+        return;
+    }
+    processes = bst_delete(processes, cid);
+    proc->cid = -1;
+    // the pending output still goes to the observers
+    while (proc->out_size > 0)
+    {
+        if (terminal_flush(fd, proc) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to send data to the observers of client %d", cid);
+            proc->out_head = 0;
+            proc->out_size = 0;
+        }
+    }
+    proc->detached_at = now_ms();
+    detached = bst_insert(detached, hash, proc);
+    M_LOG(MODULE_NAME, "Session of client %d is detached", cid);
+}
+
+static int terminal_send_token(int fd, vterm_proc_t *proc)
+{
+    tunnel_msg_t msg;
+    uint8_t data[VT_TOKEN_SIZE + 1];
+    if (proc->token[0] == '\0')
+    {
+        return 0;
+    }
+    data[0] = VT_CTRL_SESSION;
+    (void)memcpy(data + 1, proc->token, VT_TOKEN_SIZE);
+    msg.header.channel_id = 0;
+    msg.header.client_id = proc->cid;
+    msg.header.type = CHANNEL_CTRL;
+    msg.header.size = sizeof(data);
+    msg.data = data;
+    return msg_write(fd, &msg);
+}
+
+static void terminal_resize(int cid, int col, int row)
+{
+    struct winsize win = {0, 0, 0, 0};
+    bst_node_t *node;
+    vterm_proc_t *proc;
+    if (col == 0 || row == 0)
+    {
+        M_ERROR(MODULE_NAME, "Invalid terminal window size (%d,%d) for client %d", col, row, cid);
+        return;
+    }
+    col = col > VT_MAX_WINSIZE ? VT_MAX_WINSIZE : col;
+    row = row > VT_MAX_WINSIZE ? VT_MAX_WINSIZE : row;
+    node = bst_find(processes, cid);
+    if (node != NULL)
+    {
+        proc = (vterm_proc_t *)node->data;
+        if (ioctl(proc->fdm, TIOCGWINSZ, &win) != 0)
+        {
+            if (errno != EINVAL)
+            {
+                M_ERROR(MODULE_NAME, "Unable to get terminal winsize setting: %s", strerror(errno));
+                return;
+            }
+            memset(&win, 0, sizeof(win));
+        }
+        //printf("Setting winsize\n");
+        if (row >= 0)
+            win.ws_row = (unsigned short)row;
+        if (col >= 0)
+            win.ws_col = (unsigned short)col;
+
+        if (ioctl(proc->fdm, TIOCSWINSZ, (char *)&win) != 0)
+            M_ERROR(MODULE_NAME, "Unable to set terminal window size process linked to client %d: %s", cid, strerror(errno));
+        else
+        {
+            if (proc->screen)
+                screen_resize(proc->screen, win.ws_row, win.ws_col);
+            if (proc->rec)
+                record_resize(proc->rec, win.ws_col, win.ws_row);
+        }
+    }
+    else
+    {
+        M_ERROR(MODULE_NAME, "Unable to find the terminal process linked to client %d", cid);
+    }
+}
+
+/**
+ * @brief Send the current screen of a session to its owner or to one of
+ * its observers. The pending output is sent to all of them first, the
+ * snapshot starts with a terminal reset
+ */
+static int terminal_snapshot(int fd, int cid)
+{
+    bst_node_t *node = bst_find(processes, cid);
+    vterm_proc_t *proc;
+    tunnel_msg_t msg;
+    uint8_t *data;
+    int size, status;
+    if (node == NULL || node->data == NULL)
+    {
+        node = bst_find(observed, cid);
+    }
+    if (node == NULL || node->data == NULL || ((vterm_proc_t *)node->data)->screen == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to find the terminal screen linked to client %d", cid);
+        return 0;
+    }
+    proc = (vterm_proc_t *)node->data;
+    while (proc->out_size > 0)
+    {
+        if (terminal_flush(fd, proc) == -1)
+        {
+            return -1;
+        }
+    }
+    size = screen_snapshot(proc->screen, &data);
+    if (size == -1)
+    {
+        return 0;
+    }
+    msg.header.channel_id = 0;
+    msg.header.client_id = cid;
+    msg.header.type = CHANNEL_DATA;
+    msg.header.size = size;
+    msg.data = data;
+    status = msg_write(fd, &msg);
+    free(data);
+    return status;
+}
+
+static int terminal_unknown(int fd, int cid)
+{
+    tunnel_msg_t msg;
+    M_ERROR(MODULE_NAME, "Client %d requests an unknown session", cid);
+    msg.header.channel_id = 0;
+    msg.header.client_id = cid;
+    msg.header.type = CHANNEL_ERROR;
+    msg.header.size = strlen("Unknown session");
+    msg.data = (uint8_t *)"Unknown session";
+    return msg_write(fd, &msg);
+}
+
+static void terminal_unwait(int cid)
+{
+    bst_node_t *node = bst_find(waiting, cid);
+    if (node)
+    {
+        if (node->data)
+        {
+            free(node->data);
+            node->data = NULL;
+        }
+        waiting = bst_delete(waiting, cid);
+    }
+}
+
+/**
+ * @brief Hold a new client for VT_START_DELAY before starting its session,
+ * so that a client attaching to another session never spawns one
+ */
+static int terminal_wait(int cid, const char *user)
+{
+    vterm_waiting_t *wait = (vterm_waiting_t *)malloc(sizeof(vterm_waiting_t));
+    terminal_unwait(cid);
+    if (wait == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate waiting client %d: %s", cid, strerror(errno));
+        return -1;
+    }
+    (void)snprintf(wait->user, sizeof(wait->user), "%s", user);
+    wait->since = now_ms();
+    waiting = bst_insert(waiting, cid, wait);
+    return 0;
+}
+
+/**
+ * @brief Start the session of a waiting client, the client is
+ * unsubscribed if it cannot be created
+ */
+static int terminal_start(int fd, int cid)
 {
-    (void)dummy;
-    running = 0;
+    bst_node_t *node = bst_find(waiting, cid);
+    vterm_proc_t *proc;
+    tunnel_msg_t msg;
+    if (node == NULL || node->data == NULL)
+    {
+        return 0;
+    }
+    proc = terminal_new(((vterm_waiting_t *)node->data)->user);
+    terminal_unwait(cid);
+    if (proc == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create new terminal for client %d", cid);
+        // unsubscribe client
+        msg.header.channel_id = 0;
+        msg.header.client_id = cid;
+        msg.header.type = CHANNEL_UNSUBSCRIBE;
+        msg.header.size = 0;
+        msg.data = NULL;
+        return msg_write(fd, &msg);
+    }
+    proc->cid = cid;
+    // insert new terminal to the list
+    processes = bst_insert(processes, cid, proc);
+    return terminal_send_token(fd, proc);
 }
 
-static vterm_proc_t *terminal_new(const char *user)
+static void set_waiting_deadline(bst_node_t *node, void **args, int argc)
 {
-    int fdm, fds, rc;
-    pid_t pid;
-    vterm_proc_t *proc = NULL;
-    char cmd[64];
-    (void)memset(cmd, 0, sizeof(cmd));
-    if (user && strlen(user) > 0)
+    (void)argc;
+    list_t *expired = (list_t *)args[3];
+    unsigned long long *now = (unsigned long long *)args[4];
+    unsigned long long *deadline = (unsigned long long *)args[5];
+    vterm_waiting_t *wait = (vterm_waiting_t *)node->data;
+    if (wait == NULL)
     {
-        snprintf(cmd, sizeof(cmd), "TERM=linux su -l %s", user);
+        return;
     }
-    else
+    if (*now >= wait->since + VT_START_DELAY)
     {
-        snprintf(cmd, sizeof(cmd), "TERM=linux login");
+        list_put_i(expired, node->key);
     }
-    // Check arguments
-    fdm = posix_openpt(O_RDWR);
-    if (fdm < 0)
+    else if (*deadline == 0 || wait->since + VT_START_DELAY < *deadline)
     {
-        M_LOG(MODULE_NAME, "Error on posix_openpt(): %s\n", strerror(errno));
-        return NULL;
+        *deadline = wait->since + VT_START_DELAY;
     }
+}
 
-    rc = grantpt(fdm);
-    if (rc != 0)
+static void free_waiting(bst_node_t *node, void **args, int argc)
+{
+    (void)args;
+    (void)argc;
+    if (node->data)
     {
-        M_LOG(MODULE_NAME, "Error on grantpt(): %s\n", strerror(errno));
-        return NULL;
+        free(node->data);
+        node->data = NULL;
     }
-    rc = unlockpt(fdm);
-    if (rc != 0)
+}
+
+/**
+ * @brief Give a detached session of the same user to a client. A waiting
+ * client gets no session of its own, a session the client already owns
+ * is dropped. The client receives the screen snapshot of the detached one
+ */
+static int terminal_attach(int fd, int cid, const uint8_t *token)
+{
+    char key[VT_TOKEN_SIZE + 1];
+    bst_node_t *node = bst_find(processes, cid);
+    bst_node_t *wnode = bst_find(waiting, cid);
+    bst_node_t *dnode;
+    vterm_proc_t *proc;
+    const char *user = NULL;
+    int hash;
+    if (node && node->data)
     {
-        M_LOG(MODULE_NAME, "Error on unlockpt(): %s\n", strerror(errno));
-        return NULL;
+        user = ((vterm_proc_t *)node->data)->user;
     }
-
-    // Open the slave side ot the PTY
-    fds = open(ptsname(fdm), O_RDWR);
-
-    // Create the child process
-    pid = fork();
-    if (pid)
+    else if (wnode && wnode->data)
     {
-        // parent
-        proc = (vterm_proc_t *)malloc(sizeof(vterm_proc_t));
-        proc->fdm = fdm;
-        proc->pid = pid;
-        return proc;
+        user = ((vterm_waiting_t *)wnode->data)->user;
     }
-    else
+    (void)memcpy(key, token, VT_TOKEN_SIZE);
+    key[VT_TOKEN_SIZE] = '\0';
+    hash = simple_hash(key);
+    dnode = bst_find(detached, hash);
+    if (user == NULL || dnode == NULL || dnode->data == NULL || !EQU(((vterm_proc_t *)dnode->data)->token, key) ||
+        !EQU(((vterm_proc_t *)dnode->data)->user, user))
     {
-        //struct termios slave_orig_term_settings; // Saved terminal settings
-        //struct termios new_term_settings; // Current terminal settings
-
-        // CHILD
-
-        // Close the master side of the PTY
-        close(fdm);
-
-        // Save the defaults parameters of the slave side of the PTY
-        //rc = tcgetattr(fds, &slave_orig_term_settings);
-
-        // Set RAW mode on slave side of PTY
-        //new_term_settings = slave_orig_term_settings;
-        //cfmakeraw (&new_term_settings);
-        //tcsetattr (fds, TCSANOW, &new_term_settings);
-
-        // The slave side of the PTY becomes the standard input and outputs of the child process
-        // we use cook mode here
-        close(0); // Close standard input (current terminal)
-        close(1); // Close standard output (current terminal)
-        close(2); // Close standard error (current terminal)
-
-        rc = dup(fds); // PTY becomes standard input (0)
-        rc = dup(fds); // PTY becomes standard output (1)
-        rc = dup(fds); // PTY becomes standard error (2)
-
-        // Now the original file descriptor is useless
-        close(fds);
-
-        // Make the current process a new session leader
-        setsid();
-
-        // As the child is a session leader, set the controlling terminal to be the slave side of the PTY
-        // (Mandatory for programs like the shell to make them manage correctly their outputs)
-        ioctl(0, TIOCSCTTY, 1);
-
-        //system("/bin/bash");
-        rc = system(cmd);
-        //M_LOG("%s\n","Terminal exit");
-        _exit(1);
+        return terminal_unknown(fd, cid);
+    }
+    proc = (vterm_proc_t *)dnode->data;
+    dnode->data = NULL;
+    detached = bst_delete(detached, hash);
+    terminal_kill(cid, 1);
+    terminal_unwait(cid);
+    proc->cid = cid;
+    proc->detached_at = 0;
+    processes = bst_insert(processes, cid, proc);
+    M_LOG(MODULE_NAME, "Client %d reattaches to the session of %s", cid, proc->user);
+    if (terminal_send_token(fd, proc) == -1)
+    {
+        return -1;
     }
+    return terminal_snapshot(fd, cid);
 }
 
-static void terminal_kill(int client_id, int should_delete)
+/**
+ * @brief Stop observing a session
+ *
+ * @return 1 if the client was an observer, 0 otherwise
+ */
+static int terminal_unobserve(int cid)
 {
-    // find the proc
-    bst_node_t *node = bst_find(processes, client_id);
+    bst_node_t *node = bst_find(observed, cid);
     vterm_proc_t *proc;
-    if (node != NULL)
+    int i;
+    if (node == NULL)
     {
-        proc = (vterm_proc_t *)node->data;
-        if (proc != NULL)
+        return 0;
+    }
+    proc = (vterm_proc_t *)node->data;
+    for (i = 0; proc && i < proc->n_observers; i++)
+    {
+        if (proc->clients[1 + i] == cid)
         {
-            (void)close(proc->fdm);
-            M_LOG(MODULE_NAME, "Kill the process %d", proc->pid);
-            if (kill(proc->pid, SIGKILL) == -1)
-            {
-                M_ERROR(MODULE_NAME, "Unable to kill process %d: %s", proc->pid, strerror(errno));
-            }
-            else
-            {
-                (void)waitpid(proc->pid, NULL, 0);
-            }
-            free(node->data);
-            if (should_delete)
-                processes = bst_delete(processes, node->key);
-            // wait child
+            proc->clients[1 + i] = proc->clients[proc->n_observers--];
+            break;
         }
     }
+    observed = bst_delete(observed, cid);
+    M_LOG(MODULE_NAME, "Client %d stops observing", cid);
+    return 1;
 }
 
-static int terminal_write(tunnel_msg_t *msg)
+static void find_token(bst_node_t *node, void **args, int argc)
 {
-    // TODO: control frame e.g. for window resize
-    bst_node_t *node = bst_find(processes, msg->header.client_id);
-    vterm_proc_t *proc;
-    if (node != NULL)
+    (void)argc;
+    const char *token = (const char *)args[0];
+    vterm_proc_t **found = (vterm_proc_t **)args[1];
+    if (node->data && EQU(((vterm_proc_t *)node->data)->token, token))
+    {
+        *found = (vterm_proc_t *)node->data;
+    }
+}
+
+/**
+ * @brief Make a client an observer of the session with the token, live or
+ * detached. A waiting client gets no session of its own, a session the
+ * client already owns is dropped. The client receives the screen snapshot
+ * then the output of the session
+ */
+static int terminal_observe(int fd, int cid, const uint8_t *token)
+{
+    char key[VT_TOKEN_SIZE + 1];
+    bst_node_t *node;
+    vterm_proc_t *proc = NULL;
+    void *args[2];
+    (void)memcpy(key, token, VT_TOKEN_SIZE);
+    key[VT_TOKEN_SIZE] = '\0';
+    node = bst_find(detached, simple_hash(key));
+    if (node && node->data && EQU(((vterm_proc_t *)node->data)->token, key))
     {
         proc = (vterm_proc_t *)node->data;
-        if (proc != NULL)
-        {
-            if (write(proc->fdm, msg->data, msg->header.size) == -1)
-            {
-                M_ERROR(MODULE_NAME, "Unable to write data to the terminal corresponding to client %d", msg->header.client_id);
-                return -1;
-            }
-        }
-        else
-        {
-            M_ERROR(MODULE_NAME, "Unable to find the process linked to client %d", msg->header.client_id);
-            return -1;
-        }
     }
     else
     {
-        M_ERROR(MODULE_NAME, "Unable to find the process from processes list for %d", msg->header.client_id);
-        return -1;
+        args[0] = (void *)key;
+        args[1] = (void *)&proc;
+        bst_for_each(processes, find_token, args, 2);
     }
-    return 0;
-}
-
-static void unsubscribe(bst_node_t *node, void **args, int argc)
-{
-    (void)argc;
-    tunnel_msg_t msg;
-    int *ufd = (int *)args[0];
-    vterm_proc_t *proc = (vterm_proc_t *)node->data;
-    if (proc != NULL)
+    if (proc == NULL || proc->cid == cid || proc->n_observers == VT_MAX_OBSERVERS)
     {
-        msg.header.type = CHANNEL_UNSUBSCRIBE;
-        msg.header.client_id = proc->cid;
-        msg.header.size = 0;
-        terminal_kill(proc->cid, 0);
-        if (msg_write(*ufd, &msg) == -1)
-        {
-            M_ERROR(MODULE_NAME, "Unable to request unsubscribe to client %d", proc->cid);
-        }
+        return terminal_unknown(fd, cid);
+    }
+    (void)terminal_unobserve(cid);
+    terminal_kill(cid, 1);
+    terminal_unwait(cid);
+    if (terminal_add_observer(proc, cid) == -1)
+    {
+        return terminal_unknown(fd, cid);
     }
+    observed = bst_insert(observed, cid, proc);
+    M_LOG(MODULE_NAME, "Client %d observes the session of %s", cid, proc->user);
+    return terminal_snapshot(fd, cid);
 }
 
-static void set_sock_fd(bst_node_t *node, void **args, int argc)
+/**
+ * @brief Unsubscribe the observers of the sessions freed since the last call
+ */
+static void terminal_release(int fd)
 {
-    (void)argc;
     tunnel_msg_t msg;
-    pid_t wpid;
-    fd_set *fd_in = (fd_set *)args[1];
-    int *max_fd = (int *)args[2];
-    list_t *list_p = (list_t *)args[3];
-    int *ufd = (int *)args[0];
-
-    vterm_proc_t *proc = (vterm_proc_t *)node->data;
-
-    if (proc != NULL)
+    item_t item;
+    msg.header.channel_id = 0;
+    msg.header.type = CHANNEL_UNSUBSCRIBE;
+    msg.header.size = 0;
+    msg.data = NULL;
+    list_for_each(item, released)
     {
-        // monitor the pid
-        wpid = waitpid(proc->pid, NULL, WNOHANG);
-        if (wpid == -1 || wpid > 0)
+        msg.header.client_id = item->value.i;
+        if (msg_write(fd, &msg) == -1)
         {
-            // child exits
-            M_LOG(MODULE_NAME, "Terminal linked to client %d exits\n", proc->cid);
-            unsubscribe(node, args, argc);
-            list_put_ptr(list_p, node);
-        }
-        else
-        {
-            FD_SET(proc->fdm, fd_in);
-            if (*max_fd < proc->fdm)
-            {
-                *max_fd = proc->fdm;
-            }
+            M_ERROR(MODULE_NAME, "Unable to request unsubscribe to client %d", item->value.i);
         }
     }
+    list_free(&released);
+    released = list_init();
 }
 
-static void terminal_monitor(bst_node_t *node, void **args, int argc)
+/**
+ * @brief Shared mode: make a client a subscriber of the command output.
+ * The first subscriber starts the command, the later ones receive the
+ * screen snapshot then the same output frames as the others
+ */
+static int terminal_share(int fd, int cid, const char *name)
 {
-    (void)argc;
-    int *ufd = (int *)args[0];
-    fd_set *fd_in = (fd_set *)args[1];
-    list_t *list = (list_t *)args[3];
-    char buff[BUFFLEN];
+    bst_node_t *node = bst_find(processes, VT_SHARED);
+    vterm_proc_t *proc = node ? (vterm_proc_t *)node->data : NULL;
+    int started = 0;
     tunnel_msg_t msg;
-    int rc;
-    vterm_proc_t *proc = (vterm_proc_t *)node->data;
-
-    if (proc != NULL && FD_ISSET(proc->fdm, fd_in))
+    if (proc == NULL)
     {
-        if ((rc = read(proc->fdm, buff, BUFFLEN)) > 0)
+        // the channel name stands for the user in the logs and recordings
+        proc = terminal_new(name);
+        if (proc == NULL)
         {
-            // Send data to client
-            msg.header.client_id = node->key;
-            msg.header.type = CHANNEL_DATA;
-            msg.header.size = rc;
-            msg.data = buff;
-            if (msg_write(*ufd, &msg) == -1)
-            {
-                terminal_kill(node->key, 0);
-                M_ERROR(MODULE_NAME, "Unable to send data to client %d", msg.header.client_id);
-                list_put_ptr(list, node);
-            }
+            M_ERROR(MODULE_NAME, "Unable to start the command for client %d", cid);
+            msg.header.channel_id = 0;
+            msg.header.client_id = cid;
+            msg.header.type = CHANNEL_UNSUBSCRIBE;
+            msg.header.size = 0;
+            msg.data = NULL;
+            return msg_write(fd, &msg);
+        }
+        proc->cid = -1;
+        if (node)
+        {
+            node->data = proc;
         }
         else
         {
-            if (rc < 0)
-            {
-                M_LOG(MODULE_NAME, "Error on read standard input: %s\n", strerror(errno));
-                terminal_kill(node->key, 0);
-                list_put_ptr(list, node);
-            }
+            processes = bst_insert(processes, VT_SHARED, proc);
         }
+        terminal_resize(VT_SHARED, shared_cols, shared_rows);
+        M_LOG(MODULE_NAME, "Command started for client %d: %s", cid, command);
+        started = 1;
+    }
+    if (terminal_add_observer(proc, cid) == -1)
+    {
+        return terminal_unknown(fd, cid);
     }
+    observed = bst_insert(observed, cid, proc);
+    return started ? 0 : terminal_snapshot(fd, cid);
 }
 
-static void terminal_resize(int cid, int col, int row)
+/**
+ * @brief Shared mode: stop the command once its last subscriber is gone
+ */
+static void terminal_unshare()
 {
-    struct winsize win = {0, 0, 0, 0};
-    bst_node_t *node = bst_find(processes, cid);
-    vterm_proc_t *proc;
-    if (node != NULL)
-    {
-        proc = (vterm_proc_t *)node->data;
-        if (ioctl(proc->fdm, TIOCGWINSZ, &win) != 0)
-        {
-            if (errno != EINVAL)
-            {
-                M_ERROR(MODULE_NAME, "Unable to get terminal winsize setting: %s", strerror(errno));
-                return;
-            }
-            memset(&win, 0, sizeof(win));
-        }
-        //printf("Setting winsize\n");
-        if (row >= 0)
-            win.ws_row = (unsigned short)row;
-        if (col >= 0)
-            win.ws_col = (unsigned short)col;
-
-        if (ioctl(proc->fdm, TIOCSWINSZ, (char *)&win) != 0)
-            M_ERROR(MODULE_NAME, "Unable to set terminal window size process linked to client %d: %s", cid, strerror(errno));
-    }
-    else
+    bst_node_t *node = bst_find(processes, VT_SHARED);
+    if (node && node->data && ((vterm_proc_t *)node->data)->n_observers == 0)
     {
-        M_ERROR(MODULE_NAME, "Unable to find the terminal process linked to client %d", cid);
+        M_LOG(MODULE_NAME, "No more subscriber, stop the command");
+        terminal_kill(VT_SHARED, 1);
     }
 }
 
@@ -316,24 +1591,91 @@ int main(int argc, char **argv)
 {
     int fd;
     tunnel_msg_t msg;
-    fd_set fd_in;
+    fd_set fd_in, fd_out;
     int status, maxfd;
     struct timeval timeout;
     char buff[MAX_CHANNEL_NAME + 1];
-    void *args[4];
+    void *args[7];
+    unsigned long long now, deadline;
+    int pending;
     list_t list;
     item_t item;
     int ncol, nrow;
+    char user[VT_MAX_USER];
+    const char *channel = MODULE_NAME;
 
     LOG_INIT(MODULE_NAME);
-    if (argc != 2)
+    if (argc != 2 && argc != 4)
     {
-        printf("Usage: %s path/to/hotline/socket\n", argv[0]);
+        printf("Usage: %s path/to/hotline/socket [channel command]\n", argv[0]);
         return -1;
     }
+    if (argc == 4)
+    {
+        channel = argv[2];
+        command = argv[3];
+    }
     signal(SIGPIPE, SIG_IGN);
     signal(SIGABRT, SIG_IGN);
     signal(SIGINT, int_handler);
+    if (getenv("flush_size") != NULL && atoi(getenv("flush_size")) > 0)
+    {
+        flush_size = atoi(getenv("flush_size"));
+    }
+    if (getenv("flush_delay") != NULL)
+    {
+        flush_delay = (unsigned long long)atoi(getenv("flush_delay"));
+    }
+    if (getenv("queue_size") != NULL && atoi(getenv("queue_size")) > 0)
+    {
+        queue_size = atoi(getenv("queue_size"));
+    }
+    if (queue_size < flush_size)
+    {
+        queue_size = flush_size;
+    }
+    if (getenv("budget") != NULL && atoi(getenv("budget")) > 0)
+    {
+        budget = atoi(getenv("budget"));
+    }
+    if (getenv("scrollback") != NULL)
+    {
+        scrollback = atoi(getenv("scrollback"));
+    }
+    if (getenv("grace_period") != NULL)
+    {
+        grace_period = (unsigned long long)atoi(getenv("grace_period")) * 1000u;
+    }
+    if (getenv("cols") != NULL && atoi(getenv("cols")) > 0)
+    {
+        shared_cols = atoi(getenv("cols"));
+    }
+    if (getenv("rows") != NULL && atoi(getenv("rows")) > 0)
+    {
+        shared_rows = atoi(getenv("rows"));
+    }
+    // a pooled helper would wait for a user
+    if (command == NULL && getenv("pool_size") != NULL && atoi(getenv("pool_size")) > 0)
+    {
+        pool_size = atoi(getenv("pool_size"));
+        if (pool_size > VT_MAX_POOL)
+        {
+            pool_size = VT_MAX_POOL;
+        }
+    }
+    if (terminal_watch_init() == -1)
+    {
+        return -1;
+    }
+    if (getenv("record_dir") != NULL && strlen(getenv("record_dir")) > 0)
+    {
+        if (record_init(getenv("record_dir"),
+                        getenv("record_buffer") ? atoi(getenv("record_buffer")) : RECORD_DEFAULT_BUFFER,
+                        getenv("record_sync") ? atoi(getenv("record_sync")) : RECORD_DEFAULT_SYNC) == -1)
+        {
+            return -1;
+        }
+    }
     M_LOG(MODULE_NAME, "Hotline is: %s", argv[1]);
     // now try to request new channel from hotline
     fd = open_socket(argv[1]);
@@ -342,11 +1684,13 @@ int main(int argc, char **argv)
         M_ERROR(MODULE_NAME, "Unable to open the hotline: %s", argv[1]);
         return -1;
     }
+    // not inherited by the login programs
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
     msg.header.type = CHANNEL_OPEN;
     msg.header.channel_id = 0;
     msg.header.client_id = 0;
-    M_LOG(MODULE_NAME, "Request to open the channel %s", MODULE_NAME);
-    (void)strncpy(buff, MODULE_NAME, MAX_CHANNEL_NAME);
+    M_LOG(MODULE_NAME, "Request to open the channel %s", channel);
+    (void)snprintf(buff, sizeof(buff), "%s", channel);
     msg.header.size = strlen(buff);
     msg.data = (uint8_t *)buff;
     if (msg_write(fd, &msg) == -1)
@@ -355,7 +1699,7 @@ int main(int argc, char **argv)
         (void)close(fd);
         return -1;
     }
-    M_LOG(MODULE_NAME, "Wait for comfirm creation of %s", MODULE_NAME);
+    M_LOG(MODULE_NAME, "Wait for comfirm creation of %s", channel);
     // now wait for message
     if (msg_read(fd, &msg) == -1)
     {
@@ -365,40 +1709,73 @@ int main(int argc, char **argv)
     }
     if (msg.header.type == CHANNEL_OK)
     {
-        M_LOG(MODULE_NAME, "Channel created: %s", MODULE_NAME);
+        M_LOG(MODULE_NAME, "Channel created: %s", channel);
         if (msg.data)
             free(msg.data);
     }
     else
     {
-        M_ERROR(MODULE_NAME, "Channel is not created: %s. Tunnel service responds with msg of type %d", MODULE_NAME, msg.header.type);
+        M_ERROR(MODULE_NAME, "Channel is not created: %s. Tunnel service responds with msg of type %d", channel, msg.header.type);
         if (msg.data)
             free(msg.data);
         running = 0;
     }
 
     // now read data
+    released = list_init();
     while (running)
     {
+        terminal_release(fd);
+        terminal_pool_fill();
         FD_ZERO(&fd_in);
+        FD_ZERO(&fd_out);
         FD_SET(fd, &fd_in);
         maxfd = fd;
+        if (sigchld_fd != -1)
+        {
+            FD_SET(sigchld_fd, &fd_in);
+            maxfd = sigchld_fd > maxfd ? sigchld_fd : maxfd;
+        }
 
-        // monitor processes
         list = list_init();
         args[1] = (void *)&fd_in;
         args[2] = (void *)&maxfd;
         args[3] = (void *)&list;
         args[0] = (void *)&fd;
-        bst_for_each(processes, set_sock_fd, args, 4);
+        now = now_ms();
+        deadline = 0;
+        args[4] = (void *)&now;
+        args[5] = (void *)&deadline;
+        args[6] = (void *)&fd_out;
+        // the clients that did not attach get their own session
+        bst_for_each(waiting, set_waiting_deadline, args, 7);
+        list_for_each(item, list)
+        {
+            if (terminal_start(fd, item->value.i) == -1)
+            {
+                M_ERROR(MODULE_NAME, "Unable to send session token to client %d", item->value.i);
+            }
+        }
+        list_free(&list);
+        // monitor processes
+        list = list_init();
+        bst_for_each(processes, set_sock_fd, args, 7);
         list_for_each(item, list)
         {
-            processes = bst_delete(processes, ((bst_node_t *)(item->value.ptr))->key);
-            item->value.ptr = NULL;
+            processes = bst_delete(processes, item->value.i);
         }
         list_free(&list);
+        // monitor detached sessions
+        list = list_init();
+        bst_for_each(detached, set_detached_fd, args, 7);
+        terminal_expire(&list);
+        pending = deadline != 0;
 
-        status = select(maxfd + 1, &fd_in, NULL, NULL, NULL);
+        // wake up for the next pending output flush
+        deadline = deadline > now ? deadline - now : 0;
+        timeout.tv_sec = deadline / 1000;
+        timeout.tv_usec = (deadline % 1000) * 1000;
+        status = select(maxfd + 1, &fd_in, &fd_out, NULL, pending ? &timeout : NULL);
 
         switch (status)
         {
@@ -419,16 +1796,31 @@ int main(int argc, char **argv)
                 }
                 else
                 {
+                    // any other message than an attach or observe request starts the session of a waiting client
+                    if ((msg.header.type == CHANNEL_DATA || msg.header.type == CHANNEL_CTRL) &&
+                        !(msg.header.type == CHANNEL_CTRL && msg.header.size == VT_TOKEN_SIZE + 1 &&
+                          (msg.data[0] == VT_CTRL_ATTACH || msg.data[0] == VT_CTRL_OBSERVE)) &&
+                        terminal_start(fd, msg.header.client_id) == -1)
+                    {
+                        M_ERROR(MODULE_NAME, "Unable to send session token to client %d", msg.header.client_id);
+                    }
                     switch (msg.header.type)
                     {
                     case CHANNEL_SUBSCRIBE:
-                        M_LOG(MODULE_NAME, "Client %d subscribes to the chanel with user [%s]", msg.header.client_id, msg.data);
-                        // create new process
-                        vterm_proc_t *proc = terminal_new(msg.data);
-                        if (proc == NULL)
+                        // the user name is not NUL terminated
+                        (void)snprintf(user, sizeof(user), "%.*s", (int)msg.header.size, msg.data ? (char *)msg.data : "");
+                        M_LOG(MODULE_NAME, "Client %d subscribes to the chanel with user [%s]", msg.header.client_id, user);
+                        if (command)
+                        {
+                            if (terminal_share(fd, msg.header.client_id, channel) == -1)
+                            {
+                                M_ERROR(MODULE_NAME, "Unable to share the command output with client %d", msg.header.client_id);
+                            }
+                            break;
+                        }
+                        // the session starts unless the client attaches to another one first
+                        if (terminal_wait(msg.header.client_id, user) == -1)
                         {
-                            M_ERROR(MODULE_NAME, "Unable to create new terminal for client %d", msg.header.client_id);
-                            // unsubscribe client
                             msg.header.type = CHANNEL_UNSUBSCRIBE;
                             msg.header.size = 0;
                             if (msg_write(fd, &msg) == -1)
@@ -436,21 +1828,27 @@ int main(int argc, char **argv)
                                 M_LOG(MODULE_NAME, "Unable to request unsubscribe client %d", msg.header.client_id);
                             }
                         }
-                        else
-                        {
-                            proc->cid = msg.header.client_id;
-                            // insert new terminal to the list
-                            processes = bst_insert(processes, msg.header.client_id, proc);
-                        }
                         break;
 
                     case CHANNEL_UNSUBSCRIBE:
                         M_LOG(MODULE_NAME, "Client %d unsubscribes to the chanel", msg.header.client_id);
-                        terminal_kill(msg.header.client_id, 1);
+                        terminal_unwait(msg.header.client_id);
+                        if (terminal_unobserve(msg.header.client_id) == 0)
+                        {
+                            terminal_detach(fd, msg.header.client_id);
+                        }
+                        else if (command)
+                        {
+                            terminal_unshare();
+                        }
                         break;
 
                     case CHANNEL_CTRL:
-                        if (msg.header.size == 8)
+                        if (bst_find(observed, msg.header.client_id) != NULL && !(msg.header.size == 1 && msg.data[0] == VT_CTRL_SNAPSHOT))
+                        {
+                            M_LOG(MODULE_NAME, "Ignore control message of observer %d", msg.header.client_id);
+                        }
+                        else if (msg.header.size == 8)
                         {
                             (void)memcpy(&ncol, msg.data, sizeof(ncol));
                             (void)memcpy(&nrow, msg.data + sizeof(ncol), sizeof(nrow));
@@ -459,6 +1857,27 @@ int main(int argc, char **argv)
                             M_LOG(MODULE_NAME, "Client %d request terminal window resize of (%d,%d)", msg.header.client_id, ncol, nrow);
                             terminal_resize(msg.header.client_id, ncol, nrow);
                         }
+                        else if (msg.header.size == VT_TOKEN_SIZE + 1 && msg.data[0] == VT_CTRL_ATTACH)
+                        {
+                            if (terminal_attach(fd, msg.header.client_id, msg.data + 1) == -1)
+                            {
+                                M_ERROR(MODULE_NAME, "Unable to reattach client %d", msg.header.client_id);
+                            }
+                        }
+                        else if (msg.header.size == VT_TOKEN_SIZE + 1 && msg.data[0] == VT_CTRL_OBSERVE)
+                        {
+                            if (terminal_observe(fd, msg.header.client_id, msg.data + 1) == -1)
+                            {
+                                M_ERROR(MODULE_NAME, "Unable to make client %d an observer", msg.header.client_id);
+                            }
+                        }
+                        else if (msg.header.size == 1 && msg.data[0] == VT_CTRL_SNAPSHOT)
+                        {
+                            if (terminal_snapshot(fd, msg.header.client_id) == -1)
+                            {
+                                M_ERROR(MODULE_NAME, "Unable to send screen snapshot to client %d", msg.header.client_id);
+                            }
+                        }
                         else
                         {
                             M_ERROR(MODULE_NAME, "Invalid control message size: %d from client %d, expected 8", msg.header.size, msg.header.client_id);
@@ -467,6 +1886,11 @@ int main(int argc, char **argv)
                         break;
 
                     case CHANNEL_DATA:
+                        // observers are read-only
+                        if (bst_find(observed, msg.header.client_id) != NULL)
+                        {
+                            break;
+                        }
                         if (terminal_write(&msg) == -1)
                         {
                             M_ERROR(MODULE_NAME, "Unable to write data to terminal corresponding to client %d", msg.header.client_id);
@@ -494,18 +1918,20 @@ int main(int argc, char **argv)
             else
             {
                 // on the processes side
+                if (sigchld_fd != -1 && FD_ISSET(sigchld_fd, &fd_in))
+                {
+                    terminal_reap();
+                }
                 list = list_init();
-                bst_for_each(processes, terminal_monitor, args, 4);
+                bst_for_each(processes, terminal_monitor, args, 7);
                 list_for_each(item, list)
                 {
-                    processes = bst_delete(processes, ((bst_node_t *)(item->value.ptr))->key);
-                    if (((bst_node_t *)(item->value.ptr))->data)
-                    {
-                        free(((bst_node_t *)(item->value.ptr))->data);
-                    }
-                    item->value.ptr = NULL;
+                    processes = bst_delete(processes, item->value.i);
                 }
                 list_free(&list);
+                list = list_init();
+                bst_for_each(detached, detached_monitor, args, 7);
+                terminal_expire(&list);
             }
         }
     }
@@ -514,8 +1940,21 @@ int main(int argc, char **argv)
     args[0] = (void *)&fd;
     bst_for_each(processes, unsubscribe, args, 1);
     (void)bst_free(processes);
+    bst_for_each(detached, free_detached, NULL, 0);
+    bst_free(detached);
+    bst_for_each(waiting, free_waiting, NULL, 0);
+    bst_free(waiting);
+    terminal_release(fd);
+    list_free(&released);
+    bst_free(observed);
+    terminal_pool_free();
+    record_close();
+    if (sigchld_fd != -1)
+    {
+        (void)close(sigchld_fd);
+    }
     // close the channel
-    M_LOG(MODULE_NAME, "Close the channel %s (%d)", MODULE_NAME, fd);
+    M_LOG(MODULE_NAME, "Close the channel %s (%d)", channel, fd);
     msg.header.type = CHANNEL_CLOSE;
     msg.header.size = 0;
     msg.data = NULL;
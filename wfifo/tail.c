@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <antd/list.h>
+#include <antd/bst.h>
+#include <antd/utils.h>
+
+#include "../tunnel.h"
+#include "tail.h"
+
+#define MODULE_NAME "wfifo"
+
+#define TAIL_EVENT_BUFF (64 * (sizeof(struct inotify_event) + 256))
+#define TAIL_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define TAIL_DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+typedef struct
+{
+    char path[BUFFLEN];
+    char name[BUFFLEN];
+    int ifd;
+    int wd_dir;
+    int wd_file;
+} tail_t;
+
+/**
+ * @brief Position of a client catching up
+ */
+typedef struct
+{
+    off_t offset;
+} tail_cursor_t;
+
+/**
+ * @brief State of a catch up step shared by the cursors
+ */
+typedef struct
+{
+    int fd;
+    int ffd;
+    off_t end;
+    int frame;
+    int budget;
+    tail_sender_t sender;
+    list_t *done;
+    int status;
+} tail_seek_t;
+
+static tail_t tail = {.ifd = -1, .wd_dir = -1, .wd_file = -1};
+static bst_node_t *cursors = NULL;
+static int tail_pipe[2] = {-1, -1};
+static uint8_t *send_buffer = NULL;
+static int send_capacity = 0;
+
+int tail_init(const char *path)
+{
+    char buff[BUFFLEN];
+    (void)snprintf(tail.path, sizeof(tail.path), "%s", path);
+    (void)snprintf(buff, sizeof(buff), "%s", path);
+    (void)snprintf(tail.name, sizeof(tail.name), "%s", basename(buff));
+    (void)snprintf(buff, sizeof(buff), "%s", path);
+    tail.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (tail.ifd == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to init inotify: %s", strerror(errno));
+        return -1;
+    }
+    tail.wd_dir = inotify_add_watch(tail.ifd, dirname(buff), TAIL_DIR_EVENTS);
+    if (tail.wd_dir == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to watch the directory of %s: %s", path, strerror(errno));
+        (void)close(tail.ifd);
+        tail.ifd = -1;
+        return -1;
+    }
+    return tail.ifd;
+}
+
+int tail_open(void)
+{
+    int ffd;
+    struct stat st;
+    ffd = open(tail.path, O_RDONLY | O_CLOEXEC);
+    if (ffd == -1)
+    {
+        if (errno != ENOENT)
+        {
+            M_ERROR(MODULE_NAME, "Unable to open %s: %s", tail.path, strerror(errno));
+        }
+        return -1;
+    }
+    if (fstat(ffd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        M_ERROR(MODULE_NAME, "%s is not a regular file", tail.path);
+        (void)close(ffd);
+        return -1;
+    }
+    if (tail.wd_file != -1)
+    {
+        (void)inotify_rm_watch(tail.ifd, tail.wd_file);
+    }
+    // the watch follows the inode, not the name
+    tail.wd_file = inotify_add_watch(tail.ifd, tail.path, TAIL_FILE_EVENTS);
+    if (tail.wd_file == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to watch %s: %s", tail.path, strerror(errno));
+    }
+    M_LOG(MODULE_NAME, "Tail %s (%d)", tail.path, ffd);
+    return ffd;
+}
+
+int tail_events(void)
+{
+    char buff[TAIL_EVENT_BUFF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t size;
+    char *ptr;
+    int count = 0;
+    while ((size = read(tail.ifd, buff, sizeof(buff))) > 0)
+    {
+        for (ptr = buff; ptr < buff + size; ptr += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event *)ptr;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                count++;
+            }
+            else if (event->wd == tail.wd_file)
+            {
+                if (event->mask & IN_IGNORED)
+                {
+                    tail.wd_file = -1;
+                }
+                count++;
+            }
+            else if (event->wd == tail.wd_dir && event->len > 0 && EQU(event->name, tail.name))
+            {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+int tail_check(int ffd, off_t pos)
+{
+    struct stat fst, st;
+    if (fstat(ffd, &fst) == -1)
+    {
+        return TAIL_ROTATED;
+    }
+    // the old file is kept while no new file exists
+    if (stat(tail.path, &st) == 0 && (st.st_ino != fst.st_ino || st.st_dev != fst.st_dev))
+    {
+        return TAIL_ROTATED;
+    }
+    if (fst.st_size < pos)
+    {
+        return TAIL_TRUNCATED;
+    }
+    return 0;
+}
+
+static void free_cursors(bst_node_t *node, void **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    if (node->data)
+    {
+        free(node->data);
+        node->data = NULL;
+    }
+}
+
+void tail_close(void)
+{
+    if (tail.ifd != -1)
+    {
+        (void)close(tail.ifd);
+        tail.ifd = -1;
+    }
+    if (tail_pipe[0] != -1)
+    {
+        (void)close(tail_pipe[0]);
+        (void)close(tail_pipe[1]);
+        tail_pipe[0] = tail_pipe[1] = -1;
+    }
+    if (send_buffer)
+    {
+        free(send_buffer);
+        send_buffer = NULL;
+        send_capacity = 0;
+    }
+    bst_for_each(cursors, free_cursors, NULL, 0);
+    bst_free(cursors);
+    cursors = NULL;
+}
+
+/**
+ * @brief Move size bytes of the file at offset into the tail pipe, the
+ * pages are referenced rather than copied
+ *
+ * @return 0 once the pipe holds the size bytes, 1 if the file is shorter
+ * than offset + size, -1 if the pipe cannot be used
+ */
+static int tail_fill(int ffd, off_t offset, int size)
+{
+    char buff[BUFFLEN];
+    ssize_t status = 0;
+    int filled = 0;
+    if (tail_pipe[0] == -1 && pipe2(tail_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to create the tail pipe: %s", strerror(errno));
+        return -1;
+    }
+    // an unaligned frame spans two more pages than its size
+    if (fcntl(tail_pipe[1], F_GETPIPE_SZ) < size + 2 * getpagesize() &&
+        fcntl(tail_pipe[1], F_SETPIPE_SZ, size + 2 * getpagesize()) == -1)
+    {
+        return -1;
+    }
+    while (filled < size)
+    {
+        status = splice(ffd, &offset, tail_pipe[1], NULL, size - filled, SPLICE_F_NONBLOCK);
+        if (status == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (status <= 0)
+        {
+            break;
+        }
+        filled += status;
+    }
+    if (filled == size)
+    {
+        return 0;
+    }
+    // nothing is sent yet, drop what was moved into the pipe
+    while (filled > 0)
+    {
+        ssize_t len = read(tail_pipe[0], buff, filled > (int)sizeof(buff) ? (int)sizeof(buff) : filled);
+        if (len <= 0)
+        {
+            break;
+        }
+        filled -= len;
+    }
+    return status == 0 ? 1 : -1;
+}
+
+/**
+ * @brief Read size bytes of the file at offset into the send buffer
+ *
+ * @return 0 once the buffer holds the size bytes, 1 if the file is shorter
+ */
+static int tail_read(int ffd, off_t offset, int size)
+{
+    ssize_t status;
+    int got = 0;
+    uint8_t *buffer;
+    if (send_capacity < size)
+    {
+        buffer = (uint8_t *)realloc(send_buffer, size);
+        if (buffer == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate %d bytes send buffer: %s", size, strerror(errno));
+            return 1;
+        }
+        send_buffer = buffer;
+        send_capacity = size;
+    }
+    while (got < size)
+    {
+        status = pread(ffd, send_buffer + got, size - got, offset + got);
+        if (status == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (status == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to read %s: %s", tail.path, strerror(errno));
+        }
+        if (status <= 0)
+        {
+            return 1;
+        }
+        got += status;
+    }
+    return 0;
+}
+
+int tail_send(int fd, uint16_t client_id, int ffd, off_t offset, int size, int zero_copy)
+{
+    tunnel_msg_t msg;
+    char buff[BUFFLEN];
+    ssize_t status;
+    int fill = -1;
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.client_id = client_id;
+    msg.header.size = size;
+    // the whole frame is taken from the file before its header is sent, a
+    // truncation meanwhile then only skips the frame
+    if (zero_copy)
+    {
+        fill = tail_fill(ffd, offset, size);
+    }
+    if (fill == -1)
+    {
+        if (tail_read(ffd, offset, size) != 0)
+        {
+            return TAIL_SHORT;
+        }
+        msg.data = send_buffer;
+        if (msg_write(fd, &msg) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to send %s to client %d", tail.path, client_id);
+            return -1;
+        }
+        return 0;
+    }
+    if (fill == 1)
+    {
+        return TAIL_SHORT;
+    }
+    if (msg_write_header(fd, &msg) == -1)
+    {
+        return -1;
+    }
+    while (size > 0)
+    {
+        status = splice(tail_pipe[0], NULL, fd, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (status == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            status = read(tail_pipe[0], buff, size > (int)sizeof(buff) ? (int)sizeof(buff) : size);
+            if (status > 0 && write(fd, buff, status) != status)
+            {
+                status = -1;
+            }
+        }
+        if (status == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (status <= 0)
+        {
+            M_ERROR(MODULE_NAME, "Unable to send %s to client %d: %s", tail.path, client_id, strerror(errno));
+            return -1;
+        }
+        size -= status;
+    }
+    return msg_write_end(fd);
+}
+
+off_t tail_seek(uint16_t client_id, uint8_t whence, uint64_t value, off_t end)
+{
+    bst_node_t *node = bst_find(cursors, client_id);
+    tail_cursor_t *cursor;
+    off_t offset;
+    if (whence == TAIL_SEEK_LAST)
+    {
+        offset = value > (uint64_t)end ? 0 : end - (off_t)value;
+    }
+    else
+    {
+        offset = value > (uint64_t)end ? end : (off_t)value;
+    }
+    if (node && node->data)
+    {
+        cursor = (tail_cursor_t *)node->data;
+    }
+    else
+    {
+        cursor = (tail_cursor_t *)malloc(sizeof(tail_cursor_t));
+        if (cursor == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate cursor of client %d: %s", client_id, strerror(errno));
+            return -1;
+        }
+        cursors = bst_insert(cursors, client_id, cursor);
+    }
+    cursor->offset = offset;
+    return offset;
+}
+
+void tail_seek_cancel(uint16_t client_id)
+{
+    bst_node_t *node = bst_find(cursors, client_id);
+    if (node)
+    {
+        free_cursors(node, NULL, 0);
+        cursors = bst_delete(cursors, client_id);
+    }
+}
+
+static void reset_cursors(bst_node_t *node, void **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    if (node->data)
+    {
+        ((tail_cursor_t *)node->data)->offset = 0;
+    }
+}
+
+void tail_seek_reset(void)
+{
+    bst_for_each(cursors, reset_cursors, NULL, 0);
+}
+
+static void seek_step(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    tail_seek_t *seek = (tail_seek_t *)argv[0];
+    tail_cursor_t *cursor = (tail_cursor_t *)node->data;
+    int sent = 0;
+    int size;
+    int n;
+    if (cursor == NULL || seek->status == -1)
+    {
+        return;
+    }
+    while (cursor->offset < seek->end && sent < seek->budget)
+    {
+        size = seek->end - cursor->offset > seek->frame ? seek->frame : (int)(seek->end - cursor->offset);
+        n = seek->sender(seek->fd, node->key, seek->ffd, cursor->offset, size);
+        if (n == -1)
+        {
+            seek->status = -1;
+            return;
+        }
+        if (n == 0)
+        {
+            // a truncated file or a record cut by the live position, the
+            // client goes on with the live data
+            cursor->offset = seek->end;
+            break;
+        }
+        cursor->offset += n;
+        sent += n;
+    }
+    if (cursor->offset >= seek->end)
+    {
+        list_put_i(seek->done, node->key);
+    }
+}
+
+int tail_seek_step(int fd, int ffd, off_t end, int frame, int budget, tail_sender_t sender, list_t *done)
+{
+    item_t item;
+    tail_seek_t seek;
+    void *argv[1];
+    if (cursors == NULL)
+    {
+        return 0;
+    }
+    seek.fd = fd;
+    seek.ffd = ffd;
+    seek.end = end;
+    seek.frame = frame;
+    seek.budget = budget;
+    seek.sender = sender;
+    seek.done = done;
+    seek.status = 0;
+    argv[0] = (void *)&seek;
+    bst_for_each(cursors, seek_step, argv, 1);
+    if (seek.status == -1)
+    {
+        return -1;
+    }
+    list_for_each(item, *done)
+    {
+        tail_seek_cancel(item->value.i);
+    }
+    return cursors != NULL;
+}
@@ -0,0 +1,91 @@
+#ifndef TAIL_H
+#define TAIL_H
+#include <stdint.h>
+#include <sys/types.h>
+#include <antd/list.h>
+
+/** CTRL code of the seek request and of its reply */
+#define TAIL_CTRL_SEEK 0x01
+/** seek from an absolute offset or to the last N bytes */
+#define TAIL_SEEK_OFFSET 0
+#define TAIL_SEEK_LAST 1
+
+/** state changes of the tailed file reported by tail_check() */
+#define TAIL_TRUNCATED 0x01
+#define TAIL_ROTATED 0x02
+
+/**
+ * @brief Watch a regular file with inotify: the file itself for appended
+ * data and its directory for the creation of a new file with the same name
+ *
+ * @return the inotify descriptor to wait on, -1 on error
+ */
+int tail_init(const char *path);
+/**
+ * @brief (Re)open the file at path and move the file watch to it
+ *
+ * @return file descriptor, -1 if the file does not exist
+ */
+int tail_open(void);
+/**
+ * @brief Consume the pending inotify events
+ *
+ * @return number of events concerning the tailed file
+ */
+int tail_events(void);
+/**
+ * @brief Compare the open file with the file at path
+ *
+ * @param ffd open file
+ * @param pos position up to which data was forwarded
+ * @return TAIL_TRUNCATED, TAIL_ROTATED or 0
+ */
+int tail_check(int ffd, off_t pos);
+void tail_close(void);
+
+/** tail_send() result when the file is shorter than offset + size */
+#define TAIL_SHORT 1
+
+/**
+ * @brief Send size bytes of the file at offset to a client in one frame,
+ * spliced through a pipe unless zero_copy is 0
+ *
+ * The data is taken from the file before the frame header is written, so
+ * a file truncated meanwhile never yields a partial frame
+ *
+ * @return 0 when sent, TAIL_SHORT when nothing was sent, -1 on hotline error
+ */
+int tail_send(int fd, uint16_t client_id, int ffd, off_t offset, int size, int zero_copy);
+
+/**
+ * @brief Send at most size bytes of the file at offset to a catching up
+ * client, in the framing of the live data
+ *
+ * @return number of bytes of the file consumed, 0 if none can be, -1 on
+ * hotline error
+ */
+typedef int (*tail_sender_t)(int fd, uint16_t client_id, int ffd, off_t offset, int size);
+
+/**
+ * @brief Register a client catching up from an offset (TAIL_SEEK_OFFSET)
+ * or from the last value bytes (TAIL_SEEK_LAST) of the file
+ *
+ * @param end current live position
+ * @return start offset of the catch-up
+ */
+off_t tail_seek(uint16_t client_id, uint8_t whence, uint64_t value, off_t end);
+void tail_seek_cancel(uint16_t client_id);
+/**
+ * @brief Restart all catch-ups from the beginning of a new or truncated file
+ */
+void tail_seek_reset(void);
+/**
+ * @brief Send at most budget bytes to each catching up client with sender,
+ * the ids of the clients that reached the live position end are put in
+ * done. A client whose data cannot be consumed any further is also done.
+ *
+ * @return non zero if clients are still catching up, -1 on hotline error
+ */
+int tail_seek_step(int fd, int ffd, off_t end, int frame, int budget, tail_sender_t sender, list_t *done);
+
+#endif
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
@@ -17,11 +19,105 @@
 #include <antd/utils.h>
 
 #include "../tunnel.h"
+#include "tail.h"
 
 #define MODULE_NAME "wfifo"
 
+/**
+ * @brief A FIFO and the ids of its subscribed clients
+ *
+ */
+typedef struct
+{
+    int fd;
+    int hash;
+    uint16_t *subscribers;
+    int n_subscribers;
+    int capacity;
+    /** partial record in framed mode */
+    uint8_t *buffer;
+    int size;
+    int skip;
+    /** pending output in write mode */
+    uint8_t *queue;
+    int queue_head;
+    int queued;
+    /** per-user FIFO without subscriber since this time (ms), 0 if in use */
+    unsigned long long idle_since;
+} wfifo_handle_t;
+
+/**
+ * @brief Reverse map entry of a client: its FIFO handle and
+ * its position in the handle subscriber list
+ */
+typedef struct
+{
+    wfifo_handle_t *handle;
+    int index;
+} wfifo_client_t;
+
+#define MAX_USER_NAME 64
+
+/**
+ * @brief Cached uid of a user name
+ */
+typedef struct
+{
+    char name[MAX_USER_NAME];
+    uid_t uid;
+} wfifo_user_t;
+
 static bst_node_t *clients = NULL;
 static bst_node_t *fifo_handles = NULL;
+static bst_node_t *users = NULL;
+
+/** forward FIFO data to the hotline with splice()/tee() */
+static int zero_copy = 1;
+static int tee_pipe[2] = {-1, -1};
+
+#define DEFAULT_PIPE_SIZE (1024 * 1024)
+#define DEFAULT_READ_BUDGET (1024 * 1024)
+#define DEFAULT_MAX_FRAME (64 * 1024)
+
+/** capacity requested for each FIFO */
+static int pipe_size = DEFAULT_PIPE_SIZE;
+/** max bytes forwarded from a FIFO per select() wakeup */
+static int read_budget = DEFAULT_READ_BUDGET;
+/** consecutive reads are coalesced up to this frame size */
+static int max_frame = DEFAULT_MAX_FRAME;
+static uint8_t *frame_buffer = NULL;
+static char fifo_mode = 'r';
+
+#define FRAMING_RAW 0
+#define FRAMING_LINE 1
+#define FRAMING_LENGTH 2
+
+/** record boundary of the FIFO data: raw, line or length */
+static int framing = FRAMING_RAW;
+/** send several complete records per frame */
+static int batch = 0;
+
+#define DEFAULT_QUEUE_SIZE (1024 * 1024)
+#define OVERFLOW_DROP 0
+#define OVERFLOW_ERROR 1
+
+/** max bytes queued per FIFO in write mode */
+static int queue_size = DEFAULT_QUEUE_SIZE;
+/** data of a client overflowing the queue is dropped or reported */
+static int overflow = OVERFLOW_ERROR;
+
+#define DEFAULT_IDLE_TIMEOUT 60
+
+/** per-user FIFOs without subscriber are closed after this delay (ms) */
+static unsigned long long idle_timeout = DEFAULT_IDLE_TIMEOUT * 1000u;
+static int n_idle = 0;
+/** the FIFO opened at startup is never closed when idle */
+static int generic_hash = 0;
+
+/** tail mode: inotify descriptor and handle of the regular file */
+static int tail_fd = -1;
+static wfifo_handle_t *tail_handle = NULL;
+static const char *tail_path = NULL;
 
 static volatile int running = 1;
 
@@ -30,23 +126,447 @@ static void int_handler(int dummy)
     (void)dummy;
     running = 0;
 }
-static void send_data(bst_node_t *node, void **argv, int argc)
+
+static unsigned long long now_ms()
 {
-    (void)argc;
-    tunnel_msg_t *msg = (tunnel_msg_t *)argv[2];
-    int *fd = (int *)argv[0];
-    int *ffd = (int*)argv[1];
-    if(!node || !node->data || (int)node->data != *ffd)
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000u + ts.tv_nsec / 1000000u;
+}
+static int fifo_subscribe(wfifo_handle_t *handle, uint16_t cid)
+{
+    wfifo_client_t *client;
+    uint16_t *subscribers;
+    if (handle->n_subscribers == handle->capacity)
+    {
+        subscribers = (uint16_t *)realloc(handle->subscribers, (handle->capacity + 8) * 2 * sizeof(uint16_t));
+        if (subscribers == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to extend subscriber list of FIFO %d: %s", handle->fd, strerror(errno));
+            return -1;
+        }
+        handle->subscribers = subscribers;
+        handle->capacity = (handle->capacity + 8) * 2;
+    }
+    client = (wfifo_client_t *)malloc(sizeof(wfifo_client_t));
+    if (client == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate client %d: %s", cid, strerror(errno));
+        return -1;
+    }
+    if (handle->idle_since)
+    {
+        handle->idle_since = 0;
+        n_idle--;
+    }
+    client->handle = handle;
+    client->index = handle->n_subscribers;
+    handle->subscribers[handle->n_subscribers] = cid;
+    handle->n_subscribers++;
+    clients = bst_insert(clients, cid, client);
+    return 0;
+}
+
+static void fifo_unsubscribe(uint16_t cid)
+{
+    bst_node_t *node = bst_find(clients, cid);
+    wfifo_client_t *client;
+    wfifo_handle_t *handle;
+    if (!node || !node->data)
     {
         return;
     }
+    client = (wfifo_client_t *)node->data;
+    handle = client->handle;
+    // move the last subscriber to the freed slot
+    handle->n_subscribers--;
+    if (client->index != handle->n_subscribers)
+    {
+        handle->subscribers[client->index] = handle->subscribers[handle->n_subscribers];
+        node = bst_find(clients, handle->subscribers[client->index]);
+        if (node && node->data)
+        {
+            ((wfifo_client_t *)node->data)->index = client->index;
+        }
+    }
+    if (handle->n_subscribers == 0 && handle->hash != generic_hash)
+    {
+        handle->idle_since = now_ms();
+        n_idle++;
+    }
+    free(client);
+    clients = bst_delete(clients, cid);
+}
+
+/**
+ * @brief Move size bytes from a pipe to the hotline with splice(),
+ * copy them if the kernel does not support splicing to the socket
+ */
+static int splice_all(int in, int out, size_t size)
+{
+    ssize_t status;
+    char buff[BUFFLEN];
+    while (size > 0)
+    {
+        if (zero_copy)
+        {
+            status = splice(in, NULL, out, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (status == -1 && (errno == EINVAL || errno == ENOSYS))
+            {
+                M_LOG(MODULE_NAME, "splice() is not supported on the hotline, fall back to copy");
+                zero_copy = 0;
+                continue;
+            }
+        }
+        else
+        {
+            status = read(in, buff, size > sizeof(buff) ? sizeof(buff) : size);
+            if (status > 0 && write(out, buff, status) != status)
+            {
+                status = -1;
+            }
+        }
+        if (status == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            M_ERROR(MODULE_NAME, "Unable to forward FIFO data to the hotline: %s", strerror(errno));
+            return -1;
+        }
+        if (status == 0)
+        {
+            M_ERROR(MODULE_NAME, "FIFO data is shorter than expected");
+            return -1;
+        }
+        size -= status;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the FIFO until it is empty or the buffer is full
+ *
+ * @return read size
+ */
+static int fifo_read(int ffd, uint8_t *buffer, int capacity)
+{
+    int size = 0;
+    int status;
+    while (size < capacity)
+    {
+        status = read(ffd, buffer + size, capacity - size);
+        if (status == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                M_ERROR(MODULE_NAME, "Unable to read data from the FIFO %d: %s", ffd, strerror(errno));
+            }
+            break;
+        }
+        if (status == 0)
+        {
+            break;
+        }
+        size += status;
+    }
+    return size;
+}
+
+static void fifo_send(int fd, const uint16_t *ids, int n, uint8_t *data, int size)
+{
+    int i;
+    tunnel_msg_t msg;
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.size = size;
+    msg.data = data;
+    for (i = 0; i < n; i++)
+    {
+        msg.header.client_id = ids[i];
+        if (msg_write(fd, &msg) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to write data message to client %d", msg.header.client_id);
+        }
+        M_DEBUG(MODULE_NAME, "Message sent to client %d", msg.header.client_id);
+    }
+}
 
-    msg->header.client_id = node->key;
-    if (msg_write(*fd, msg) == -1)
+/**
+ * @brief Read the FIFO until it is empty or a frame is full and send
+ * the frame to the subscribers
+ *
+ * @return forwarded size, 0 if the FIFO is empty
+ */
+static int fifo_copy(int fd, wfifo_handle_t *handle)
+{
+    // coalesce the pending data in one frame
+    int size = fifo_read(handle->fd, frame_buffer, max_frame);
+    if (size > 0)
     {
-        M_ERROR(MODULE_NAME, "Unable to write data message to client %d", node->key);
+        fifo_send(fd, handle->subscribers, handle->n_subscribers, frame_buffer, size);
     }
-    M_DEBUG(MODULE_NAME, "Message sent to client %d", node->key);
+    return size;
+}
+
+/**
+ * @brief Split the buffered data into records (newline delimited or
+ * 4 bytes length prefixed) and send them to the clients one per frame, or
+ * batched in frames holding only complete records (delimiter/prefix kept)
+ *
+ * @param ffd descriptor the data comes from, for the logs
+ * @param skip rest of an oversized record to drop, updated
+ * @return consumed size, the rest is a partial record
+ */
+static int fifo_records(int fd, const uint16_t *ids, int n, uint8_t *buffer, int size, int *skip, int ffd)
+{
+    int offset, start, len;
+    uint32_t net32;
+    uint8_t *end;
+    offset = 0;
+    start = 0;
+    while (offset < size)
+    {
+        if (*skip > 0)
+        {
+            // rest of an oversized record
+            len = size - offset < *skip ? size - offset : *skip;
+            *skip -= len;
+            offset += len;
+            start = offset;
+            continue;
+        }
+        if (framing == FRAMING_LINE)
+        {
+            end = (uint8_t *)memchr(buffer + offset, '\n', size - offset);
+            if (end == NULL)
+            {
+                if (offset == 0 && size == max_frame)
+                {
+                    // the line does not fit in a frame, forward it as is
+                    fifo_send(fd, ids, n, buffer, size);
+                    offset = start = size;
+                }
+                break;
+            }
+            len = end - (buffer + offset);
+            if (!batch)
+            {
+                fifo_send(fd, ids, n, buffer + offset, len);
+            }
+            offset += len + 1;
+        }
+        else
+        {
+            if (size - offset < (int)sizeof(net32))
+            {
+                break;
+            }
+            (void)memcpy(&net32, buffer + offset, sizeof(net32));
+            len = (int)ntohl(net32);
+            if (len < 0)
+            {
+                // no record is that large, the stream is out of sync
+                M_ERROR(MODULE_NAME, "Corrupt length prefix on FIFO %d, %d buffered bytes dropped", ffd, size - offset);
+                if (batch && offset > start)
+                {
+                    fifo_send(fd, ids, n, buffer + start, offset - start);
+                }
+                offset = start = size;
+                break;
+            }
+            if (len > max_frame - (int)sizeof(net32))
+            {
+                M_ERROR(MODULE_NAME, "Record of %d bytes on FIFO %d exceeds the max frame size, dropped", len, ffd);
+                if (batch && offset > start)
+                {
+                    fifo_send(fd, ids, n, buffer + start, offset - start);
+                }
+                *skip = len;
+                offset += sizeof(net32);
+                start = offset;
+                continue;
+            }
+            if (offset + (int)sizeof(net32) + len > size)
+            {
+                break;
+            }
+            if (!batch)
+            {
+                fifo_send(fd, ids, n, buffer + offset + sizeof(net32), len);
+            }
+            offset += sizeof(net32) + len;
+        }
+    }
+    if (batch && offset > start)
+    {
+        fifo_send(fd, ids, n, buffer + start, offset - start);
+    }
+    return offset;
+}
+
+/**
+ * @brief Reassemble the FIFO data into records and send them to the
+ * subscribers, see fifo_records()
+ *
+ * @return read size, 0 if the FIFO is empty
+ */
+static int fifo_framed(int fd, wfifo_handle_t *handle)
+{
+    int size, offset;
+    if (handle->buffer == NULL)
+    {
+        handle->buffer = (uint8_t *)malloc(max_frame);
+        if (handle->buffer == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate record buffer of FIFO %d: %s", handle->fd, strerror(errno));
+            return fifo_copy(fd, handle);
+        }
+    }
+    size = fifo_read(handle->fd, handle->buffer + handle->size, max_frame - handle->size);
+    if (size == 0)
+    {
+        return 0;
+    }
+    handle->size += size;
+    offset = fifo_records(fd, handle->subscribers, handle->n_subscribers, handle->buffer, handle->size, &handle->skip,
+                          handle->fd);
+    // keep the partial record
+    handle->size -= offset;
+    if (handle->size > 0 && offset > 0)
+    {
+        (void)memmove(handle->buffer, handle->buffer + offset, handle->size);
+    }
+    return size;
+}
+
+/**
+ * @brief Send a batch to the subscribers from the first one on through
+ * user space, when tee() could not duplicate all of it: the partial copy
+ * is dropped and the batch is read from the FIFO
+ *
+ * @return forwarded size, -1 on hotline error
+ */
+static int fifo_tee_fallback(int fd, wfifo_handle_t *handle, int first, int size, int teed)
+{
+    tunnel_msg_t msg;
+    int offset = 0;
+    int n;
+    while (teed > 0)
+    {
+        n = read(tee_pipe[0], frame_buffer, teed);
+        if (n <= 0)
+        {
+            break;
+        }
+        teed -= n;
+    }
+    // the batch is in the FIFO, tee() does not consume it
+    while (offset < size)
+    {
+        n = read(handle->fd, frame_buffer + offset, size - offset);
+        if (n <= 0)
+        {
+            M_ERROR(MODULE_NAME, "Unable to read FIFO %d: %s", handle->fd, strerror(errno));
+            break;
+        }
+        offset += n;
+    }
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.size = offset;
+    msg.data = frame_buffer;
+    for (; offset > 0 && first < handle->n_subscribers; first++)
+    {
+        msg.header.client_id = handle->subscribers[first];
+        if (msg_write(fd, &msg) == -1)
+        {
+            return -1;
+        }
+    }
+    return offset;
+}
+
+/**
+ * @brief Forward the available FIFO data to its subscribers without
+ * copying it to user space: the payload is spliced directly to the hotline
+ * for the last subscriber and duplicated with tee() for the others
+ *
+ * @return forwarded size, 0 if the FIFO is empty, -1 on hotline error
+ */
+static int fifo_splice(int fd, wfifo_handle_t *handle)
+{
+    int available = 0;
+    int size, status, i;
+    int ffd = handle->fd;
+    tunnel_msg_t msg;
+    if (ioctl(ffd, FIONREAD, &available) == -1)
+    {
+        return fifo_copy(fd, handle);
+    }
+    if (available <= 0)
+    {
+        return 0;
+    }
+    size = available > max_frame ? max_frame : available;
+    if (handle->n_subscribers > 1)
+    {
+        if (tee_pipe[0] == -1)
+        {
+            if (pipe(tee_pipe) == -1)
+            {
+                M_ERROR(MODULE_NAME, "Unable to create tee pipe: %s", strerror(errno));
+                zero_copy = 0;
+                return fifo_copy(fd, handle);
+            }
+            (void)fcntl(tee_pipe[1], F_SETPIPE_SZ, fcntl(ffd, F_GETPIPE_SZ));
+        }
+        // all subscribers receive the same amount of data
+        size = tee(ffd, tee_pipe[1], size, 0);
+        if (size <= 0)
+        {
+            M_ERROR(MODULE_NAME, "Unable to tee FIFO %d: %s", ffd, strerror(errno));
+            zero_copy = 0;
+            return fifo_copy(fd, handle);
+        }
+    }
+    msg.header.type = CHANNEL_DATA;
+    msg.header.channel_id = 0;
+    msg.header.size = size;
+    for (i = 0; i < handle->n_subscribers; i++)
+    {
+        // a copy for each subscriber but the last one, it may be short
+        // when the tee pipe is smaller than the FIFO
+        if (i > 0 && i < handle->n_subscribers - 1 && (status = tee(ffd, tee_pipe[1], size, 0)) != size)
+        {
+            return fifo_tee_fallback(fd, handle, i, size, status);
+        }
+        msg.header.client_id = handle->subscribers[i];
+        if (msg_write_header(fd, &msg) == -1)
+        {
+            return -1;
+        }
+        if (i == handle->n_subscribers - 1)
+        {
+            // the last subscriber consumes the FIFO
+            status = splice_all(ffd, fd, size);
+        }
+        else
+        {
+            status = splice_all(tee_pipe[0], fd, size);
+        }
+        if (status == -1 || msg_write_end(fd) == -1)
+        {
+            return -1;
+        }
+        M_DEBUG(MODULE_NAME, "%d bytes spliced to client %d", size, msg.header.client_id);
+    }
+    return size;
 }
 
 static void prepare_fd_set(bst_node_t *node, void **argv, int argc)
@@ -54,42 +574,197 @@ static void prepare_fd_set(bst_node_t *node, void **argv, int argc)
     (void)argc;
     fd_set* fd_in = (fd_set *)argv[1];
     int* max_fd = (int*) argv[2];
-    if(!node || ! node->data)
+    fd_set* fd_out = (fd_set *)argv[3];
+    wfifo_handle_t *handle = (wfifo_handle_t *)node->data;
+    if(!node || !handle)
     {
         return;
     }
-    FD_SET((int)node->data, fd_in);
-    *max_fd = (int)node->data > *max_fd? (int)node->data: *max_fd;
+    if (fifo_mode == 'r')
+    {
+        FD_SET(handle->fd, fd_in);
+    }
+    else if (handle->queued > 0)
+    {
+        FD_SET(handle->fd, fd_out);
+    }
+    else
+    {
+        return;
+    }
+    *max_fd = handle->fd > *max_fd? handle->fd: *max_fd;
+}
+
+/**
+ * @brief Write the queued data of a FIFO until it would block
+ *
+ * @return -1 on write error
+ */
+static int fifo_flush_queue(wfifo_handle_t *handle)
+{
+    int status;
+    while (handle->queued > 0)
+    {
+        status = write(handle->fd, handle->queue + handle->queue_head, handle->queued);
+        if (status == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            M_ERROR(MODULE_NAME, "Unable to write data to the FIFO %d: %s", handle->fd, strerror(errno));
+            handle->queued = 0;
+            handle->queue_head = 0;
+            return -1;
+        }
+        handle->queue_head += status;
+        handle->queued -= status;
+    }
+    if (handle->queued == 0)
+    {
+        handle->queue_head = 0;
+    }
+    return 0;
+}
+
+/**
+ * @return free bytes in the pipe of the FIFO, 0 if unknown
+ */
+static int fifo_room(int fd)
+{
+    int unread = 0;
+    int capacity = fcntl(fd, F_GETPIPE_SZ);
+    if (capacity == -1 || ioctl(fd, FIONREAD, &unread) == -1 || unread >= capacity)
+    {
+        return 0;
+    }
+    return capacity - unread;
+}
+
+/**
+ * @brief Write client data to a FIFO, the part that can not be written
+ * without blocking is queued
+ *
+ * @return -1 if the queue is full, -2 on write error
+ */
+static int fifo_write(wfifo_handle_t *handle, uint8_t *data, int size)
+{
+    int status = 0;
+    // only what the FIFO does not take right away is queued, a message is
+    // refused as a whole so that it is never written in part
+    if (handle->queued > 0 ? handle->queued + size > queue_size
+                           : size > queue_size && size - fifo_room(handle->fd) > queue_size)
+    {
+        return -1;
+    }
+    if (handle->queued == 0)
+    {
+        while (status < size)
+        {
+            int ret = write(handle->fd, data + status, size - status);
+            if (ret == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                M_ERROR(MODULE_NAME, "Unable to write data to the FIFO %d: %s", handle->fd, strerror(errno));
+                return -2;
+            }
+            status += ret;
+        }
+        if (status == size)
+        {
+            return 0;
+        }
+        // the reader took less than fifo_room() promised
+        if (size - status > queue_size)
+        {
+            if (status == 0)
+            {
+                return -1;
+            }
+            M_ERROR(MODULE_NAME, "FIFO %d took %d bytes of a %d bytes message, the rest is dropped", handle->fd, status,
+                    size);
+            return -2;
+        }
+    }
+    if (handle->queue == NULL)
+    {
+        handle->queue = (uint8_t *)malloc(queue_size);
+        if (handle->queue == NULL)
+        {
+            M_ERROR(MODULE_NAME, "Unable to allocate output queue of FIFO %d: %s", handle->fd, strerror(errno));
+            return -2;
+        }
+    }
+    if (handle->queue_head + handle->queued + size - status > queue_size)
+    {
+        (void)memmove(handle->queue, handle->queue + handle->queue_head, handle->queued);
+        handle->queue_head = 0;
+    }
+    (void)memcpy(handle->queue + handle->queue_head + handle->queued, data + status, size - status);
+    handle->queued += size - status;
+    return 0;
+}
+
+static void monitor_fifo_queues(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    fd_set *fd_out = (fd_set *)argv[1];
+    wfifo_handle_t *handle = (wfifo_handle_t *)node->data;
+    if (handle && handle->queued > 0 && FD_ISSET(handle->fd, fd_out))
+    {
+        (void)fifo_flush_queue(handle);
+    }
 }
 
 static void monitor_fifo_handles(bst_node_t *node, void **argv, int argc)
 {
     (void)argc;
-    int ffd, status;
+    int status, budget;
     int* fd;
     fd_set* fd_in = (fd_set *)argv[1];
-    tunnel_msg_t* msg = (tunnel_msg_t*) argv[2];
-    void * fargv[3];
+    wfifo_handle_t *handle = (wfifo_handle_t *)node->data;
     fd = (int*) argv[0];
-    if(!node || ! node->data)
+    if(!node || !handle)
     {
         return;
     }
-    ffd = (int) node->data;
-    if(FD_ISSET(ffd, fd_in))
+    if(FD_ISSET(handle->fd, fd_in))
     {
-        if ((status = read(ffd, msg->data, BUFFLEN)) == -1)
-        {
-            M_ERROR(MODULE_NAME, "Unable to read data from the FIFO %d: %s", ffd, strerror(errno));
-            return;
-        }
-        else
+        // drain the FIFO until it is empty or the budget is used
+        for (budget = read_budget; budget > 0 && running; budget -= status)
         {
-            msg->header.size = status;
-            fargv[0] = argv[0];
-            fargv[1] = &ffd;
-            fargv[2] = argv[2];
-            bst_for_each(clients, send_data, fargv, 2);
+            if (framing != FRAMING_RAW)
+            {
+                status = fifo_framed(*fd, handle);
+            }
+            else if (zero_copy && handle->n_subscribers > 0)
+            {
+                status = fifo_splice(*fd, handle);
+            }
+            else
+            {
+                status = fifo_copy(*fd, handle);
+            }
+            if (status == -1)
+            {
+                M_ERROR(MODULE_NAME, "Unable to forward data of FIFO %d to the hotline. quit", handle->fd);
+                running = 0;
+            }
+            if (status <= 0)
+            {
+                break;
+            }
         }
     }
 }
@@ -111,24 +786,166 @@ static void close_fifo_handles(bst_node_t *node, void **args, int argc)
 {
     (void)argc;
     (void) args;
-    if(!node || !node->data)
+    wfifo_handle_t *handle = (wfifo_handle_t *)node->data;
+    if(!node || !handle)
     {
         return;
     }
-    if((int) node->data > 0)
+    if(handle->fd > 0)
+    {
+        M_DEBUG(MODULE_NAME, "Close fifo handle %d", handle->fd);
+        (void) close(handle->fd);
+    }
+    free(handle->subscribers);
+    if (handle->buffer)
+    {
+        free(handle->buffer);
+    }
+    if (handle->queue)
+    {
+        free(handle->queue);
+    }
+    free(handle);
+    node->data = NULL;
+}
+
+static void free_clients(bst_node_t *node, void **args, int argc)
+{
+    (void)argc;
+    (void)args;
+    if (node->data)
+    {
+        free(node->data);
+        node->data = NULL;
+    }
+}
+
+static void close_idle_handles(bst_node_t *node, void **argv, int argc)
+{
+    (void)argc;
+    list_t *expired = (list_t *)argv[0];
+    unsigned long long *now = (unsigned long long *)argv[1];
+    unsigned long long *deadline = (unsigned long long *)argv[2];
+    wfifo_handle_t *handle = (wfifo_handle_t *)node->data;
+    // pending output is written before the FIFO is closed
+    if (!handle || !handle->idle_since || handle->queued > 0)
+    {
+        return;
+    }
+    if (*now >= handle->idle_since + idle_timeout)
+    {
+        list_put_i(expired, node->key);
+    }
+    else if (*deadline == 0 || handle->idle_since + idle_timeout < *deadline)
+    {
+        *deadline = handle->idle_since + idle_timeout;
+    }
+}
+
+/**
+ * @brief Close the per-user FIFOs idle for longer than idle_timeout,
+ * the FIFO files are kept and reused on the next subscription
+ *
+ * @return time (ms) until the next idle FIFO expires, -1 if none
+ */
+static long long expire_fifo_handles()
+{
+    list_t expired;
+    item_t item;
+    bst_node_t *node;
+    unsigned long long now, deadline = 0;
+    void *argv[3];
+    if (n_idle == 0)
+    {
+        return -1;
+    }
+    now = now_ms();
+    expired = list_init();
+    argv[0] = (void *)&expired;
+    argv[1] = (void *)&now;
+    argv[2] = (void *)&deadline;
+    bst_for_each(fifo_handles, close_idle_handles, argv, 3);
+    list_for_each(item, expired)
+    {
+        node = bst_find(fifo_handles, item->value.i);
+        if (node && node->data)
+        {
+            close_fifo_handles(node, NULL, 0);
+            fifo_handles = bst_delete(fifo_handles, item->value.i);
+            n_idle--;
+        }
+    }
+    list_free(&expired);
+    return deadline == 0 ? -1 : (long long)(deadline - now);
+}
+
+/**
+ * @brief Get the uid of a user, the user database is queried only
+ * on the first lookup of a name
+ */
+static int lookup_uid(const char *user, uid_t *uid)
+{
+    int hash = simple_hash(user);
+    bst_node_t *node = bst_find(users, hash);
+    wfifo_user_t *entry;
+    struct passwd *pwd;
+    if (node && node->data && EQU(((wfifo_user_t *)node->data)->name, user))
+    {
+        *uid = ((wfifo_user_t *)node->data)->uid;
+        return 0;
+    }
+    errno = 0;
+    pwd = getpwnam(user);
+    if (pwd == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to get userid from user %s: %s", user, errno ? strerror(errno) : "no such user");
+        return -1;
+    }
+    *uid = pwd->pw_uid;
+    // on hash collision the second name is simply not cached
+    if (node == NULL && strlen(user) < MAX_USER_NAME)
+    {
+        entry = (wfifo_user_t *)malloc(sizeof(wfifo_user_t));
+        if (entry)
+        {
+            (void)strcpy(entry->name, user);
+            entry->uid = *uid;
+            users = bst_insert(users, hash, entry);
+        }
+    }
+    return 0;
+}
+
+static wfifo_handle_t *new_fifo_handle(int fd, int hash)
+{
+    wfifo_handle_t *handle = (wfifo_handle_t *)malloc(sizeof(wfifo_handle_t));
+    if (handle == NULL)
     {
-        M_DEBUG(MODULE_NAME, "Close fifo handle %d", (int)node->data);
-        (void) close((int) node->data);
+        return NULL;
     }
+    handle->fd = fd;
+    handle->hash = hash;
+    handle->subscribers = NULL;
+    handle->n_subscribers = 0;
+    handle->capacity = 0;
+    handle->buffer = NULL;
+    handle->size = 0;
+    handle->skip = 0;
+    handle->queue = NULL;
+    handle->queue_head = 0;
+    handle->queued = 0;
+    handle->idle_since = 0;
+    return handle;
 }
 
-int init_fifo(char *buff, const char *base, const char *user)
+wfifo_handle_t *init_fifo(char *buff, const char *base, const char *user)
 {
     int fd, hash;
+    wfifo_handle_t *handle;
     int generic_fd = 1;
+    int created = 0;
     struct stat path_stat;
-    uid_t uid;
-    struct passwd *pwd = NULL;
+    uid_t uid = 0;
     bst_node_t * node;
     (void)memset(buff, 0, BUFFLEN);
     if (stat(base, &path_stat) == 0)
@@ -140,17 +957,14 @@ int init_fifo(char *buff, const char *base, const char *user)
             if (user == NULL)
             {
                 M_ERROR(MODULE_NAME, "Cannot init fifo for null user");
-                return -1;
+                return NULL;
             }
             (void)snprintf(buff, BUFFLEN, "%s/%s.fifo", base, user);
             generic_fd = 0;
-            pwd = getpwnam(user); /* Try getting UID for username */
-            if (pwd == NULL)
+            if (lookup_uid(user, &uid) == -1)
             {
-                M_ERROR(MODULE_NAME, "Unable to get userid from user %s: %s", user, strerror(errno));
-                return -1;
+                return NULL;
             }
-            uid = pwd->pw_uid;
         }
         else
         {
@@ -170,56 +984,457 @@ int init_fifo(char *buff, const char *base, const char *user)
     node = bst_find(fifo_handles,hash);
     if(node && node->data)
     {
-        M_DEBUG(MODULE_NAME, "handle for file %s exists (%d)", buff, (int)node->data);
-        return (int) node->data;
+        handle = (wfifo_handle_t *)node->data;
+        M_DEBUG(MODULE_NAME, "handle for file %s exists (%d)", buff, handle->fd);
+        return handle;
     }
-    (void)unlink(buff);
-    if (mkfifo(buff, 0666) == -1)
+    // reuse the FIFO left by an idle close or a previous run
+    if (lstat(buff, &path_stat) != 0 || !S_ISFIFO(path_stat.st_mode) || (!generic_fd && path_stat.st_uid != uid))
     {
-        M_ERROR(MODULE_NAME, "Unable to create FIFO %s: %s", buff, strerror(errno));
-        return -1;
+        created = 1;
+        (void)unlink(buff);
+        if (mkfifo(buff, 0666) == -1)
+        {
+            M_ERROR(MODULE_NAME, "Unable to create FIFO %s: %s", buff, strerror(errno));
+            return NULL;
+        }
     }
     fd = open(buff, O_RDWR);
     if (fd == -1)
     {
         M_ERROR(MODULE_NAME, "Unable to open FIFO %s: %s", buff, strerror(errno));
-        return -1;
+        return NULL;
+    }
+    if (pipe_size > 0 && fcntl(fd, F_SETPIPE_SZ, pipe_size) == -1)
+    {
+        M_ERROR(MODULE_NAME, "Unable to set FIFO %s size to %d: %s", buff, pipe_size, strerror(errno));
     }
-    if (!generic_fd)
+    // read mode drains the FIFO until empty, write mode queues what would block
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (!generic_fd && created)
     {
         // chown file by user
         if (chown(buff, uid, -1) == -1)
         {
             M_ERROR(MODULE_NAME, "Unable to change ownerfor file %s to %s: %s", buff, user, strerror(errno));
             (void) close(fd);
+            return NULL;
+        }
+    }
+    handle = new_fifo_handle(fd, hash);
+    if (handle == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate handle for FIFO %s: %s", buff, strerror(errno));
+        (void) close(fd);
+        return NULL;
+    }
+    if (user == NULL)
+    {
+        generic_hash = hash;
+    }
+    else if (hash != generic_hash)
+    {
+        // idle until the first subscription succeeds
+        handle->idle_since = now_ms();
+        n_idle++;
+    }
+    fifo_handles = bst_insert(fifo_handles, hash, handle);
+    M_LOG(MODULE_NAME, "FIFO: %s opened", buff);
+    return handle;
+}
+/**
+ * @brief Tail a regular file: data appended after startup is forwarded
+ * to the subscribers, the file may not exist yet
+ */
+static wfifo_handle_t *init_tail(const char *path)
+{
+    int ffd;
+    wfifo_handle_t *handle;
+    tail_path = path;
+    tail_fd = tail_init(path);
+    if (tail_fd == -1)
+    {
+        return NULL;
+    }
+    ffd = tail_open();
+    if (ffd != -1)
+    {
+        (void)lseek(ffd, 0, SEEK_END);
+    }
+    handle = new_fifo_handle(ffd, simple_hash(path));
+    if (handle == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate handle for %s: %s", path, strerror(errno));
+        if (ffd != -1)
+        {
+            (void)close(ffd);
+        }
+        return NULL;
+    }
+    generic_hash = handle->hash;
+    fifo_handles = bst_insert(fifo_handles, handle->hash, handle);
+    return handle;
+}
+
+/**
+ * @brief Forward the data appended to the file since the last call,
+ * spliced for each subscriber in zero copy mode
+ *
+ * @return forwarded size, 0 at the end of file, -1 on hotline error
+ */
+static int tail_splice(int fd, wfifo_handle_t *handle)
+{
+    struct stat st;
+    off_t pos;
+    int size, i, status;
+    pos = lseek(handle->fd, 0, SEEK_CUR);
+    if (pos == -1 || fstat(handle->fd, &st) == -1 || st.st_size <= pos)
+    {
+        return 0;
+    }
+    size = st.st_size - pos > max_frame ? max_frame : (int)(st.st_size - pos);
+    for (i = 0; i < handle->n_subscribers; i++)
+    {
+        status = tail_send(fd, handle->subscribers[i], handle->fd, pos, size, zero_copy);
+        if (status == -1)
+        {
+            return -1;
+        }
+        if (status == TAIL_SHORT)
+        {
+            // truncated meanwhile, the next check restarts from offset 0
+            if (i == 0)
+            {
+                return 0;
+            }
+            break;
+        }
+    }
+    (void)lseek(handle->fd, pos + size, SEEK_SET);
+    return size;
+}
+
+/**
+ * @brief tail_sender_t of the raw catch-up
+ */
+static int tail_send_raw(int fd, uint16_t client_id, int ffd, off_t offset, int size)
+{
+    int status = tail_send(fd, client_id, ffd, offset, size, zero_copy);
+    if (status == -1)
+    {
+        return -1;
+    }
+    return status == TAIL_SHORT ? 0 : size;
+}
+
+/**
+ * @brief tail_sender_t of the framed catch-up: the data is split into
+ * records as the live data is, an oversized record is skipped as a whole
+ */
+static int tail_send_records(int fd, uint16_t client_id, int ffd, off_t offset, int size)
+{
+    ssize_t status;
+    int got = 0;
+    int skip = 0;
+    int consumed;
+    while (got < size)
+    {
+        status = pread(ffd, frame_buffer + got, size - got, offset + got);
+        if (status == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (status <= 0)
+        {
+            break;
+        }
+        got += status;
+    }
+    if (got == 0)
+    {
+        return 0;
+    }
+    consumed = fifo_records(fd, &client_id, 1, frame_buffer, got, &skip, ffd);
+    return consumed + skip;
+}
+
+static int tail_forward(int fd, wfifo_handle_t *handle, int budget)
+{
+    int status, forwarded = 0;
+    while (forwarded < budget)
+    {
+        if (framing != FRAMING_RAW)
+        {
+            status = fifo_framed(fd, handle);
+        }
+        else if (zero_copy && handle->n_subscribers > 0)
+        {
+            status = tail_splice(fd, handle);
+        }
+        else
+        {
+            status = fifo_copy(fd, handle);
+        }
+        if (status == -1)
+        {
             return -1;
         }
+        if (status == 0)
+        {
+            break;
+        }
+        forwarded += status;
     }
-    fifo_handles = bst_insert(fifo_handles, hash, (void*)fd);
-    M_LOG(MODULE_NAME, "FIFO: %s created", buff);
-    return fd;
+    return forwarded;
+}
+
+/**
+ * @brief Position up to which the file was forwarded, a partial
+ * record kept in framed mode is not forwarded yet
+ */
+static off_t tail_position(wfifo_handle_t *handle)
+{
+    off_t pos = lseek(handle->fd, 0, SEEK_CUR);
+    return pos == -1 ? 0 : pos - handle->size;
 }
+
+static void tail_restart(wfifo_handle_t *handle)
+{
+    handle->size = 0;
+    handle->skip = 0;
+    tail_seek_reset();
+}
+
+/**
+ * @brief Handle the file changes then forward the appended data to the
+ * live subscribers and one batch to each client catching up
+ *
+ * @return non zero if data remains to be forwarded
+ */
+static int monitor_tail(int fd, wfifo_handle_t *handle)
+{
+    int ffd, flags, forwarded;
+    int pending;
+    list_t done;
+    item_t item;
+    (void)tail_events();
+    if (handle->fd == -1)
+    {
+        handle->fd = tail_open();
+        if (handle->fd == -1)
+        {
+            return 0;
+        }
+        tail_restart(handle);
+    }
+    flags = tail_check(handle->fd, lseek(handle->fd, 0, SEEK_CUR));
+    if (flags & TAIL_ROTATED)
+    {
+        // what was appended to the old file is forwarded first
+        (void)tail_forward(fd, handle, INT_MAX);
+        ffd = tail_open();
+        if (ffd != -1)
+        {
+            M_LOG(MODULE_NAME, "%s was rotated", tail_path);
+            (void)close(handle->fd);
+            handle->fd = ffd;
+            tail_restart(handle);
+        }
+    }
+    else if (flags & TAIL_TRUNCATED)
+    {
+        M_LOG(MODULE_NAME, "%s was truncated", tail_path);
+        (void)lseek(handle->fd, 0, SEEK_SET);
+        tail_restart(handle);
+    }
+    forwarded = tail_forward(fd, handle, read_budget);
+    if (forwarded == -1)
+    {
+        return -1;
+    }
+    done = list_init();
+    pending = tail_seek_step(fd, handle->fd, tail_position(handle), max_frame, read_budget,
+                             framing == FRAMING_RAW ? tail_send_raw : tail_send_records, &done);
+    // the clients that caught up receive the live data from now on
+    list_for_each(item, done)
+    {
+        if (fifo_subscribe(handle, item->value.i) == 0)
+        {
+            M_DEBUG(MODULE_NAME, "Client %d caught up with %s", item->value.i, tail_path);
+        }
+    }
+    list_free(&done);
+    if (pending == -1)
+    {
+        return -1;
+    }
+    return pending || forwarded >= read_budget;
+}
+
+/**
+ * @brief First line start at or after offset, end if no line starts
+ * before the live position
+ */
+static off_t tail_line_start(int ffd, off_t offset, off_t end)
+{
+    char buff[BUFFLEN];
+    ssize_t status;
+    char *nl;
+    // offset is a line start if the previous byte ends a line
+    offset--;
+    while (offset < end)
+    {
+        status = pread(ffd, buff, end - offset > (off_t)sizeof(buff) ? (off_t)sizeof(buff) : end - offset, offset);
+        if (status == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (status <= 0)
+        {
+            break;
+        }
+        nl = (char *)memchr(buff, '\n', status);
+        if (nl)
+        {
+            return offset + (nl - buff) + 1;
+        }
+        offset += status;
+    }
+    return end;
+}
+
+/**
+ * @brief CTRL seek request: [0x01][whence][value u64], the client
+ * receives the file from the requested offset then the live data.
+ * The reply is [0x01][start u64][end u64]
+ *
+ * With line framing the start moves to the next line start. With length
+ * framing the offset must be a record start and the last N bytes cannot
+ * be requested, they do not start on a known record.
+ */
+static int tail_ctrl(int fd, tunnel_msg_t *msg, char *buff)
+{
+    uint64_t value = 0;
+    off_t start, end;
+    int i;
+    tunnel_msg_t reply;
+    if (msg->header.size < 10 || msg->data[0] != TAIL_CTRL_SEEK || tail_handle == NULL || tail_handle->fd == -1)
+    {
+        return 0;
+    }
+    reply.header.channel_id = msg->header.channel_id;
+    reply.header.client_id = msg->header.client_id;
+    reply.data = (uint8_t *)buff;
+    if (framing == FRAMING_LENGTH && msg->data[1] == TAIL_SEEK_LAST)
+    {
+        (void)snprintf(buff, BUFFLEN, "Seek from the end is not supported with length framing");
+        reply.header.type = CHANNEL_ERROR;
+        reply.header.size = strlen(buff);
+        return msg_write(fd, &reply) == -1 ? -1 : 0;
+    }
+    for (i = 0; i < 8; i++)
+    {
+        value = (value << 8) | msg->data[2 + i];
+    }
+    end = tail_position(tail_handle);
+    start = tail_seek(msg->header.client_id, msg->data[1], value, end);
+    if (start == -1)
+    {
+        return 0;
+    }
+    if (framing == FRAMING_LINE && start > 0)
+    {
+        start = tail_seek(msg->header.client_id, TAIL_SEEK_OFFSET, tail_line_start(tail_handle->fd, start, end), end);
+    }
+    // the client leaves the live list until it catches up
+    fifo_unsubscribe(msg->header.client_id);
+    buff[0] = TAIL_CTRL_SEEK;
+    for (i = 0; i < 8; i++)
+    {
+        buff[1 + i] = (uint8_t)((uint64_t)start >> (56 - 8 * i));
+        buff[9 + i] = (uint8_t)((uint64_t)end >> (56 - 8 * i));
+    }
+    reply.header.type = CHANNEL_CTRL;
+    reply.header.size = 17;
+    return msg_write(fd, &reply) == -1 ? -1 : 1;
+}
+
 int main(int argc, char **argv)
 {
-    int fd, ffd;
+    int fd;
+    wfifo_handle_t *handle;
     tunnel_msg_t msg;
-    fd_set fd_in;
+    fd_set fd_in, fd_out;
     int status, maxfd;
+    long long expire;
+    int tail_pending = 0;
+    struct timeval timeout;
     char buff[BUFFLEN + 1];
-    void *fargv[3];
+    char user[MAX_USER_NAME];
+    void *fargv[4];
     bst_node_t* node = NULL;
     uint8_t *tmp;
     LOG_INIT(MODULE_NAME);
 
     if (argc != 5)
     {
-        M_LOG(MODULE_NAME, "Usage: %s path/to/hotline/socket channel_name input_file r/w\n", argv[0]);
-        printf("Usage: %s path/to/hotline/socket channel_name input_file r/w\n", argv[0]);
+        M_LOG(MODULE_NAME, "Usage: %s path/to/hotline/socket channel_name input_file r/w/t\n", argv[0]);
+        printf("Usage: %s path/to/hotline/socket channel_name input_file r/w/t\n", argv[0]);
         return -1;
     }
     signal(SIGPIPE, SIG_IGN);
     signal(SIGABRT, SIG_IGN);
     signal(SIGINT, int_handler);
+    if (getenv("zero_copy") != NULL)
+    {
+        zero_copy = atoi(getenv("zero_copy"));
+    }
+    if (getenv("pipe_size") != NULL)
+    {
+        pipe_size = atoi(getenv("pipe_size"));
+    }
+    if (getenv("read_budget") != NULL && atoi(getenv("read_budget")) > 0)
+    {
+        read_budget = atoi(getenv("read_budget"));
+    }
+    if (getenv("max_frame") != NULL && atoi(getenv("max_frame")) > 0)
+    {
+        max_frame = atoi(getenv("max_frame"));
+    }
+    if (getenv("framing") != NULL)
+    {
+        if (EQU(getenv("framing"), "line"))
+        {
+            framing = FRAMING_LINE;
+        }
+        else if (EQU(getenv("framing"), "length"))
+        {
+            framing = FRAMING_LENGTH;
+        }
+    }
+    if (getenv("batch") != NULL)
+    {
+        batch = atoi(getenv("batch"));
+    }
+    if (getenv("queue_size") != NULL && atoi(getenv("queue_size")) > 0)
+    {
+        queue_size = atoi(getenv("queue_size"));
+    }
+    if (getenv("overflow") != NULL && EQU(getenv("overflow"), "drop"))
+    {
+        overflow = OVERFLOW_DROP;
+    }
+    if (getenv("idle_timeout") != NULL)
+    {
+        idle_timeout = (unsigned long long)atoi(getenv("idle_timeout")) * 1000u;
+    }
+    fifo_mode = argv[4][0];
+    frame_buffer = (uint8_t *)malloc(max_frame);
+    if (frame_buffer == NULL)
+    {
+        M_ERROR(MODULE_NAME, "Unable to allocate frame buffer: %s", strerror(errno));
+        return -1;
+    }
 
     // now try to request new channel from hotline
     fd = open_socket(argv[1]);
@@ -268,19 +1483,44 @@ int main(int argc, char **argv)
      * If the publisher is configured to be user base fifo,
      * a error LOG will be shown
      */
-    (void)init_fifo(buff, argv[3], NULL);
+    if (argv[4][0] == 't')
+    {
+        tail_handle = init_tail(argv[3]);
+        if (tail_handle == NULL)
+        {
+            running = 0;
+        }
+    }
+    else
+    {
+        (void)init_fifo(buff, argv[3], NULL);
+    }
 
     fargv[0] = (void *)&fd;
     // now read data
     while (running)
     {
+        expire = expire_fifo_handles();
+        if (tail_pending)
+        {
+            expire = 0;
+        }
+        timeout.tv_sec = expire / 1000;
+        timeout.tv_usec = (expire % 1000) * 1000;
         FD_ZERO(&fd_in);
+        FD_ZERO(&fd_out);
         FD_SET(fd, &fd_in);
         fargv[1] = &fd_in;
         maxfd = fd;
         fargv[2] = &maxfd;
-        bst_for_each(fifo_handles, prepare_fd_set, fargv, 3);
-        status = select(maxfd + 1, &fd_in, NULL, NULL, NULL);
+        fargv[3] = &fd_out;
+        bst_for_each(fifo_handles, prepare_fd_set, fargv, 4);
+        if (tail_fd != -1)
+        {
+            FD_SET(tail_fd, &fd_in);
+            maxfd = tail_fd > maxfd ? tail_fd : maxfd;
+        }
+        status = select(maxfd + 1, &fd_in, &fd_out, NULL, expire == -1 ? NULL : &timeout);
 
         switch (status)
         {
@@ -304,33 +1544,65 @@ int main(int argc, char **argv)
                     switch (msg.header.type)
                     {
                     case CHANNEL_SUBSCRIBE:
-                        ffd = init_fifo(buff, argv[3], (char*)msg.data);
-                        if(ffd != -1)
+                        // the user name is not NUL terminated
+                        (void)snprintf(user, sizeof(user), "%.*s", (int)msg.header.size, msg.data ? (char *)msg.data : "");
+                        handle = tail_handle ? tail_handle : init_fifo(buff, argv[3], user);
+                        if(handle != NULL)
                         {
-                            clients = bst_insert(clients, msg.header.client_id, (void*)ffd);
-                            M_LOG(MODULE_NAME, "Client %d subscribes to the chanel", msg.header.client_id);
+                            fifo_unsubscribe(msg.header.client_id);
+                            tail_seek_cancel(msg.header.client_id);
+                            if (fifo_subscribe(handle, msg.header.client_id) == 0)
+                            {
+                                M_LOG(MODULE_NAME, "Client %d subscribes to the chanel", msg.header.client_id);
+                            }
                         }
                         break;
 
                     case CHANNEL_UNSUBSCRIBE:
                         M_LOG(MODULE_NAME, "Client %d unsubscribes to the chanel", msg.header.client_id);
-                        clients = bst_delete(clients, msg.header.client_id);
+                        fifo_unsubscribe(msg.header.client_id);
+                        tail_seek_cancel(msg.header.client_id);
+                        break;
+
+                    case CHANNEL_CTRL:
+                        status = tail_ctrl(fd, &msg, buff);
+                        if (status == -1)
+                        {
+                            M_ERROR(MODULE_NAME, "Unable to write message to hotline");
+                            running = 0;
+                        }
+                        else if (status == 1)
+                        {
+                            tail_pending = 1;
+                        }
                         break;
 
                     case CHANNEL_DATA:
                         if (argv[4][0] == 'w')
                         {
                             node = bst_find(clients, msg.header.client_id);
-                            if(node && node->data)
+                            if(node && node->data && msg.header.size > 0)
                             {
-                                // write data to the FIFO
-                                if (msg.header.size > 0)
+                                // write data to the FIFO, only this client is affected by a stuck consumer
+                                status = fifo_write(((wfifo_client_t *)node->data)->handle, msg.data, msg.header.size);
+                                if (status == -1 && overflow == OVERFLOW_DROP)
+                                {
+                                    M_DEBUG(MODULE_NAME, "FIFO queue of client %d is full, %d bytes dropped", msg.header.client_id, msg.header.size);
+                                }
+                                else if (status != 0)
                                 {
-                                    if (write((int)node->data, msg.data, msg.header.size) == -1)
+                                    (void)snprintf(buff, BUFFLEN, status == -1 ? "FIFO is full, data dropped" : "Unable to write data to the FIFO");
+                                    M_ERROR(MODULE_NAME, "%s: %s(%d)", buff, argv[3], msg.header.client_id);
+                                    msg.header.type = CHANNEL_ERROR;
+                                    msg.header.size = strlen(buff);
+                                    tmp = msg.data;
+                                    msg.data = (uint8_t *)buff;
+                                    if (msg_write(fd, &msg) == -1)
                                     {
-                                        M_ERROR(MODULE_NAME, "Unable to write data to the FIFO %s from client %d: %s", argv[3], msg.header.client_id, strerror(errno));
+                                        M_ERROR(MODULE_NAME, "Unable to write message to hotline");
                                         running = 0;
                                     }
+                                    msg.data = tmp;
                                 }
                             }
                         }
@@ -366,16 +1638,34 @@ int main(int argc, char **argv)
             {
                 // on the fifo side
                 fargv[1] = &fd_in;
-                fargv[2] = &msg;
-                msg.data = (uint8_t *)buff;
-                msg.header.type = CHANNEL_DATA;
-                bst_for_each(fifo_handles, monitor_fifo_handles, fargv, 3);
+                bst_for_each(fifo_handles, monitor_fifo_handles, fargv, 2);
+            }
+            if (argv[4][0] == 'w')
+            {
+                // on the fifo side, drain the output queues
+                fargv[1] = &fd_out;
+                bst_for_each(fifo_handles, monitor_fifo_queues, fargv, 2);
+            }
+        }
+        if (tail_handle && running && (tail_pending || FD_ISSET(tail_fd, &fd_in)))
+        {
+            tail_pending = monitor_tail(fd, tail_handle);
+            if (tail_pending == -1)
+            {
+                M_ERROR(MODULE_NAME, "Unable to forward data of %s to the hotline. quit", argv[3]);
+                running = 0;
             }
         }
     }
     // unsubscribe all client
     bst_for_each(clients, unsubscribe, fargv, 1);
     bst_for_each(fifo_handles, close_fifo_handles, NULL, 0);
+    tail_close();
+    if (tee_pipe[0] != -1)
+    {
+        (void)close(tee_pipe[0]);
+        (void)close(tee_pipe[1]);
+    }
     // close the channel
     M_LOG(MODULE_NAME, "Close the channel %s (%d)", argv[2], fd);
     msg.header.type = CHANNEL_CLOSE;
@@ -389,7 +1679,11 @@ int main(int argc, char **argv)
 
     (void)msg_read(fd, &msg);
     (void)close(fd);
+    bst_for_each(clients, free_clients, NULL, 0);
     bst_free(clients);
     bst_free(fifo_handles);
+    bst_for_each(users, free_clients, NULL, 0);
+    bst_free(users);
+    free(frame_buffer);
     return 0;
 }
\ No newline at end of file